@@ -2,7 +2,7 @@
 
 #define ANSI_ESC '\x1b'
 
-#define ANSI_MAX_NUM_PARAMS 16
+#define ANSI_MAX_NUM_PARAMS 32
 #define ANSI_FINAL_SGR 'm'
 
 #define ANSI_FINAL_CUU 'A'
@@ -36,3 +36,4 @@
 // L
 
 #define ANSI_C1_RI 'M'
+#define ANSI_ST '\\'
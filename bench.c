@@ -0,0 +1,687 @@
+/*
+ * Headless parser benchmark, feeds recorded pty streams or generated ones
+ * through vt_parse() in fixed size chunks.
+ *
+ *   hooktty-bench [-c chunk] [-s size] [-g rows]x[cols] [-t secs]
+ *                 [-m parse|read] [input...]
+ *
+ * An input is a file, a raw pty stream or a HOOKTTY_CAPTURE recording, or
+ * one of the generators: ascii, sgr, cjk, tui, scroll. Without inputs every
+ * generator runs. A recording is parsed at the size it was made at unless
+ * -g is given.
+ *
+ * -m read measures the pty readers instead, the input is written to a pty
+ * in chunks and each reader moves it to a byte ring that is only drained.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pty.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "macros.h"
+#include "pty-read.h"
+#include "pty-uring.h"
+#include "ring.h"
+#include "vt.h"
+
+#define BENCH_DEFAULT_SIZE (8 * 1024 * 1024)
+#define BENCH_DEFAULT_CHUNK 4096
+#define BENCH_DEFAULT_SECS 1.0
+
+// PTY_RING_SIZE
+#define BENCH_RING_SIZE (1024 * 1024)
+
+/*
+ * allocation counting, the bench is linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+ */
+static uint64_t allocs;
+
+void*
+__real_malloc(size_t size);
+void*
+__real_calloc(size_t n, size_t size);
+void*
+__real_realloc(void* p, size_t size);
+
+void*
+__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void*
+__wrap_realloc(void* p, size_t size)
+{
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+struct buf
+{
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+static void
+buf_put(struct buf* b, const char* s, size_t n)
+{
+    if (b->len + n > b->cap) {
+        b->cap = (b->cap + n) * 2;
+        b->data = realloc(b->data, b->cap);
+        assert(b->data != NULL);
+    }
+
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void
+buf_printf(struct buf* b, const char* fmt, ...)
+{
+    char tmp[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+
+    buf_put(b, tmp, min(n, (int)sizeof(tmp) - 1));
+}
+
+// the same stream on every run
+static uint32_t rng_state;
+
+static uint32_t
+rng(void)
+{
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static void
+put_word(struct buf* b)
+{
+    char w[16];
+    int len = 1 + rng() % 10;
+
+    for (int i = 0; i < len; i++)
+        w[i] = 'a' + rng() % 26;
+
+    buf_put(b, w, len);
+}
+
+// shell/log like output, lines of words
+static void
+gen_ascii(struct buf* b, size_t size, int rows, int cols)
+{
+    while (b->len < size) {
+        int words = rng() % 14;
+
+        for (int i = 0; i < words; i++) {
+            put_word(b);
+            buf_put(b, " ", 1);
+        }
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+// every word in its own color, like ls --color or syntax highlighting
+static void
+gen_sgr(struct buf* b, size_t size, int rows, int cols)
+{
+    while (b->len < size) {
+        int words = rng() % 10;
+
+        for (int i = 0; i < words; i++) {
+            switch (rng() % 4) {
+                case 0:
+                    buf_printf(b, "\x1b[%dm", 30 + rng() % 8);
+                    break;
+                case 1:
+                    buf_printf(b, "\x1b[1;%dm", 90 + rng() % 8);
+                    break;
+                case 2:
+                    buf_printf(b, "\x1b[38;5;%dm", rng() % 256);
+                    break;
+                case 3:
+                    buf_printf(b,
+                               "\x1b[38;2;%d;%d;%d;48;5;%dm",
+                               rng() % 256,
+                               rng() % 256,
+                               rng() % 256,
+                               232 + rng() % 24);
+                    break;
+            }
+
+            put_word(b);
+            buf_put(b, "\x1b[0m ", 5);
+        }
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+// 3 byte utf-8, mostly CJK with some ascii punctuation
+static void
+gen_cjk(struct buf* b, size_t size, int rows, int cols)
+{
+    while (b->len < size) {
+        int chars = rng() % (cols / 2);
+
+        for (int i = 0; i < chars; i++) {
+            if (rng() % 8 == 0) {
+                buf_put(b, ", ", 2);
+                continue;
+            }
+
+            uint32_t cp = 0x4e00 + rng() % 0x5000;
+            char u[3] = {
+                0xe0 | (cp >> 12),
+                0x80 | ((cp >> 6) & 0x3f),
+                0x80 | (cp & 0x3f),
+            };
+            buf_put(b, u, 3);
+        }
+        buf_put(b, "\r\n", 2);
+    }
+}
+
+// full screen app on the alt screen redrawing random parts of itself
+static void
+gen_tui(struct buf* b, size_t size, int rows, int cols)
+{
+    buf_printf(b, "\x1b[?1049h");
+
+    while (b->len < size) {
+        if (rng() % 64 == 0)
+            buf_printf(b, "\x1b[H\x1b[2J");
+
+        int updates = 1 + rng() % rows;
+
+        for (int i = 0; i < updates; i++) {
+            buf_printf(b,
+                       "\x1b[%d;%dH\x1b[%d;%dm",
+                       1 + rng() % rows,
+                       1 + rng() % (cols / 2),
+                       rng() % 2 ? 7 : 27,
+                       30 + rng() % 8);
+
+            int words = 1 + rng() % 4;
+            for (int j = 0; j < words; j++) {
+                put_word(b);
+                buf_put(b, " ", 1);
+            }
+
+            buf_printf(b, "\x1b[0m\x1b[K");
+        }
+
+        // status line
+        buf_printf(b, "\x1b[%d;1H\x1b[7m", rows);
+        put_word(b);
+        buf_printf(b, "\x1b[0m\x1b[%d;%dH", 1 + rng() % rows, 1);
+    }
+
+    buf_printf(b, "\x1b[?1049l");
+}
+
+// a pager/editor scrolling a region with the first and last rows fixed
+static void
+gen_scroll(struct buf* b, size_t size, int rows, int cols)
+{
+    while (b->len < size) {
+        buf_printf(b, "\x1b[2;%dr\x1b[%d;1H", rows - 1, rows - 1);
+
+        int lines = 1 + rng() % rows;
+        for (int i = 0; i < lines; i++) {
+            put_word(b);
+            buf_put(b, " ", 1);
+            put_word(b);
+            buf_put(b, "\r\n", 2);
+        }
+
+        // and back up
+        buf_printf(b, "\x1b[2;1H");
+        for (int i = rng() % 4; i > 0; i--)
+            buf_printf(b, "\x1bM");
+
+        buf_printf(b, "\x1b[%dS\x1b[r", 1 + rng() % 3);
+    }
+}
+
+static const struct generator
+{
+    const char* name;
+    void (*gen)(struct buf* b, size_t size, int rows, int cols);
+} generators[] = {
+    { "ascii", gen_ascii }, { "sgr", gen_sgr },       { "cjk", gen_cjk },
+    { "tui", gen_tui },     { "scroll", gen_scroll },
+};
+
+#define GENERATOR_COUNT (sizeof(generators) / sizeof(generators[0]))
+
+// only the output of a capture, `rows` and `cols` are set to its first size
+static bool
+load_capture(struct buf* b, const char* path, int* rows, int* cols)
+{
+    struct capture_reader r;
+    struct capture_record rec;
+    bool sized = false;
+
+    if (!capture_reader_open(&r, path))
+        return false;
+
+    while (capture_read(&r, &rec)) {
+        if (rec.type == CAPTURE_OUTPUT)
+            buf_put(b, rec.data, rec.len);
+
+        if (rec.type == CAPTURE_RESIZE && !sized) {
+            uint16_t r16, c16;
+            capture_record_size(&rec, &r16, &c16);
+            *rows = r16;
+            *cols = c16;
+            sized = true;
+        }
+    }
+
+    capture_reader_close(&r);
+    return true;
+}
+
+static bool
+load_file(struct buf* b, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    char tmp[65536];
+    size_t n;
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+        buf_put(b, tmp, n);
+
+    fclose(f);
+    return true;
+}
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+ignore_write(void* data, const char* buf, size_t n)
+{
+}
+
+static const struct vt_listener bench_listener = {
+    .write = ignore_write,
+};
+
+// one more pass with the profiler, outside of the timed runs
+static void
+profile(const struct buf* in, size_t chunk, int rows, int cols, size_t top)
+{
+    struct vt* vt = vt_new(rows, cols, &bench_listener, NULL);
+    vt_profile_enable(vt);
+
+    for (size_t off = 0; off < in->len; off += chunk)
+        vt_parse(vt, in->data + off, min(chunk, in->len - off));
+
+    vt_profile_report(vt->profile, stdout, top);
+    printf("\n");
+
+    vt_free(vt);
+}
+
+static void
+run(const char* name,
+    const struct buf* in,
+    size_t chunk,
+    int rows,
+    int cols,
+    double secs)
+{
+    struct vt* vt = vt_new(rows, cols, &bench_listener, NULL);
+
+    // warm up, grows the rows written past their initial length
+    for (size_t off = 0; off < in->len; off += chunk)
+        vt_parse(vt, in->data + off, min(chunk, in->len - off));
+
+    uint64_t allocs_start = allocs;
+    uint64_t bytes = 0;
+    double start = now_s();
+    double elapsed;
+
+    do {
+        for (size_t off = 0; off < in->len; off += chunk)
+            vt_parse(vt, in->data + off, min(chunk, in->len - off));
+
+        bytes += in->len;
+        elapsed = now_s() - start;
+    } while (elapsed < secs);
+
+    uint64_t n_allocs = allocs - allocs_start;
+
+    printf("%-16s %10zu %8zu %10.1f %8.2f %12.2f\n",
+           name,
+           in->len,
+           chunk,
+           bytes / elapsed / (1024 * 1024),
+           elapsed * 1e9 / bytes,
+           n_allocs / (bytes / (1024.0 * 1024)));
+
+    vt_free(vt);
+}
+
+struct pty_feed
+{
+    int fd; // pty slave
+    const struct buf* in;
+    size_t chunk;
+    double secs;
+};
+
+// writes the input over and over for `secs`, closing the slave is the EOF
+static void*
+feed_thread(void* data)
+{
+    struct pty_feed* f = data;
+    double start = now_s();
+
+    do {
+        for (size_t off = 0; off < f->in->len;) {
+            ssize_t n =
+              write(f->fd, f->in->data + off, min(f->chunk, f->in->len - off));
+            assert(n > 0);
+            off += n;
+        }
+    } while (now_s() - start < f->secs);
+
+    close(f->fd);
+    return NULL;
+}
+
+struct bench_reader
+{
+    struct pty_reader r;
+    bool uring;
+};
+
+static void*
+reader_thread(void* data)
+{
+    struct bench_reader* b = data;
+
+#ifdef HOOKTTY_IO_URING
+    if (b->uring && !pty_uring_reader(&b->r))
+        fprintf(stderr, "io_uring can't be used\n");
+    if (!b->uring)
+        pty_reader_poll(&b->r);
+#else
+    pty_reader_poll(&b->r);
+#endif
+
+    ring_close(b->r.ring);
+
+    return NULL;
+}
+
+static void
+run_reader(const char* name,
+           const char* reader,
+           bool uring,
+           const struct buf* in,
+           size_t chunk,
+           double secs)
+{
+    int master, slave;
+    if (openpty(&master, &slave, NULL, NULL, NULL) < 0) {
+        perror("openpty");
+        exit(1);
+    }
+
+    struct termios t;
+    tcgetattr(slave, &t);
+    cfmakeraw(&t);
+    tcsetattr(slave, TCSANOW, &t);
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    struct capture capture = { 0 };
+    atomic_uint_fast64_t arrival = 0;
+    atomic_uint_fast64_t ring_full = 0;
+    int stop_fd = eventfd(0, EFD_CLOEXEC);
+    assert(stop_fd >= 0);
+
+    struct bench_reader b = {
+        .r = {
+            .fd = master,
+            .stop_fd = stop_fd,
+            .ring = ring_new(BENCH_RING_SIZE),
+            .capture = &capture,
+            .arrival = &arrival,
+            .ring_full = &ring_full,
+        },
+        .uring = uring,
+    };
+    struct pty_reader* r = &b.r;
+    assert(r->ring != NULL);
+
+    // no parser, only what the reader costs
+    struct pty_feed feed = { slave, in, chunk, secs };
+    pthread_t feed_tid, reader_tid;
+    uint64_t bytes = 0;
+    uint64_t wakeups = 0;
+    double start = now_s();
+
+    pthread_create(&reader_tid, NULL, reader_thread, &b);
+    pthread_create(&feed_tid, NULL, feed_thread, &feed);
+
+    for (;;) {
+        struct iovec iov[2];
+        int iovcnt = ring_read_spans(r->ring, iov, SIZE_MAX);
+
+        if (iovcnt == 0) {
+            if (!ring_wait_data(r->ring))
+                break;
+            wakeups++;
+            continue;
+        }
+
+        size_t n = iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0);
+        ring_consume(r->ring, n);
+        bytes += n;
+    }
+
+    double elapsed = now_s() - start;
+
+    pthread_join(feed_tid, NULL);
+    pthread_join(reader_tid, NULL);
+
+    printf("%-16s %-8s %8zu %10.1f %8.2f %12lu\n",
+           name,
+           reader,
+           chunk,
+           bytes / elapsed / (1024 * 1024),
+           elapsed * 1e9 / bytes,
+           (unsigned long)wakeups);
+
+    ring_free(r->ring);
+    close(stop_fd);
+    close(master);
+}
+
+static void
+usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-c chunk] [-s size] [-g ROWSxCOLS] [-t secs] "
+            "[-p top] [-m parse|read] [file|generator...]\n"
+            "generators:",
+            argv0);
+
+    for (size_t i = 0; i < GENERATOR_COUNT; i++)
+        fprintf(stderr, " %s", generators[i].name);
+
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+    size_t chunk = BENCH_DEFAULT_CHUNK;
+    size_t size = BENCH_DEFAULT_SIZE;
+    int rows = 50;
+    int cols = 200;
+    double secs = BENCH_DEFAULT_SECS;
+    bool grid_set = false;
+    size_t top = 0;
+    bool profile_set = false;
+    bool read_mode = false;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            usage(argv[0]);
+
+        const char* v = argv[++i];
+
+        switch (argv[i - 1][1]) {
+            case 'c':
+                chunk = strtoul(v, NULL, 10);
+                break;
+            case 's':
+                size = strtoul(v, NULL, 10);
+                break;
+            case 'g':
+                if (sscanf(v, "%dx%d", &rows, &cols) != 2)
+                    usage(argv[0]);
+                grid_set = true;
+                break;
+            case 't':
+                secs = strtod(v, NULL);
+                break;
+            case 'p':
+                // the `top` sequences by time for each input, 0 for all
+                top = strtoul(v, NULL, 10);
+                profile_set = true;
+                break;
+            case 'm':
+                if (strcmp(v, "read") == 0)
+                    read_mode = true;
+                else if (strcmp(v, "parse") != 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (chunk == 0 || size == 0 || rows < 4 || cols < 4)
+        usage(argv[0]);
+
+    if (read_mode)
+        printf("%-16s %-8s %8s %10s %8s %12s\n",
+               "input",
+               "reader",
+               "chunk",
+               "MB/s",
+               "ns/byte",
+               "wakeups");
+    else
+        printf("%-16s %10s %8s %10s %8s %12s\n",
+               "input",
+               "bytes",
+               "chunk",
+               "MB/s",
+               "ns/byte",
+               "allocs/MB");
+
+    const char* const* inputs = (const char* const*)&argv[i];
+    int n_inputs = argc - i;
+
+    const char* all[GENERATOR_COUNT];
+    if (n_inputs == 0) {
+        for (size_t g = 0; g < GENERATOR_COUNT; g++)
+            all[g] = generators[g].name;
+
+        inputs = all;
+        n_inputs = GENERATOR_COUNT;
+    }
+
+    for (int n = 0; n < n_inputs; n++) {
+        struct buf in = { 0 };
+        const struct generator* gen = NULL;
+        int in_rows = rows, in_cols = cols;
+
+        for (size_t g = 0; g < GENERATOR_COUNT; g++)
+            if (strcmp(inputs[n], generators[g].name) == 0)
+                gen = &generators[g];
+
+        if (gen != NULL) {
+            rng_state = 1;
+            gen->gen(&in, size, rows, cols);
+        } else if (capture_is_capture(inputs[n])) {
+            // the size it was recorded at, unless -g says otherwise
+            int cap_rows = rows, cap_cols = cols;
+
+            if (!load_capture(&in, inputs[n], &cap_rows, &cap_cols)) {
+                perror(inputs[n]);
+                return 1;
+            }
+
+            if (!grid_set && cap_rows > 0 && cap_cols > 0) {
+                in_rows = cap_rows;
+                in_cols = cap_cols;
+            }
+        } else if (!load_file(&in, inputs[n])) {
+            perror(inputs[n]);
+            return 1;
+        }
+
+        if (in.len == 0)
+            continue;
+
+        if (read_mode) {
+            run_reader(inputs[n], "read", false, &in, chunk, secs);
+#ifdef HOOKTTY_IO_URING
+            run_reader(inputs[n], "io_uring", true, &in, chunk, secs);
+#endif
+            free(in.data);
+            continue;
+        }
+
+        run(inputs[n], &in, chunk, in_rows, in_cols, secs);
+
+        if (profile_set)
+            profile(&in, chunk, in_rows, in_cols, top);
+
+        free(in.data);
+    }
+
+    return 0;
+}
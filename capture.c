@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "macros.h"
+#include "stats.h"
+
+// buffered, but never more than this behind so a crash keeps most of it
+#define CAPTURE_FLUSH_NS (100 * 1000000ull)
+
+static void
+put_varint(FILE* f, uint64_t v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc_unlocked(v, f);
+}
+
+static bool
+get_varint(FILE* f, uint64_t* v)
+{
+    *v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int b = getc(f);
+        if (b == EOF)
+            return false;
+
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+bool
+capture_open(struct capture* c, const char* path)
+{
+    c->f = fopen(path, "wb");
+    if (c->f == NULL)
+        return false;
+
+    setvbuf(c->f, NULL, _IOFBF, 64 * 1024);
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, c->f);
+
+    c->last = c->flushed = now_ns();
+
+    return true;
+}
+
+void
+capture_close(struct capture* c)
+{
+    if (c->f == NULL)
+        return;
+
+    fclose(c->f);
+    c->f = NULL;
+}
+
+void
+capture_write(struct capture* c,
+              enum capture_type type,
+              const void* data,
+              size_t len)
+{
+    if (c->f == NULL)
+        return;
+
+    flockfile(c->f);
+
+    // taken under the lock, the deltas of records from different threads
+    // can't go negative
+    uint64_t now = now_ns();
+
+    putc_unlocked(type, c->f);
+    put_varint(c->f, now - c->last);
+    put_varint(c->f, len);
+    fwrite_unlocked(data, 1, len, c->f);
+
+    c->last = now;
+
+    if (now - c->flushed >= CAPTURE_FLUSH_NS) {
+        fflush_unlocked(c->f);
+        c->flushed = now;
+    }
+
+    funlockfile(c->f);
+}
+
+void
+capture_resize(struct capture* c, uint16_t rows, uint16_t cols)
+{
+    uint8_t p[4] = { rows, rows >> 8, cols, cols >> 8 };
+    capture_write(c, CAPTURE_RESIZE, p, sizeof(p));
+}
+
+bool
+capture_is_capture(const char* path)
+{
+    char magic[CAPTURE_MAGIC_LEN];
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    bool is = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+              memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+
+    fclose(f);
+    return is;
+}
+
+bool
+capture_reader_open(struct capture_reader* r, const char* path)
+{
+    char magic[CAPTURE_MAGIC_LEN];
+
+    *r = (struct capture_reader){ 0 };
+
+    r->f = fopen(path, "rb");
+    if (r->f == NULL)
+        return false;
+
+    if (fread(magic, 1, sizeof(magic), r->f) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        fclose(r->f);
+        r->f = NULL;
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+void
+capture_reader_close(struct capture_reader* r)
+{
+    if (r->f != NULL)
+        fclose(r->f);
+
+    free(r->buf);
+    *r = (struct capture_reader){ 0 };
+}
+
+bool
+capture_read(struct capture_reader* r, struct capture_record* rec)
+{
+    int type = getc(r->f);
+    uint64_t delta, len;
+
+    if (type == EOF || !get_varint(r->f, &delta) || !get_varint(r->f, &len))
+        return false;
+
+    if (len > r->cap) {
+        r->cap = len;
+        r->buf = realloc(r->buf, r->cap);
+        assert(r->buf != NULL);
+    }
+
+    if (fread(r->buf, 1, len, r->f) != len)
+        return false;
+
+    r->time += delta;
+
+    *rec = (struct capture_record){
+        .type = type,
+        .time = r->time,
+        .data = r->buf,
+        .len = len,
+    };
+
+    return true;
+}
+
+void
+capture_record_size(const struct capture_record* rec,
+                    uint16_t* rows,
+                    uint16_t* cols)
+{
+    const uint8_t* p = (const uint8_t*)rec->data;
+
+    *rows = *cols = 0;
+    if (rec->len < 4)
+        return;
+
+    *rows = p[0] | p[1] << 8;
+    *cols = p[2] | p[3] << 8;
+}
+
+// waits for `fd` to take more output or for `deadline`, drops whatever the
+// terminal writes meanwhile, false on error
+static bool
+replay_wait(int fd, bool want_out, uint64_t deadline)
+{
+    char scratch[4096];
+
+    for (;;) {
+        struct pollfd pfd = {
+            .fd = fd,
+            .events = POLLIN | (want_out ? POLLOUT : 0),
+        };
+
+        struct timespec ts, *timeout = NULL;
+        if (deadline) {
+            uint64_t now = now_ns();
+            if (now >= deadline)
+                return true;
+
+            ts = (struct timespec){ (deadline - now) / 1000000000ull,
+                                    (deadline - now) % 1000000000ull };
+            timeout = &ts;
+        }
+
+        if (ppoll(&pfd, 1, timeout, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        if (pfd.revents & POLLIN) {
+            while (read(fd, scratch, sizeof(scratch)) > 0) {
+            }
+        }
+
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            return false;
+
+        if (want_out && (pfd.revents & POLLOUT))
+            return true;
+    }
+}
+
+double
+capture_replay(const char* path, int fd, double speed)
+{
+    struct capture_reader r;
+    struct capture_record rec;
+
+    if (!capture_reader_open(&r, path))
+        return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    uint64_t start = now_ns();
+    bool ok = true;
+
+    while (ok && capture_read(&r, &rec)) {
+        if (rec.type != CAPTURE_OUTPUT)
+            continue;
+
+        if (speed > 0)
+            ok = replay_wait(fd, false, start + rec.time / speed);
+
+        for (size_t off = 0; ok && off < rec.len;) {
+            // the window may be gone already, that is EPIPE and no signal
+            ssize_t n = send(fd, rec.data + off, rec.len - off, MSG_NOSIGNAL);
+
+            if (n > 0)
+                off += n;
+            else if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                ok = replay_wait(fd, true, 0);
+            else
+                ok = false;
+        }
+    }
+
+    capture_reader_close(&r);
+
+    // the terminal sees EOF like after the child exits, it can still write
+    shutdown(fd, SHUT_WR);
+
+    if (!ok)
+        return -1;
+
+    return (now_ns() - start) / 1e9;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Binary capture of a pty session, enabled with HOOKTTY_CAPTURE=<path> and
+ * played back with HOOKTTY_REPLAY=<path>.
+ *
+ * The file starts with CAPTURE_MAGIC, then records of
+ *
+ *   u8      type (enum capture_type)
+ *   varint  ns since the previous record (since capture_open() for the first)
+ *   varint  payload length
+ *   bytes   payload
+ *
+ * varints are unsigned LEB128. Output is recorded when it is read from the
+ * pty, input when it is queued for the child.
+ */
+
+#define CAPTURE_MAGIC "hookcap\x01"
+#define CAPTURE_MAGIC_LEN 8
+
+enum capture_type
+{
+    CAPTURE_OUTPUT = 'o', // pty -> terminal
+    CAPTURE_INPUT = 'i',  // terminal -> pty, keys and replies
+    CAPTURE_RESIZE = 'r', // u16 rows, u16 cols, little endian
+};
+
+// `f` is NULL while disabled, records are appended under the FILE lock so
+// any thread can write
+struct capture
+{
+    FILE* f;
+    uint64_t last;    // time of the previous record
+    uint64_t flushed; // time of the last fflush()
+};
+
+struct capture_record
+{
+    enum capture_type type;
+    uint64_t time; // ns since the start of the capture
+    char* data;    // owned by the reader, valid until the next read
+    size_t len;
+};
+
+struct capture_reader
+{
+    FILE* f;
+    uint64_t time;
+    char* buf;
+    size_t cap;
+};
+
+bool
+capture_open(struct capture* c, const char* path);
+
+void
+capture_close(struct capture* c);
+
+void
+capture_write(struct capture* c,
+              enum capture_type type,
+              const void* data,
+              size_t len);
+
+void
+capture_resize(struct capture* c, uint16_t rows, uint16_t cols);
+
+// true if the file at `path` starts with CAPTURE_MAGIC
+bool
+capture_is_capture(const char* path);
+
+bool
+capture_reader_open(struct capture_reader* r, const char* path);
+
+void
+capture_reader_close(struct capture_reader* r);
+
+// false at the end of the file or on a truncated record
+bool
+capture_read(struct capture_reader* r, struct capture_record* rec);
+
+// rows and cols of a CAPTURE_RESIZE record
+void
+capture_record_size(const struct capture_record* rec,
+                    uint16_t* rows,
+                    uint16_t* cols);
+
+/*
+ * Writes the output records of a capture to `fd` as the child would, with
+ * the original timing divided by `speed` or as fast as `fd` takes them if
+ * `speed` is 0. Whatever is written to the other end is read and dropped.
+ * Shuts down writing on `fd` at the end, returns the seconds it took or a
+ * negative value on error.
+ */
+double
+capture_replay(const char* path, int fd, double speed);
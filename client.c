@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+ * hooktty-client [-s socket] [command [args...]]
+ *
+ * Asks a `hooktty --server` to open a window running `command`, the shell
+ * without one, in the current directory. Exits once the window is up.
+ */
+
+static void
+usage(const char* argv0)
+{
+    fprintf(stderr, "usage: %s [-s socket] [command [args...]]\n", argv0);
+    exit(2);
+}
+
+static bool
+write_full(int fd, const void* buf, size_t n)
+{
+    const char* p = buf;
+
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+
+        p += w;
+        n -= w;
+    }
+
+    return true;
+}
+
+int
+main(int argc, char* argv[])
+{
+    char path[108];
+    int first = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        if (argc < 3)
+            usage(argv[0]);
+
+        snprintf(path, sizeof(path), "%s", argv[2]);
+        first = 3;
+    } else if (argc > 1 && argv[1][0] == '-') {
+        usage(argv[0]);
+    } else if (!server_socket_path(path, sizeof(path))) {
+        fprintf(stderr, "XDG_RUNTIME_DIR isn't set, give a socket path\n");
+        return 1;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+
+    // the lengths first, see server.h
+    uint32_t n_args = argc - first;
+    uint32_t* head = calloc(n_args + 2, sizeof(*head));
+    size_t total = (n_args + 2) * sizeof(*head);
+
+    head[0] = n_args;
+    head[1] = strlen(cwd);
+    total += head[1];
+
+    for (uint32_t i = 0; i < n_args; i++) {
+        head[i + 2] = strlen(argv[first + i]);
+        total += head[i + 2];
+    }
+
+    if (total > SERVER_REQUEST_MAX) {
+        fprintf(stderr, "command too long\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    bool ok = write_full(fd, head, (n_args + 2) * sizeof(*head)) &&
+              write_full(fd, cwd, head[1]);
+
+    for (uint32_t i = 0; ok && i < n_args; i++)
+        ok = write_full(fd, argv[first + i], head[i + 2]);
+
+    uint8_t status = 1;
+    if (!ok || read(fd, &status, sizeof(status)) != sizeof(status)) {
+        fprintf(stderr, "%s: the server hung up\n", path);
+        return 1;
+    }
+
+    if (status != 0) {
+        fprintf(stderr, "the server couldn't open a window\n");
+        return 1;
+    }
+
+    return 0;
+}
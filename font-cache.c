@@ -0,0 +1,406 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "font-cache.h"
+#include "macros.h"
+#include "mem.h"
+
+_Static_assert(FC_CHARSET_MAP_SIZE == 8, "coverage pages are fontconfig's");
+
+// more pages than unicode has, larger masks than any cell
+#define FONT_CACHE_PAGES_MAX 0x1100
+#define FONT_CACHE_GLYPH_MAX 4096
+
+struct reader
+{
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+static bool
+take(struct reader* r, void* out, size_t n)
+{
+    if ((size_t)(r->end - r->p) < n)
+        return false;
+
+    memcpy(out, r->p, n);
+    r->p += n;
+    return true;
+}
+
+static bool
+take_u32(struct reader* r, uint32_t* v)
+{
+    return take(r, v, sizeof(*v));
+}
+
+static bool
+take_i32(struct reader* r, int32_t* v)
+{
+    return take(r, v, sizeof(*v));
+}
+
+static bool
+font_cache_enabled(void)
+{
+    const char* v = getenv("HOOKTTY_FONT_CACHE");
+
+    return v == NULL || strcmp(v, "0") != 0;
+}
+
+// the newest mtime of the config files and the font directories, fontconfig
+// lists the directories below the configured ones too
+static int64_t
+config_mtime(void)
+{
+    FcStrList* lists[] = {
+        FcConfigGetConfigFiles(NULL),
+        FcConfigGetFontDirs(NULL),
+    };
+    int64_t newest = 0;
+
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        FcChar8* path;
+
+        if (lists[i] == NULL)
+            continue;
+
+        while ((path = FcStrListNext(lists[i])) != NULL) {
+            struct stat st;
+
+            if (stat((const char*)path, &st) == 0)
+                newest = max(newest,
+                             st.st_mtim.tv_sec * 1000000000ll +
+                               st.st_mtim.tv_nsec);
+        }
+
+        FcStrListDone(lists[i]);
+    }
+
+    return newest;
+}
+
+// $XDG_CACHE_HOME/hooktty/fonts-<hash>, ~/.cache without XDG_CACHE_HOME.
+// `create` makes the directories
+static bool
+cache_path(const struct font_cache* cache, char* buf, size_t size, bool create)
+{
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    char dir[PATH_MAX];
+    int n;
+
+    if (xdg && *xdg)
+        n = snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home)
+        n = snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return false;
+
+    if (n < 0 || (size_t)n >= sizeof(dir) - sizeof("/hooktty"))
+        return false;
+
+    if (create)
+        mkdir(dir, 0700);
+
+    strcat(dir, "/hooktty");
+    if (create)
+        mkdir(dir, 0700);
+
+    // FNV-1a, the name can't go in a file name as it is
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char* p = cache->name; *p; p++)
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+    h = (h ^ cache->pixel_size) * 0x100000001b3ull;
+    h = (h ^ (uint32_t)cache->scale) * 0x100000001b3ull;
+
+    n = snprintf(buf, size, "%s/fonts-%016llx", dir, (unsigned long long)h);
+    return n > 0 && (size_t)n < size;
+}
+
+static void
+free_fonts(struct font* fonts, int count)
+{
+    for (int i = 0; i < count; i++) {
+        mem_free(MEM_FONTS, fonts[i].ttf);
+        mem_free(MEM_FONTS, fonts[i].coverage);
+    }
+    mem_free(MEM_FONTS, fonts);
+}
+
+static bool
+read_font(struct reader* r, struct font* font)
+{
+    uint32_t len;
+    uint32_t pages;
+    int32_t index;
+
+    if (!take_u32(r, &len) || len == 0 || len >= PATH_MAX)
+        return false;
+
+    font->ttf = mem_calloc(MEM_FONTS, 1, len + 1);
+    assert(font->ttf != NULL);
+
+    if (!take(r, font->ttf, len) || !take_i32(r, &index) ||
+        !take_u32(r, &pages) || pages > FONT_CACHE_PAGES_MAX)
+        return false;
+
+    font->index = index;
+    font->coverage_pages = pages;
+    font->coverage = mem_calloc(MEM_FONTS, pages, sizeof(*font->coverage));
+    assert(pages == 0 || font->coverage != NULL);
+
+    return take(r, font->coverage, pages * sizeof(*font->coverage));
+}
+
+static struct glyph*
+read_glyph(struct reader* r, FT_UInt size)
+{
+    uint32_t ch;
+    int32_t v[7];
+
+    if (!take_u32(r, &ch) || !take(r, v, sizeof(v)))
+        return NULL;
+
+    int32_t width = v[0];
+    int32_t rows = v[1];
+    int32_t stride = v[2];
+
+    if (width < 0 || rows < 0 || rows > FONT_CACHE_GLYPH_MAX ||
+        stride < width || stride > FONT_CACHE_GLYPH_MAX)
+        return NULL;
+
+    struct glyph* g =
+      mem_malloc(MEM_FONTS, sizeof(*g) + (size_t)rows * stride);
+    assert(g != NULL);
+
+    *g = (struct glyph){
+        .ch = ch,
+        .size = size,
+        .width = width,
+        .rows = rows,
+        .stride = stride,
+        .top = v[3],
+        .ascent = v[4],
+        .underline_position = v[5],
+        .underline_thickness = v[6],
+        .pixels = (const uint32_t*)(g + 1),
+    };
+
+    if (!take(r, g + 1, (size_t)rows * stride)) {
+        mem_free(MEM_FONTS, g);
+        return NULL;
+    }
+
+    return g;
+}
+
+static bool
+parse(struct reader* r, struct font_cache* cache)
+{
+    char magic[FONT_CACHE_MAGIC_LEN];
+    uint32_t pixel_size;
+    int32_t scale;
+    int64_t mtime;
+    uint32_t name_len;
+
+    if (!take(r, magic, sizeof(magic)) ||
+        memcmp(magic, FONT_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        !take_u32(r, &pixel_size) || !take_i32(r, &scale) ||
+        !take(r, &mtime, sizeof(mtime)) || !take_u32(r, &name_len))
+        return false;
+
+    // a hash collision or an old file
+    if (pixel_size != cache->pixel_size || scale != cache->scale ||
+        name_len != strlen(cache->name) ||
+        (size_t)(r->end - r->p) < name_len ||
+        memcmp(r->p, cache->name, name_len) != 0)
+        return false;
+    r->p += name_len;
+
+    if (mtime != config_mtime()) {
+        HOG("font cache: fontconfig changed");
+        return false;
+    }
+
+    int32_t metrics[4];
+    uint32_t count;
+
+    if (!take(r, metrics, sizeof(metrics)) || !take_u32(r, &count) ||
+        count == 0 || count > (size_t)(r->end - r->p))
+        return false;
+
+    cache->cell_width = metrics[0];
+    cache->cell_height = metrics[1];
+    cache->advance_x = metrics[2];
+    cache->advance_y = metrics[3];
+
+    cache->fonts = mem_calloc(MEM_FONTS, count, sizeof(*cache->fonts));
+    assert(cache->fonts != NULL);
+    cache->font_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!read_font(r, &cache->fonts[i]))
+            return false;
+    }
+
+    if (!take_u32(r, &count) || count > (size_t)(r->end - r->p))
+        return false;
+
+    cache->glyphs = mem_calloc(MEM_FONTS, count, sizeof(*cache->glyphs));
+    assert(count == 0 || cache->glyphs != NULL);
+
+    FT_UInt size = cache->pixel_size * cache->scale;
+
+    for (uint32_t i = 0; i < count; i++) {
+        cache->glyphs[i] = read_glyph(r, size);
+        if (cache->glyphs[i] == NULL)
+            return false;
+
+        cache->glyph_count++;
+    }
+
+    return true;
+}
+
+bool
+font_cache_read(struct font_cache* cache)
+{
+    char path[PATH_MAX];
+
+    if (!font_cache_enabled() || !cache_path(cache, path, sizeof(path), false))
+        return false;
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    // a few hundred KB at most, the glyphs are most of it
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    uint8_t* buf = size > 0 ? malloc(size) : NULL;
+    bool ok = buf != NULL && fread(buf, 1, size, f) == (size_t)size;
+    fclose(f);
+
+    struct reader r = { buf, buf + (ok ? size : 0) };
+    ok = ok && parse(&r, cache);
+    free(buf);
+
+    if (!ok) {
+        free_fonts(cache->fonts, cache->font_count);
+        for (int i = 0; i < cache->glyph_count; i++)
+            mem_free(MEM_FONTS, cache->glyphs[i]);
+        mem_free(MEM_FONTS, cache->glyphs);
+
+        cache->fonts = NULL;
+        cache->glyphs = NULL;
+        cache->font_count = cache->glyph_count = 0;
+
+        HOG("font cache: %s is a miss", path);
+        return false;
+    }
+
+    HOG_INFO("font cache: %d fonts from %s", cache->font_count, path);
+    return true;
+}
+
+static void
+put_u32(FILE* f, uint32_t v)
+{
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void
+put_i32(FILE* f, int32_t v)
+{
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+void
+font_cache_write(const struct font_cache* cache)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 32];
+
+    if (!font_cache_enabled() || !cache_path(cache, path, sizeof(path), true))
+        return;
+
+    // renamed over the old one, a reader never sees half of it
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror(tmp);
+        return;
+    }
+
+    int64_t mtime = config_mtime();
+
+    fwrite(FONT_CACHE_MAGIC, 1, FONT_CACHE_MAGIC_LEN, f);
+    put_u32(f, cache->pixel_size);
+    put_i32(f, cache->scale);
+    fwrite(&mtime, sizeof(mtime), 1, f);
+    put_u32(f, strlen(cache->name));
+    fputs(cache->name, f);
+
+    put_i32(f, cache->cell_width);
+    put_i32(f, cache->cell_height);
+    put_i32(f, cache->advance_x);
+    put_i32(f, cache->advance_y);
+
+    put_u32(f, cache->font_count);
+    for (int i = 0; i < cache->font_count; i++) {
+        const struct font* font = &cache->fonts[i];
+
+        put_u32(f, strlen(font->ttf));
+        fputs(font->ttf, f);
+        put_i32(f, font->index);
+        put_u32(f, font->coverage_pages);
+        fwrite(font->coverage,
+               sizeof(*font->coverage),
+               font->coverage_pages,
+               f);
+    }
+
+    put_u32(f, cache->glyph_count);
+    for (int i = 0; i < cache->glyph_count; i++) {
+        const struct glyph* g = cache->glyphs[i];
+
+        put_u32(f, g->ch);
+        put_i32(f, g->width);
+        put_i32(f, g->rows);
+        put_i32(f, g->stride);
+        put_i32(f, g->top);
+        put_i32(f, g->ascent);
+        put_i32(f, g->underline_position);
+        put_i32(f, g->underline_thickness);
+        fwrite(g->pixels, 1, (size_t)g->rows * g->stride, f);
+    }
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        return;
+    }
+
+    HOG_INFO("font cache: wrote %s", path);
+}
+
+void
+font_cache_remove(const struct font_cache* cache)
+{
+    char path[PATH_MAX];
+
+    if (!cache_path(cache, path, sizeof(path), false))
+        return;
+
+    if (unlink(path) == 0)
+        HOG_INFO("font cache: removed %s", path);
+}
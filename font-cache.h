@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "render.h"
+
+/*
+ * What fonts_init() and fonts_load_fallbacks() resolve with fontconfig and
+ * FreeType, kept in $XDG_CACHE_HOME/hooktty/fonts-<hash of the key> so a
+ * warm start neither matches nor sorts. HOOKTTY_FONT_CACHE=0 disables it.
+ *
+ * The file is FONT_CACHE_MAGIC then, in host byte order
+ *
+ *   u32  pixel size
+ *   i32  scale
+ *   i64  ns mtime of the fontconfig configuration, see below
+ *   u32  length of the font name, the name
+ *   i32  cell_width, cell_height, advance_x, advance_y at the scale
+ *   u32  number of fonts, the primary one then the fallbacks in
+ *        fontconfig's order, each
+ *          u32  length of the path, the path
+ *          i32  face index
+ *          u32  number of coverage pages, each u32 page and u32 bits[8]
+ *   u32  number of glyphs of the primary font at pixel size * scale, each
+ *          u32  ch
+ *          i32  width, rows, stride, top, ascent, underline_position,
+ *               underline_thickness
+ *          rows * stride bytes of mask
+ *
+ * The mtime is the newest one of the config files and the font directories,
+ * installing or removing a font changes it. A file with another key is a
+ * miss and is replaced by the next write.
+ */
+
+#define FONT_CACHE_MAGIC "hookfnt\x01"
+#define FONT_CACHE_MAGIC_LEN 8
+
+struct font_cache
+{
+    // the key, the caller fills it in
+    const char* name;
+    FT_UInt pixel_size;
+    int32_t scale;
+
+    int cell_width;
+    int cell_height;
+    int advance_x;
+    int advance_y;
+
+    // without faces, the primary font first
+    struct font* fonts;
+    int font_count;
+
+    // their `font` is left to the caller
+    struct glyph** glyphs;
+    int glyph_count;
+};
+
+// fills `cache` for its key, false on a miss. The fonts, their paths and
+// coverage, the glyphs and both arrays are MEM_FONTS allocations the caller
+// owns
+bool
+font_cache_read(struct font_cache* cache);
+
+// replaces the file for the key of `cache`
+void
+font_cache_write(const struct font_cache* cache);
+
+// removes the file for the key of `cache`, a font in it can't be opened
+void
+font_cache_remove(const struct font_cache* cache);
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hud.h"
+
+#define HUD_INTERVAL_NS 1000000000ull
+
+void
+hud_init(struct hud* hud)
+{
+    const char* v = getenv("HOOKTTY_HUD");
+
+    *hud = (struct hud){ 0 };
+    hud->enabled = v && *v && strcmp(v, "0") != 0;
+
+    for (int i = 0; i < HUD_LINES; i++)
+        hud->line_ptrs[i] = hud->lines[i];
+
+    snprintf(hud->lines[0], HUD_LINE_SIZE, "hud: waiting for samples");
+}
+
+static double
+p99_us(const struct histogram* h)
+{
+    return histogram_percentile(h, 0.99) / 1e3;
+}
+
+static double
+p50_us(const struct histogram* h)
+{
+    return histogram_percentile(h, 0.5) / 1e3;
+}
+
+void
+hud_update(struct hud* hud, const struct stats* stats)
+{
+    uint64_t now = now_ns();
+
+    if (hud->last != 0 && now - hud->last < HUD_INTERVAL_NS)
+        return;
+
+    // copied first so every line is computed from the same numbers
+    struct stats cur;
+    stats_copy(&cur, stats);
+
+    if (hud->last == 0) {
+        hud->last = now;
+        hud->prev = cur;
+        return;
+    }
+
+    double secs = (now - hud->last) / 1e9;
+    struct histogram parse, parse_wait, render_wait, paint, latency;
+    struct histogram output_present, key_present;
+
+    histogram_sub(&parse, &cur.parse_lock_hold, &hud->prev.parse_lock_hold);
+    histogram_sub(&parse_wait, &cur.parse_lock_wait, &hud->prev.parse_lock_wait);
+    histogram_sub(
+      &render_wait, &cur.render_lock_wait, &hud->prev.render_lock_wait);
+    histogram_sub(&paint, &cur.paint_time, &hud->prev.paint_time);
+    histogram_sub(&latency, &cur.frame_latency, &hud->prev.frame_latency);
+    histogram_sub(
+      &output_present, &cur.output_to_present, &hud->prev.output_to_present);
+    histogram_sub(&key_present, &cur.key_to_present, &hud->prev.key_to_present);
+
+    snprintf(hud->lines[0],
+             HUD_LINE_SIZE,
+             "fps %.1f  parsed %.2f MB/s",
+             (cur.frames - hud->prev.frames) / secs,
+             (cur.read_batch.sum - hud->prev.read_batch.sum) / secs / 1e6);
+    snprintf(hud->lines[1],
+             HUD_LINE_SIZE,
+             "parse    p50 %.0f p99 %.0f us",
+             p50_us(&parse),
+             p99_us(&parse));
+    snprintf(hud->lines[2],
+             HUD_LINE_SIZE,
+             "paint    p50 %.0f p99 %.0f us",
+             p50_us(&paint),
+             p99_us(&paint));
+    snprintf(hud->lines[3],
+             HUD_LINE_SIZE,
+             "frame    p50 %.0f p99 %.0f us",
+             p50_us(&latency),
+             p99_us(&latency));
+    snprintf(hud->lines[4],
+             HUD_LINE_SIZE,
+             "lock wait p99 parse %.0f render %.0f us",
+             p99_us(&parse_wait),
+             p99_us(&render_wait));
+    snprintf(hud->lines[5],
+             HUD_LINE_SIZE,
+             "skipped %lu  buffer busy %lu",
+             cur.frames_skipped - hud->prev.frames_skipped,
+             cur.buffer_busy - hud->prev.buffer_busy);
+    snprintf(hud->lines[6],
+             HUD_LINE_SIZE,
+             "to present p99 output %.0f key %.0f us",
+             p99_us(&output_present),
+             p99_us(&key_present));
+
+    hud->last = now;
+    hud->prev = cur;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define HUD_LINES 7
+#define HUD_LINE_SIZE 64
+
+/*
+ * On-screen overlay with the stats of the last second, enabled with
+ * HOOKTTY_HUD=1. Only touched by the thread that paints, the stats it reads
+ * are written by the others, see struct histogram.
+ */
+struct hud
+{
+    bool enabled;
+
+    uint64_t last;     // time of the last update
+    struct stats prev; // copy of the stats at `last`
+
+    char lines[HUD_LINES][HUD_LINE_SIZE];
+    const char* line_ptrs[HUD_LINES];
+};
+
+void
+hud_init(struct hud* hud);
+
+// updates the lines once a second, the rates and percentiles are over the
+// time since the last update
+void
+hud_update(struct hud* hud, const struct stats* stats);
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "macros.h"
+#include "mem.h"
+#include "stats.h"
+
+#define LOG_BUFFER_SIZE (64 * 1024) // power of 2
+#define LOG_BUFFER_MASK (LOG_BUFFER_SIZE - 1)
+#define LOG_LINE_MAX 1024
+// lines are batched for this long before the flusher writes them
+#define LOG_FLUSH_DELAY_US (20 * 1000)
+
+enum log_level log_level = LOG_INFO;
+
+static const char* const level_names[] = {
+    [LOG_DEBUG] = "DEBUG",
+    [LOG_INFO] = "INFO",
+    [LOG_WARN] = "WARNING",
+    [LOG_ERR] = "ERROR",
+};
+
+static const char* const level_colors[] = {
+    [LOG_DEBUG] = ANSI_BLUE,
+    [LOG_INFO] = ANSI_CYAN,
+    [LOG_WARN] = ANSI_YELLOW,
+    [LOG_ERR] = ANSI_RED,
+};
+
+/*
+ * Single producer byte ring of one thread, the owner appends whole lines at
+ * `head`, the drain writes out everything up to `head` under drain_mutex
+ * and moves `tail`.
+ */
+struct log_buffer
+{
+    struct log_buffer* next;
+
+    atomic_size_t head;
+    atomic_size_t tail;
+
+    // "%H:%M:%S" of `sec`, localtime_r() runs once a second at most
+    time_t sec;
+    char time_buf[9];
+
+    char buf[LOG_BUFFER_SIZE];
+};
+
+// under drain_mutex, a thread adds its buffer with its first line and
+// buffer_key frees it when the thread exits
+static struct log_buffer* buffers;
+static __thread struct log_buffer* thread_buffer;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+static bool flusher_running;
+static int flusher_fd = -1;
+static atomic_bool flush_pending;
+static atomic_uint_fast64_t dropped;
+
+__attribute__((constructor)) static void
+log_init(void)
+{
+    log_level = getenv("HOOKTTY_DEBUG") ? LOG_DEBUG : LOG_INFO;
+}
+
+static void
+write_all(const char* p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(STDOUT_FILENO, p, n);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return;
+
+        p += w;
+        n -= w;
+    }
+}
+
+static void
+drain(void)
+{
+    for (struct log_buffer* b = buffers; b; b = b->next) {
+        size_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+
+        if (head == tail)
+            continue;
+
+        size_t off = tail & LOG_BUFFER_MASK;
+        size_t len = head - tail;
+        size_t first = min(len, LOG_BUFFER_SIZE - off);
+
+        write_all(b->buf + off, first);
+        write_all(b->buf, len - first);
+
+        atomic_store_explicit(&b->tail, head, memory_order_release);
+    }
+
+    uint64_t n = atomic_exchange(&dropped, 0);
+    if (n > 0) {
+        char line[96];
+        int len = snprintf(line,
+                           sizeof(line),
+                           ANSI_YELLOW "[WARNING] %lu log lines dropped, "
+                                       "buffer full" ANSI_RESET "\n",
+                           n);
+        write_all(line, len);
+    }
+}
+
+void
+log_flush(void)
+{
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+static void*
+flusher_thread(void* data)
+{
+    struct pollfd pfd = { .fd = flusher_fd, .events = POLLIN };
+
+    for (;;) {
+        uint64_t v;
+
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        if (read(flusher_fd, &v, sizeof(v)) != sizeof(v))
+            continue;
+
+        usleep(LOG_FLUSH_DELAY_US);
+
+        // cleared first, a line added during the drain asks for another
+        atomic_store(&flush_pending, false);
+        log_flush();
+    }
+
+    return NULL;
+}
+
+static void
+start_flusher(void)
+{
+    atexit(log_flush);
+
+    flusher_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (flusher_fd < 0)
+        return;
+
+    // the first line can come before the loop blocks its signals, none of
+    // them may land on this thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_t tid;
+    flusher_running =
+      pthread_create(&tid, NULL, flusher_thread, NULL) == 0;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// the thread exited, its lines are written out before the buffer goes
+static void
+log_buffer_free(void* data)
+{
+    struct log_buffer* b = data;
+
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+
+    for (struct log_buffer** p = &buffers; *p; p = &(*p)->next) {
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&drain_mutex);
+
+    thread_buffer = NULL;
+    mem_free(MEM_DIAG, b);
+}
+
+static void
+create_buffer_key(void)
+{
+    pthread_key_create(&buffer_key, log_buffer_free);
+}
+
+static struct log_buffer*
+log_buffer_get(void)
+{
+    if (thread_buffer != NULL)
+        return thread_buffer;
+
+    struct log_buffer* b = mem_calloc(MEM_DIAG, 1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    atomic_init(&b->head, 0);
+    atomic_init(&b->tail, 0);
+
+    pthread_once(&buffer_key_once, create_buffer_key);
+    pthread_setspecific(buffer_key, b);
+
+    pthread_mutex_lock(&drain_mutex);
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&drain_mutex);
+
+    thread_buffer = b;
+    return b;
+}
+
+static bool
+log_buffer_push(struct log_buffer* b, const char* line, size_t len)
+{
+    size_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&b->tail, memory_order_acquire);
+
+    if (LOG_BUFFER_SIZE - (head - tail) < len)
+        return false;
+
+    size_t off = head & LOG_BUFFER_MASK;
+    size_t first = min(len, LOG_BUFFER_SIZE - off);
+
+    memcpy(b->buf + off, line, first);
+    memcpy(b->buf, line + first, len - first);
+
+    atomic_store_explicit(&b->head, head + len, memory_order_release);
+
+    return true;
+}
+
+// appends to `line` at `*n`, truncating at `size`
+static void
+line_append(char* line, size_t size, size_t* n, const char* fmt, ...)
+{
+    if (*n >= size)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    int w = vsnprintf(line + *n, size - *n, fmt, args);
+    va_end(args);
+
+    if (w > 0)
+        *n = min(*n + w, size - 1);
+}
+
+void
+log_msg(enum log_level level,
+        const char* file,
+        int line,
+        const char* func,
+        const char* fmt,
+        ...)
+{
+    static const char end[] = ANSI_RESET "\n";
+
+    pthread_once(&flusher_once, start_flusher);
+
+    struct log_buffer* b = log_buffer_get();
+    if (b == NULL)
+        return;
+
+    time_t now = time(NULL);
+    if (now != b->sec) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(b->time_buf, sizeof(b->time_buf), "%H:%M:%S", &tm);
+        b->sec = now;
+    }
+
+    // room for `end` is kept at the back
+    char buf[LOG_LINE_MAX];
+    size_t size = sizeof(buf) - (sizeof(end) - 1);
+    size_t n = 0;
+
+    line_append(buf,
+                size,
+                &n,
+                "%s[%s] [%s] ",
+                level_colors[level],
+                level_names[level],
+                b->time_buf);
+
+    if (level == LOG_DEBUG)
+        line_append(buf, size, &n, "%s:%d (%s()) ", file, line, func);
+
+    va_list args;
+    va_start(args, fmt);
+    int w = vsnprintf(buf + n, size - n, fmt, args);
+    va_end(args);
+
+    if (w > 0)
+        n = min(n + w, size - 1);
+
+    memcpy(buf + n, end, sizeof(end) - 1);
+    n += sizeof(end) - 1;
+
+    if (!log_buffer_push(b, buf, n))
+        atomic_fetch_add(&dropped, 1);
+
+    if (level >= LOG_ERR || !flusher_running) {
+        log_flush();
+        return;
+    }
+
+    if (!atomic_exchange(&flush_pending, true)) {
+        uint64_t one = 1;
+        write(flusher_fd, &one, sizeof(one));
+    }
+}
+
+bool
+log_ratelimit(struct log_ratelimit* rl, const char* file, int line)
+{
+    uint64_t now = now_ns();
+
+    if (rl->start == 0 || now - rl->start >= LOG_RATELIMIT_INTERVAL_NS) {
+        if (rl->suppressed > 0)
+            log_msg(LOG_WARN,
+                    file,
+                    line,
+                    __func__,
+                    "%s:%d: suppressed %lu similar messages",
+                    file,
+                    line,
+                    rl->suppressed);
+
+        rl->start = now;
+        rl->printed = 0;
+        rl->suppressed = 0;
+    }
+
+    if (rl->printed < LOG_RATELIMIT_BURST) {
+        rl->printed++;
+        return true;
+    }
+
+    if (rl->suppressed++ == 0)
+        log_msg(LOG_WARN,
+                file,
+                line,
+                __func__,
+                "%s:%d: suppressing similar messages for %llu s",
+                file,
+                line,
+                LOG_RATELIMIT_INTERVAL_NS / 1000000000ull);
+
+    return false;
+}
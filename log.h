@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous logger behind the HOG* macros.
+ *
+ * The level is resolved once at startup, debug with HOOKTTY_DEBUG set and
+ * info otherwise, and messages below it cost a load and a branch. Messages
+ * below HOOKTTY_LOG_MIN_LEVEL (`make LOG_MIN_LEVEL=n`) are compiled out.
+ *
+ * Lines are formatted into a buffer of the calling thread and written to
+ * stdout by a background thread, errors are written before returning so
+ * they make it out before an abort(). A thread whose buffer is full drops
+ * the line instead of waiting, the count of dropped lines is logged.
+ */
+
+enum log_level
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERR,
+};
+
+#ifndef HOOKTTY_LOG_MIN_LEVEL
+#define HOOKTTY_LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+extern enum log_level log_level;
+
+void
+log_msg(enum log_level level,
+        const char* file,
+        int line,
+        const char* func,
+        const char* fmt,
+        ...) __attribute__((format(printf, 5, 6)));
+
+// writes out everything logged so far
+void
+log_flush(void);
+
+#define LOG_AT(level, fmt, ...)                                                \
+    do {                                                                       \
+        if ((level) >= HOOKTTY_LOG_MIN_LEVEL && (level) >= log_level)          \
+            log_msg(                                                           \
+              (level), __FILE__, __LINE__, __func__, fmt, ##__VA_ARGS__);      \
+    } while (0)
+
+#define HOG(fmt, ...) LOG_AT(LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define HOG_INFO(fmt, ...) LOG_AT(LOG_INFO, fmt, ##__VA_ARGS__)
+#define HOG_WARN(fmt, ...) LOG_AT(LOG_WARN, fmt, ##__VA_ARGS__)
+#define HOG_ERR(fmt, ...) LOG_AT(LOG_ERR, fmt, ##__VA_ARGS__)
+
+// a call site logs at most LOG_RATELIMIT_BURST lines every
+// LOG_RATELIMIT_INTERVAL_NS per thread, then how many it suppressed
+#define LOG_RATELIMIT_BURST 5
+#define LOG_RATELIMIT_INTERVAL_NS (10 * 1000000000ull)
+
+struct log_ratelimit
+{
+    uint64_t start; // of the current interval
+    uint32_t printed;
+    uint64_t suppressed;
+};
+
+// true if the call site may log now
+bool
+log_ratelimit(struct log_ratelimit* rl, const char* file, int line);
+
+#define LOG_RATELIMITED(level, fmt, ...)                                       \
+    do {                                                                       \
+        static _Thread_local struct log_ratelimit rl_;                         \
+        if ((level) >= HOOKTTY_LOG_MIN_LEVEL && (level) >= log_level &&        \
+            log_ratelimit(&rl_, __FILE__, __LINE__))                           \
+            log_msg(                                                           \
+              (level), __FILE__, __LINE__, __func__, fmt, ##__VA_ARGS__);      \
+    } while (0)
+
+// for input driven errors like unsupported escape sequences
+#define HOG_WARN_RATELIMITED(fmt, ...)                                         \
+    LOG_RATELIMITED(LOG_WARN, fmt, ##__VA_ARGS__)
+#define HOG_ERR_RATELIMITED(fmt, ...)                                          \
+    LOG_RATELIMITED(LOG_ERR, fmt, ##__VA_ARGS__)
@@ -0,0 +1,500 @@
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "macros.h"
+#include "main.h"
+#include "mem.h"
+#include "pty-write.h"
+#include "seat.h"
+#include "trace.h"
+
+#define LOOP_MAX_EVENTS 8
+
+// pidfds of the children of closed windows, reaped on the server's SIGCHLD
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int* orphans;
+static size_t orphan_count;
+
+enum loop_source
+{
+    LOOP_WAYLAND,
+    LOOP_PTY,
+    LOOP_TIMER,
+    LOOP_SIGNAL,
+    LOOP_WAKE,
+    LOOP_MEM_LOG,
+    LOOP_CHILD,
+};
+
+static bool
+loop_add(struct loop* loop, int fd, uint32_t events, enum loop_source src)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = src };
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+
+    return true;
+}
+
+static void
+loop_mod(struct loop* loop, int fd, uint32_t events, enum loop_source src)
+{
+    struct epoll_event ev = { .events = events, .data.u32 = src };
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+bool
+loop_init(struct loop* loop, bool signals)
+{
+    const char* st = getenv("HOOKTTY_SINGLE_THREAD");
+    loop->single_thread = st && *st && strcmp(st, "0") != 0;
+    loop->wl_want_out = false;
+    loop->signal_fd = loop->mem_log_fd = loop->child_fd = -1;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (loop->epoll_fd < 0 || loop->timer_fd < 0 || loop->wake_fd < 0) {
+        perror("loop_init");
+        return false;
+    }
+
+    if (!loop_add(loop, loop->timer_fd, EPOLLIN, LOOP_TIMER) ||
+        !loop_add(loop, loop->wake_fd, EPOLLIN, LOOP_WAKE))
+        return false;
+
+    // a server owns the signals
+    if (!signals)
+        return true;
+
+    // has to happen before any thread is created, they inherit the mask and a
+    // SIGCHLD or SIGUSR1 delivered to one of them would never reach the signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+#ifdef HOOKTTY_TRACE
+    sigaddset(&mask, SIGUSR2);
+#endif
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    loop->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->signal_fd < 0) {
+        perror("signalfd");
+        return false;
+    }
+
+    if (!loop_add(loop, loop->signal_fd, EPOLLIN, LOOP_SIGNAL))
+        return false;
+
+    const char* mem_log = getenv("HOOKTTY_MEM_LOG");
+    long secs = mem_log ? strtol(mem_log, NULL, 10) : 0;
+    if (secs > 0) {
+        loop->mem_log_fd =
+          timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        struct itimerspec its = {
+            .it_value = { secs, 0 },
+            .it_interval = { secs, 0 },
+        };
+
+        if (loop->mem_log_fd >= 0 &&
+            timerfd_settime(loop->mem_log_fd, 0, &its, NULL) == 0)
+            loop_add(loop, loop->mem_log_fd, EPOLLIN, LOOP_MEM_LOG);
+        else
+            perror("HOOKTTY_MEM_LOG");
+    }
+
+    return true;
+}
+
+// the child of a window that closed first, it got a hangup from the pty
+// but may ignore it
+static void
+adopt_orphan(int child_fd)
+{
+    siginfo_t info = { 0 };
+
+    // under the mutex, a SIGCHLD handled after the check sees it in the list
+    pthread_mutex_lock(&orphans_mutex);
+
+    if (waitid(P_PIDFD, child_fd, &info, WEXITED | WNOHANG) < 0 ||
+        info.si_pid != 0) {
+        close(child_fd);
+    } else {
+        int* p = realloc(orphans, (orphan_count + 1) * sizeof(*orphans));
+        if (p != NULL) {
+            orphans = p;
+            orphans[orphan_count++] = child_fd;
+        } else {
+            close(child_fd);
+        }
+    }
+
+    pthread_mutex_unlock(&orphans_mutex);
+}
+
+void
+loop_reap_orphans(void)
+{
+    size_t kept = 0;
+
+    pthread_mutex_lock(&orphans_mutex);
+
+    for (size_t i = 0; i < orphan_count; i++) {
+        siginfo_t info = { 0 };
+
+        if (waitid(P_PIDFD, orphans[i], &info, WEXITED | WNOHANG) == 0 &&
+            info.si_pid == 0)
+            orphans[kept++] = orphans[i];
+        else
+            close(orphans[i]);
+    }
+    orphan_count = kept;
+
+    pthread_mutex_unlock(&orphans_mutex);
+}
+
+void
+loop_fini(struct loop* loop)
+{
+    int fds[] = { loop->epoll_fd,  loop->timer_fd,  loop->wake_fd,
+                  loop->signal_fd, loop->mem_log_fd };
+
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    if (loop->child_fd >= 0)
+        adopt_orphan(loop->child_fd);
+}
+
+void
+loop_add_child(struct loop* loop, int pid)
+{
+    if (loop->signal_fd >= 0)
+        return;
+
+    // nobody reaps the child before handle_child(), the pid can't be reused
+    // until then
+    loop->child_fd = syscall(SYS_pidfd_open, pid, 0);
+    if (loop->child_fd < 0) {
+        perror("pidfd_open");
+        return;
+    }
+
+    // the window still closes on EOF from the pty
+    if (!loop_add(loop, loop->child_fd, EPOLLIN, LOOP_CHILD)) {
+        close(loop->child_fd);
+        loop->child_fd = -1;
+    }
+}
+
+bool
+loop_add_pty(struct loop* loop, int fd)
+{
+    return loop_add(loop, fd, EPOLLIN, LOOP_PTY);
+}
+
+void
+loop_watch_pty_out(struct loop* loop, int fd, bool out)
+{
+    struct epoll_event ev = {
+        .events = (loop->single_thread ? EPOLLIN : 0) | (out ? EPOLLOUT : 0),
+        .data.u32 = LOOP_PTY,
+    };
+
+    // with the reader thread the pty is only in the set while there is
+    // something to write, a hung up pty would keep waking us up otherwise
+    int op = loop->single_thread ? EPOLL_CTL_MOD
+             : out               ? EPOLL_CTL_ADD
+                                 : EPOLL_CTL_DEL;
+
+    if (epoll_ctl(loop->epoll_fd, op, fd, &ev) < 0)
+        perror("epoll_ctl pty");
+}
+
+void
+loop_wake(struct loop* loop)
+{
+    uint64_t one = 1;
+    write(loop->wake_fd, &one, sizeof(one));
+}
+
+void
+loop_arm_timer(struct loop* loop, uint32_t delay_ms, uint32_t interval_ms)
+{
+    struct itimerspec its = {
+        .it_value = { delay_ms / 1000, (delay_ms % 1000) * 1000000L },
+        .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L },
+    };
+
+    timerfd_settime(loop->timer_fd, 0, &its, NULL);
+}
+
+// appends the stats so far, the memory accounting and the
+// HOOKTTY_VT_PROFILE table to HOOKTTY_STATS_FILE, by default
+// /tmp/hooktty-stats-<pid>.txt
+void
+dump_stats(struct state* state)
+{
+    char buf[64];
+    const char* path = getenv("HOOKTTY_STATS_FILE");
+
+    if (!path || !*path) {
+        snprintf(buf, sizeof(buf), "/tmp/hooktty-stats-%d.txt", getpid());
+        path = buf;
+    }
+
+    FILE* f = fopen(path, "a");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+
+    time_t t = time(NULL);
+    strftime(buf, sizeof(buf), "%F %T", localtime(&t));
+
+    fprintf(f, "--- %s\n", buf);
+    stats_dump(&state->stats, f);
+    startup_dump(&state->startup, f);
+    mem_dump(f);
+
+    if (state->vt->profile) {
+        pthread_mutex_lock(&state->grid_mutex);
+        vt_profile_report(state->vt->profile, f, 0);
+        pthread_mutex_unlock(&state->grid_mutex);
+    }
+
+    fclose(f);
+
+    HOG_INFO("stats written to %s", path);
+}
+
+#ifdef HOOKTTY_TRACE
+// writes the trace rings to HOOKTTY_TRACE_FILE, by default
+// /tmp/hooktty-trace-<pid>.json
+void
+dump_trace(void)
+{
+    char buf[64];
+    const char* path = getenv("HOOKTTY_TRACE_FILE");
+
+    if (!path || !*path) {
+        snprintf(buf, sizeof(buf), "/tmp/hooktty-trace-%d.json", getpid());
+        path = buf;
+    }
+
+    if (!trace_dump(path)) {
+        perror(path);
+        return;
+    }
+
+    HOG_INFO("trace written to %s", path);
+}
+#endif
+
+static void
+handle_signals(struct state* state)
+{
+    struct signalfd_siginfo si;
+
+    while (read(state->loop.signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) {
+            dump_stats(state);
+            continue;
+        }
+
+#ifdef HOOKTTY_TRACE
+        if (si.ssi_signo == SIGUSR2) {
+            dump_trace();
+            continue;
+        }
+#endif
+
+        if (si.ssi_signo != SIGCHLD)
+            continue;
+
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (pid == state->child_pid) {
+                HOG_INFO("shell exited");
+                state->keep_running = false;
+            }
+        }
+    }
+}
+
+// the pidfd is readable once the child exited, in a server it may be reaped
+// already
+static void
+handle_child(struct state* state)
+{
+    struct loop* loop = &state->loop;
+    siginfo_t info;
+
+    waitid(P_PIDFD, loop->child_fd, &info, WEXITED | WNOHANG);
+
+    HOG_INFO("shell exited");
+    state->keep_running = false;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->child_fd, NULL);
+    close(loop->child_fd);
+    loop->child_fd = -1;
+}
+
+static void
+handle_timer(struct state* state)
+{
+    uint64_t expirations;
+
+    if (read(state->loop.timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+        return;
+
+    keyboard_repeat(state, expirations);
+}
+
+static void
+handle_pty(struct state* state, uint32_t events)
+{
+    if (events & (EPOLLOUT | EPOLLERR))
+        pty_flush(state);
+
+    if (!state->loop.single_thread || !(events & (EPOLLIN | EPOLLHUP)))
+        return;
+
+    if (!pty_read_and_parse(state)) {
+        epoll_ctl(state->loop.epoll_fd, EPOLL_CTL_DEL, state->master_fd, NULL);
+        HOG_INFO("pty closed");
+        state->keep_running = false;
+    }
+}
+
+// false on a fatal display error
+static bool
+flush_display(struct state* state)
+{
+    struct loop* loop = &state->loop;
+    int wl_fd = wl_display_get_fd(state->display);
+
+    if (wl_display_flush(state->display) < 0) {
+        if (errno != EAGAIN)
+            return false;
+
+        // the socket is full, try again once it can take more
+        if (!loop->wl_want_out) {
+            loop->wl_want_out = true;
+            loop_mod(loop, wl_fd, EPOLLIN | EPOLLOUT, LOOP_WAYLAND);
+        }
+    } else if (loop->wl_want_out) {
+        loop->wl_want_out = false;
+        loop_mod(loop, wl_fd, EPOLLIN, LOOP_WAYLAND);
+    }
+
+    return true;
+}
+
+void
+loop_run(struct state* state)
+{
+    struct loop* loop = &state->loop;
+    struct wl_display* display = state->display;
+
+    loop_add(loop, wl_display_get_fd(display), EPOLLIN, LOOP_WAYLAND);
+
+    while (state->keep_running) {
+        // events already queued have to be dispatched before we can read
+        while (wl_display_prepare_read(display) != 0) {
+            if (wl_display_dispatch_pending(display) < 0)
+                goto display_error;
+        }
+
+        if (!flush_display(state)) {
+            wl_display_cancel_read(display);
+            goto display_error;
+        }
+
+        struct epoll_event events[LOOP_MAX_EVENTS];
+        int n = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, -1);
+
+        if (n < 0) {
+            wl_display_cancel_read(display);
+            if (errno == EINTR)
+                continue;
+
+            perror("epoll_wait");
+            break;
+        }
+
+        bool wl_readable = false;
+        for (int i = 0; i < n; i++)
+            if (events[i].data.u32 == LOOP_WAYLAND &&
+                (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                wl_readable = true;
+
+        // the read has to be finished or cancelled before anything else can
+        // touch the display
+        if (wl_readable) {
+            if (wl_display_read_events(display) < 0)
+                goto display_error;
+        } else {
+            wl_display_cancel_read(display);
+        }
+
+        for (int i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+                case LOOP_PTY:
+                    handle_pty(state, events[i].events);
+                    break;
+                case LOOP_TIMER:
+                    handle_timer(state);
+                    break;
+                case LOOP_SIGNAL:
+                    handle_signals(state);
+                    break;
+                case LOOP_WAKE: {
+                    uint64_t v;
+                    read(loop->wake_fd, &v, sizeof(v));
+                    finish_render(state);
+                    if (atomic_load(&state->pty_closed))
+                        state->keep_running = false;
+                    break;
+                }
+                case LOOP_CHILD:
+                    handle_child(state);
+                    break;
+                case LOOP_MEM_LOG: {
+                    uint64_t v;
+                    read(loop->mem_log_fd, &v, sizeof(v));
+                    mem_log();
+                    break;
+                }
+            }
+        }
+
+        if (wl_display_dispatch_pending(display) < 0)
+            goto display_error;
+
+        request_frame(state);
+    }
+
+    return;
+
+display_error:
+    HOG_ERR("wayland display error: %d", wl_display_get_error(display));
+}
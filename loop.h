@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct state;
+
+/*
+ * epoll loop of the main thread, waits on the wayland socket, a timerfd, a
+ * signalfd for SIGCHLD, an eventfd other threads use to wake it up and in
+ * single threaded mode (HOOKTTY_SINGLE_THREAD=1) the pty. The windows of a
+ * server run one each on their own thread, without the signalfd, the exit
+ * of the child comes from a pidfd instead.
+ *
+ * HOOKTTY_MEM_LOG=<seconds> adds a timerfd that logs the memory accounting
+ * of mem.h every that many seconds.
+ */
+struct loop
+{
+    int epoll_fd;
+    int timer_fd;
+    int signal_fd;
+    int wake_fd;
+    int mem_log_fd; // -1 without HOOKTTY_MEM_LOG
+    int child_fd;   // pidfd, -1 unless in a server or once reaped
+
+    bool single_thread;
+    bool wl_want_out; // the last flush didn't fit in the socket
+};
+
+// with `signals`, blocks SIGCHLD for every thread created after and reads
+// it from a signalfd, call before start_pty. False if an fd can't be created,
+// loop_fini() closes the ones that were
+bool
+loop_init(struct loop* loop, bool signals);
+
+// closes everything loop_init() and loop_add_child() opened, after the pty.
+// A child still running is left to loop_reap_orphans()
+void
+loop_fini(struct loop* loop);
+
+// reaps the children loop_fini() left that exited since, the server calls
+// it on SIGCHLD
+void
+loop_reap_orphans(void);
+
+// ends loop_run() when `pid` exits and reaps it, without the signalfd
+void
+loop_add_child(struct loop* loop, int pid);
+
+// in single threaded mode the pty is read and parsed by the loop
+bool
+loop_add_pty(struct loop* loop, int fd);
+
+// returns when `state->keep_running` is cleared or the display fails
+void
+loop_run(struct state* state);
+
+// EPOLLOUT on the pty while the write queue has data, safe to call from any
+// thread but the calls have to be serialized
+void
+loop_watch_pty_out(struct loop* loop, int fd, bool out);
+
+// safe to call from any thread
+void
+loop_wake(struct loop* loop);
+
+// first expiry after `delay_ms`, then every `interval_ms` (0 for a one shot),
+// a `delay_ms` of 0 disarms the timer
+void
+loop_arm_timer(struct loop* loop, uint32_t delay_ms, uint32_t interval_ms);
+
+// SIGUSR1, appends the stats of `state` to HOOKTTY_STATS_FILE
+void
+dump_stats(struct state* state);
+
+#ifdef HOOKTTY_TRACE
+// SIGUSR2, writes the trace rings to HOOKTTY_TRACE_FILE
+void
+dump_trace(void);
+#endif
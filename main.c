@@ -1,13 +1,16 @@
+#define _GNU_SOURCE
 #include "string.h"
 #include "wayland-client-protocol.h"
 #include <assert.h>
 #include <dll.h>
 #include <fcntl.h>
 #include <ft2build.h>
-#include <locale.h>
 #include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
@@ -16,55 +19,30 @@
 #include <pixman.h>
 #include <uchar.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pty.h>
 
 #include "ansi.h"
+#include "capture.h"
+#include "hud.h"
+#include "loop.h"
 #include "macros.h"
 #include "main.h"
+#include "mem.h"
+#include "presentation-time-client-protocol.h"
+#include "pty-read.h"
+#include "render.h"
+#include "ring.h"
 #include "seat.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include "vt.h"
 #include "xdg-shell.h"
 
-static const float alpha = 0.8;
-static const struct color COLOR_BACKGROUND = { 25,
-                                               25,
-                                               25,
-                                               (unsigned char)(255 * alpha) };
-static const struct color COLOR_FOREGROUND = { 255, 255, 255, 255 };
-static const struct attributes DEFAULT_ATTRS = {
-    COLOR_FOREGROUND, COLOR_BACKGROUND, false, false, false,
-};
-
-static const struct color COLOR_CURSOR_FOREGROUND = { 255, 120, 180, 255 };
-static const struct color COLOR_CURSOR_BACKGROUND = COLOR_BACKGROUND;
-
-static const struct color COLOR_BRIGHT_0 = { 57, 57, 57, 255 };
-static const struct color COLOR_BRIGHT_1 = { 238, 83, 150, 255 };
-static const struct color COLOR_BRIGHT_2 = { 66, 190, 101, 255 };
-static const struct color COLOR_BRIGHT_3 = { 255, 233, 123, 255 };
-static const struct color COLOR_BRIGHT_4 = { 51, 177, 255, 255 };
-static const struct color COLOR_BRIGHT_5 = { 255, 126, 182, 255 };
-static const struct color COLOR_BRIGHT_6 = { 61, 219, 217, 255 };
-static const struct color COLOR_BRIGHT_7 = { 255, 255, 255, 255 };
-
-static const struct color COLOR_REGULAR_0 = { 0, 0, 0, 255 };
-static const struct color COLOR_REGULAR_1 = { 255, 126, 182, 255 };
-static const struct color COLOR_REGULAR_2 = { 66, 190, 101, 255 };
-static const struct color COLOR_REGULAR_3 = { 255, 233, 123, 255 };
-static const struct color COLOR_REGULAR_4 = { 51, 177, 255, 255 };
-static const struct color COLOR_REGULAR_5 = { 255, 126, 182, 255 };
-static const struct color COLOR_REGULAR_6 = { 61, 219, 217, 255 };
-static const struct color COLOR_REGULAR_7 = { 221, 225, 230, 255 };
-
-static const struct color SYSTEM_COLORS[16] = {
-    COLOR_REGULAR_0, COLOR_REGULAR_1, COLOR_REGULAR_2, COLOR_REGULAR_3,
-    COLOR_REGULAR_4, COLOR_REGULAR_5, COLOR_REGULAR_6, COLOR_REGULAR_7,
-
-    COLOR_BRIGHT_0,  COLOR_BRIGHT_1,  COLOR_BRIGHT_2,  COLOR_BRIGHT_3,
-    COLOR_BRIGHT_4,  COLOR_BRIGHT_5,  COLOR_BRIGHT_6,  COLOR_BRIGHT_7,
-};
-
 static void
 buffer_release(void* data, struct wl_buffer* buffer)
 {
@@ -72,6 +50,7 @@ buffer_release(void* data, struct wl_buffer* buffer)
     buff->busy = 0;
 }
 
+// NULL while the compositor holds both buffers
 static struct buffer*
 get_free_buff(struct state* state)
 {
@@ -82,276 +61,59 @@ get_free_buff(struct state* state)
     if (!state->buff2->busy)
         buff = state->buff2;
 
-    if (buff == NULL) {
-        HOG_ERR("Both buffers are busy.");
-        exit(1);
-    }
+    if (buff == NULL)
+        stat_add(&state->stats.buffer_busy, 1);
 
     return buff;
 }
 
 static const struct wl_buffer_listener buffer_listener = { buffer_release };
 
-struct font*
-find_fallback_font(struct state* state, uint32_t ch)
-{
-    dll_for_each(state->fallback_fonts, i)
-    {
-        if (!FcCharSetHasChar(i->val.fc_charset, ch))
-            continue;
-        return &i->val;
-    }
-    return NULL;
-}
-
-static struct pixman_color
-color_to_pixman_color(struct color color)
-{
-    return (struct pixman_color){
-        (uint16_t)(color.r * 257),
-        (uint16_t)(color.g * 257),
-        (uint16_t)(color.b * 257),
-        (uint16_t)(color.a * 257),
-    };
-}
-
+// `width` and `height` are in pixels, runs on the render thread
 static void
-render_char_at(struct font* font,
-               pixman_image_t* buf_img,
-               struct cell* cell,
-               int x,
-               int y,
-               int cell_height,
-               int cell_width)
+paint_data(struct state* state, struct buffer* buff, int width, int height)
 {
-    FT_Error ft_err;
-
-    int font_height = font->ft_face->size->metrics.height / 63.;
-
-    int glyph_index = FT_Get_Char_Index(font->ft_face, cell->ch);
-
-    ft_err = FT_Load_Glyph(font->ft_face, glyph_index, FT_LOAD_DEFAULT);
-    if (ft_err != FT_Err_Ok) {
-        HOG_ERR("Failed to load glyph");
-        abort();
-    }
-
-    ft_err = FT_Render_Glyph(font->ft_face->glyph, FT_RENDER_MODE_NORMAL);
-    if (ft_err != FT_Err_Ok) {
-        HOG_ERR("Failed to load glyph");
-        abort();
-    }
-
-    FT_Bitmap bitmap = font->ft_face->glyph->bitmap;
-
-    int stride =
-      (((PIXMAN_FORMAT_BPP(PIXMAN_a8) * bitmap.width + 7) / 8 + 4 - 1) & -4);
-
-    uint8_t* glyph_pix = malloc(bitmap.rows * stride);
-    if (stride == bitmap.pitch) {
-        memcpy(glyph_pix, bitmap.buffer, bitmap.rows * stride);
-    } else {
-        for (size_t r = 0; r < bitmap.rows; r++) {
-            for (size_t c = 0; c < bitmap.width; c++)
-                glyph_pix[r * stride + c] = bitmap.buffer[r * bitmap.pitch + c];
-        }
-    }
-
-    pixman_image_t* glyph_img = pixman_image_create_bits_no_clear(
-      PIXMAN_a8, bitmap.width, bitmap.rows, (uint32_t*)glyph_pix, stride);
-
-    int dst_x = x + (cell_width - bitmap.width) / 2;
-
-    int ascent = font->ft_face->size->metrics.ascender / 63.;
-    int baseline = y - cell_height + ascent;
-    int dst_y = baseline - font->ft_face->glyph->bitmap_top;
-
-    struct pixman_color fg = color_to_pixman_color(
-      (cell->attrs.inverse) ? cell->attrs.bg : cell->attrs.fg);
-
-    struct pixman_color bg = color_to_pixman_color(
-      (cell->attrs.inverse) ? cell->attrs.fg : cell->attrs.bg);
-
-    pixman_image_t* color_img = pixman_image_create_solid_fill(&fg);
-
-    pixman_image_fill_rectangles(
-      PIXMAN_OP_SRC,
-      buf_img,
-      &bg,
-      1,
-      (pixman_rectangle16_t[]){
-        { x, y - cell_height, cell_width, cell_height } });
-
-    pixman_image_composite(PIXMAN_OP_OVER,
-                           color_img,
-                           glyph_img,
-                           buf_img,
-                           0,
-                           0,
-                           0,
-                           0,
-                           dst_x,
-                           dst_y,
-                           bitmap.width,
-                           bitmap.rows);
-
-    if (cell->attrs.underline) {
-        int upos = font->ft_face->underline_position / 64.;
-        int uthick = font->ft_face->underline_thickness / 64.;
-
-        pixman_color_t ucolor = color_to_pixman_color(COLOR_FOREGROUND);
-
-        pixman_image_fill_rectangles(PIXMAN_OP_SRC,
-                                     buf_img,
-                                     &ucolor,
-                                     1,
-                                     &(pixman_rectangle16_t){
-                                       .x = x,
-                                       .y = baseline - upos,
-                                       .width = cell_width,
-                                       .height = uthick,
-                                     });
-    }
-
-    pixman_image_unref(glyph_img);
-    pixman_image_unref(color_img);
-    free(glyph_pix);
-}
-
-static inline struct row**
-get_grid(struct state* state)
-{
-    return (state->alt_screen) ? state->alt_grid : state->grid;
-}
-
-static inline struct cursor*
-get_cursor(struct state* state)
-{
-    return (state->alt_screen) ? &state->alt_cursor : &state->cursor;
-}
-
-static void
-paint_data(struct state* state, struct buffer* buff, uint32_t time)
-{
-    int height = state->height * state->output_scale_factor;
-    int width = state->width * state->output_scale_factor;
-
-    struct row** grid = get_grid(state);
-    assert(grid != NULL);
-
     uint32_t* data =
       state->shm_data +
       buff->offset / 4; // buff->offset is byte offset, here we don't need bytes
 
-    pixman_image_t* buf_img = pixman_image_create_bits_no_clear(
-      PIXMAN_a8r8g8b8, width, height, data, width * 4);
-
-    pixman_region32_t clip;
-    pixman_region32_init_rect(&clip, 0, 0, width, height);
-    pixman_image_set_clip_region32(buf_img, &clip);
-    pixman_region32_fini(&clip);
+    TRACE_BEGIN(paint);
 
-    struct pixman_color bg = color_to_pixman_color(COLOR_BACKGROUND);
-    pixman_image_fill_rectangles(
-      PIXMAN_OP_SRC,
-      buf_img,
-      &bg,
-      1,
-      (pixman_rectangle16_t[]){ { 0, 0, width, height } });
-
-    if (grid[0] == NULL)
-        goto end;
-
-    struct font* font = &state->font;
-    assert(font == &state->font);
-
-    FT_Load_Char(state->font.ft_face, 'M', FT_LOAD_DEFAULT);
-    int x_adv = font->ft_face->glyph->advance.x / 63.;
-    int y_adv = font->ft_face->size->metrics.height / 63.;
-
-    int row_num = state->rows; // TODO
-
-    // TODO: use front/back grids
+    // paint from a copy so the parser only waits for the copy
+    uint64_t lock_start = now_ns();
     pthread_mutex_lock(&state->grid_mutex);
+    uint64_t locked_at = now_ns();
 
-    for (int row_idx = 0; row_idx < row_num; row_idx++) {
-        // skip unused rows
-        if (grid[row_idx]->cells[0].ch == 0) {
-            continue;
-        }
-
-        struct row* row = grid[row_idx];
+    struct snapshot* snap = &state->snapshot;
+    vt_snapshot(state->vt, snap);
 
-        for (int col_idx = 0; col_idx < row->len; col_idx++) {
-            struct cell* cell = &row->cells[col_idx];
+    // present_frame() reads them once the frame is done
+    state->render.output_time = state->output_pending;
+    state->render.key_time = state->key_pending;
+    state->output_pending = state->key_pending = 0;
 
-            uint32_t ch = cell->ch;
-
-            // Don't render null chars
-            if (ch == 0)
-                break;
+    pthread_mutex_unlock(&state->grid_mutex);
 
-            if (!FcCharSetHasChar(font->fc_charset, ch)) {
-                struct font* fallback_font = find_fallback_font(state, ch);
-
-                if (fallback_font == NULL)
-                    HOG_ERR("char: %c not found in fallback fonts nor in "
-                            "specified font",
-                            ch);
-                else
-                    font = fallback_font;
-            }
-
-            render_char_at(font,
-                           buf_img,
-                           cell,
-                           (col_idx + 1) * x_adv,
-                           (row_idx + 1) * y_adv,
-                           state->cell_height,
-                           state->cell_width);
-
-            // set back to default font if using fallback
-            if (font != &state->font)
-                font = &state->font;
-        }
-    }
+    histogram_record(&state->stats.render_lock_wait, locked_at - lock_start);
+    uint64_t paint_start = now_ns();
+    histogram_record(&state->stats.render_lock_hold, paint_start - locked_at);
+    TRACE_END(lock_start, "snapshot");
 
-    cursor* cur = get_cursor(state);
-    struct cell cursor_cell = grid[cur->p.y]->cells[cur->p.x];
+    render_snapshot(&state->fonts, snap, data, width, height, NULL);
 
-    if (cursor_cell.ch != 0) {
-        cursor_cell.attrs.fg = COLOR_CURSOR_BACKGROUND;
-        cursor_cell.attrs.bg = COLOR_CURSOR_FOREGROUND;
+    histogram_record(&state->stats.paint_time, now_ns() - paint_start);
 
-        render_char_at(&state->font,
-                       buf_img,
-                       &cursor_cell,
-                       (cur->p.x + 1) * x_adv,
-                       (cur->p.y + 1) * y_adv,
-                       state->cell_height,
-                       state->cell_width);
-    } else {
-        struct attributes a = DEFAULT_ATTRS;
-        a.fg = COLOR_CURSOR_FOREGROUND;
-        a.bg = COLOR_CURSOR_BACKGROUND;
-        struct cell cursor = { U'\u2588', a };
-
-        render_char_at(&state->font,
-                       buf_img,
-                       &cursor,
-                       (cur->p.x + 1) * x_adv,
-                       (cur->p.y + 1) * y_adv,
-                       state->cell_height,
-                       state->cell_width);
+    if (state->hud.enabled) {
+        hud_update(&state->hud, &state->stats);
+        render_overlay(
+          &state->fonts, data, width, height, state->hud.line_ptrs, HUD_LINES);
     }
 
-    pthread_mutex_unlock(&state->grid_mutex);
-
-end:
-    pixman_image_unref(buf_img);
+    TRACE_END(paint, "paint");
 }
 
-void
+// false if the memory for them can't be had, the window can't go on
+bool
 new_buffers(struct state* state)
 {
     int height = state->height * state->output_scale_factor;
@@ -360,33 +122,34 @@ new_buffers(struct state* state)
 
     stride = width * 4;
     size = stride * height * 2;
-    state->size = size;
 
-    char name[64];
-    snprintf(name, sizeof(name), "/wl_hooktty_shm_buffer_pool-%d", getpid());
-    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-    shm_unlink(name);
+    // anonymous, the windows of a server would race for a shm_open() name
+    int fd = memfd_create("hooktty-buffers", MFD_CLOEXEC);
 
     if (fd < 0) {
         HOG_ERR("Creating a buffer file for %d B failed", size);
-        abort();
+        return false;
     }
 
     if (ftruncate(fd, size) == -1) {
         HOG_ERR("Setting size of buffer file to: %d failed", size);
         close(fd);
-        abort();
+        return false;
     }
 
-    state->shm_data =
-      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    if (state->shm_data == MAP_FAILED) {
+    if (data == MAP_FAILED) {
         HOG_ERR("Mapping shm_data with mmap to fd failed");
         close(fd);
-        abort();
+        return false;
     }
 
+    state->shm_data = data;
+    state->size = size;
+
+    mem_track(MEM_SHM, size);
+
     struct wl_shm_pool* pool;
     pool = wl_shm_create_pool(state->shm, fd, size);
 
@@ -412,9 +175,11 @@ new_buffers(struct state* state)
       state->buff1->buffer, &buffer_listener, state->buff1);
     wl_buffer_add_listener(
       state->buff2->buffer, &buffer_listener, state->buff2);
+
+    return true;
 }
 
-static void
+static bool
 update_buffs(struct state* state)
 {
     if (state->buff1) {
@@ -430,160 +195,297 @@ update_buffs(struct state* state)
 
         free(state->buff2);
     }
+    state->buff1 = state->buff2 = NULL;
 
     munmap(state->shm_data, state->size);
+    mem_track(MEM_SHM, -(int64_t)state->size);
+    state->shm_data = NULL;
 
-    new_buffers(state);
+    return new_buffers(state);
 }
 
-static struct row*
-init_row(uint16_t size)
+void
+update_grid(struct state* state)
 {
-    struct row* row = malloc(sizeof(struct row));
-    row->cells = calloc(size, sizeof(*row->cells));
+    if (state->fonts.set == NULL)
+        return;
 
-    struct attributes attrs = DEFAULT_ATTRS;
+    int char_width = state->fonts.cell_width;
+    int char_height = state->fonts.cell_height;
 
-    for (int i = 0; i < size; i++) {
-        row->cells[i].ch = 0;
-        row->cells[i].attrs = attrs;
-    }
+    // a surface smaller than a cell or two still gets one
+    int width = state->width * state->output_scale_factor;
+    int height = state->height * state->output_scale_factor;
+    uint16_t cols = min(max(width / char_width - 1, 1), UINT16_MAX);
+    uint16_t rows = min(max(height / char_height, 1), UINT16_MAX);
+
+    // the parser thread reads the grid and its size
+    pthread_mutex_lock(&state->grid_mutex);
+
+    struct vt* vt = state->vt;
+
+    HOG("cols: %d, rows: %d", cols, rows);
+
+    if (vt->rows == rows && vt->cols == cols)
+        goto end;
+
+    if (!vt_resize(vt, rows, cols))
+        goto end;
+    capture_resize(&state->capture, rows, cols);
 
-    row->len = size;
+    ioctl(state->master_fd,
+          TIOCSWINSZ,
+          &(struct winsize){ .ws_row = (unsigned short int)rows,
+                             .ws_col = (unsigned short int)cols,
+                             .ws_xpixel = 0,
+                             .ws_ypixel = 0 });
 
-    return row;
+end:
+    pthread_mutex_unlock(&state->grid_mutex);
 }
 
-static struct row**
-init_grid(uint16_t rows, uint16_t cols)
+static void
+record_since(struct histogram* h, uint64_t now, uint64_t t)
 {
-    struct row** grid = malloc(rows * sizeof(struct row*));
+    if (t != 0 && now >= t)
+        histogram_record(h, now - t);
+}
 
-    for (int i = 0; i < rows; i++) {
-        grid[i] = init_row(cols);
-    }
+static void
+feedback_done(struct present_feedback* fb,
+              struct wp_presentation_feedback* feedback)
+{
+    wp_presentation_feedback_destroy(feedback);
+    free(fb);
+}
 
-    return grid;
+static void
+feedback_sync_output(void* data,
+                     struct wp_presentation_feedback* feedback,
+                     struct wl_output* output)
+{
 }
 
+// the first frame showing pty output is on the screen, for a shell that is
+// its prompt
 static void
-grow_grid(struct row*** grid, uint16_t old_rows, uint16_t rows, uint16_t cols)
+first_prompt(struct state* state, uint64_t output_time, uint64_t presented)
 {
-    struct row** new = realloc(*grid, rows * sizeof(struct row*));
+    struct startup* startup = &state->startup;
 
-    assert(new != NULL);
+    if (startup->first_prompt != 0)
+        return;
 
-    *grid = new;
+    startup->first_output = output_time;
+    startup->first_prompt = presented;
 
-    for (int i = old_rows; i < rows; i++) {
-        (*grid)[i] = init_row(cols);
-    }
+    startup_log(startup);
 }
 
-static struct row**
-shrink_grid(struct row*** grid, uint16_t rows, uint16_t cols)
+static void
+feedback_presented(void* data,
+                   struct wp_presentation_feedback* feedback,
+                   uint32_t tv_sec_hi,
+                   uint32_t tv_sec_lo,
+                   uint32_t tv_nsec,
+                   uint32_t refresh,
+                   uint32_t seq_hi,
+                   uint32_t seq_lo,
+                   uint32_t flags)
 {
-    assert(!"TODO");
+    struct present_feedback* fb = data;
+    struct stats* stats = &fb->state->stats;
+
+    uint64_t presented =
+      (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ull + tv_nsec;
+
+    // the stamps are CLOCK_MONOTONIC, with another presentation clock the
+    // time the event arrives is the best there is
+    if (fb->state->presentation_clock != CLOCK_MONOTONIC)
+        presented = now_ns();
+
+    if (fb->output_time != 0)
+        first_prompt(fb->state, fb->output_time, presented);
+
+    record_since(&stats->commit_to_present, presented, fb->commit_time);
+    record_since(&stats->output_to_present, presented, fb->output_time);
+    record_since(&stats->key_to_present, presented, fb->key_time);
+
+    stat_add(&stats->frames_presented, 1);
+
+    feedback_done(fb, feedback);
 }
 
-void
-update_grid(struct state* state)
+static void
+feedback_discarded(void* data, struct wp_presentation_feedback* feedback)
 {
-    if (!state->font.ft_face)
-        return;
+    struct present_feedback* fb = data;
+
+    stat_add(&fb->state->stats.frames_discarded, 1);
+
+    feedback_done(fb, feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    .sync_output = feedback_sync_output,
+    .presented = feedback_presented,
+    .discarded = feedback_discarded,
+};
 
-    FT_Load_Char(state->font.ft_face, 'M', FT_LOAD_DEFAULT);
-    int char_width = state->font.ft_face->glyph->advance.x >> 6;
-    int char_height = state->font.ft_face->size->metrics.height >> 6;
+// attaches a painted buffer and asks for the next frame, the size and scale
+// are the ones in `state->render` it was painted with
+static void
+present_frame(struct state* state, struct buffer* buffer)
+{
+    struct render* r = &state->render;
 
-    uint16_t cols =
-      (state->width * state->output_scale_factor) / char_width - 1;
-    uint16_t rows = (state->height * state->output_scale_factor) / char_height;
+    wl_surface_attach(state->surface, buffer->buffer, 0, 0);
+    wl_surface_damage(state->surface, 0, 0, r->width, r->height);
 
-    bool is_bigger = state->rows < rows || state->cols < cols;
+    wl_surface_set_buffer_scale(state->surface, r->scale);
 
-    uint16_t old_rows = state->rows;
-    uint16_t old_cols = state->cols;
+    buffer->busy = 1;
 
-    state->cols = cols;
-    state->rows = rows;
-    state->cell_height = char_height;
-    state->cell_width = char_width;
+    stat_add(&state->stats.frames, 1);
+    state->commit_time = now_ns();
+    startup_mark(&state->startup.first_frame);
+
+    // without feedback the commit is as close as it gets
+    if (state->presentation == NULL && r->output_time != 0)
+        first_prompt(state, r->output_time, state->commit_time);
+
+    if (state->presentation != NULL) {
+        struct present_feedback* fb = malloc(sizeof(*fb));
+        *fb = (struct present_feedback){
+            .state = state,
+            .commit_time = state->commit_time,
+            .output_time = r->output_time,
+            .key_time = r->key_time,
+        };
+
+        wp_presentation_feedback_add_listener(
+          wp_presentation_feedback(state->presentation, state->surface),
+          &feedback_listener,
+          fb);
+    }
 
-    HOG("cols: %d, rows: %d", state->cols, state->rows);
+    state->frame_callback = wl_surface_frame(state->surface);
+    wl_callback_add_listener(state->frame_callback, &frame_listener, state);
 
-    if (old_rows == rows && old_cols == cols)
-        return;
+    TRACE_BEGIN(commit);
+    wl_surface_commit(state->surface);
+    TRACE_END(commit, "commit");
+}
 
-    state->top_margin = 0;
-    state->btm_margin = rows - 1;
+void*
+render_thread(void* data)
+{
+    struct state* state = data;
+    struct render* r = &state->render;
 
-    ioctl(state->master_fd,
-          TIOCSWINSZ,
-          &(struct winsize){ .ws_row = (unsigned short int)rows,
-                             .ws_col = (unsigned short int)cols,
-                             .ws_xpixel = 0,
-                             .ws_ypixel = 0 });
+    TRACE_THREAD("render");
 
-    // init grid
-    if (state->grid == NULL)
-        state->grid = init_grid(rows, cols);
+    pthread_mutex_lock(&r->mutex);
 
-    if (state->alt_grid == NULL)
-        state->alt_grid = init_grid(rows, cols);
+    for (;;) {
+        while (!r->stop && (r->buffer == NULL || r->done))
+            pthread_cond_wait(&r->cond, &r->mutex);
 
-    if (old_rows == 0)
-        return;
+        if (r->stop)
+            break;
 
-    if (is_bigger) {
-        grow_grid(&state->grid, old_rows, rows, cols);
-        grow_grid(&state->alt_grid, old_rows, rows, cols);
-    }
+        struct buffer* buffer = r->buffer;
+        int width = r->width;
+        int height = r->height;
 
-    if (!is_bigger) {
-        shrink_grid(&state->grid, rows, cols);
-        shrink_grid(&state->alt_grid, rows, cols);
+        pthread_mutex_unlock(&r->mutex);
+
+        paint_data(state, buffer, width, height);
+
+        pthread_mutex_lock(&r->mutex);
+        r->done = true;
+
+        // the main thread does the attach and commit
+        loop_wake(&state->loop);
     }
+
+    pthread_mutex_unlock(&r->mutex);
+
+    return NULL;
 }
 
-void
+// starts painting the next frame, the buffers, fonts and sizes are only
+// changed here while the render thread is idle
+static void
 redraw(struct state* state, uint32_t time)
 {
-    if (!state->needs_redraw)
+    struct render* r = &state->render;
+
+    // finish_render() asks for another frame if needed
+    if (r->buffer != NULL) {
+        stat_add(&state->stats.frames_skipped, 1);
         return;
+    }
 
     if (state->window_resized) {
-        update_buffs(state);
+        fonts_set_scale(&state->fonts, state->output_scale_factor);
+        if (!update_buffs(state)) {
+            state->keep_running = false;
+            return;
+        }
         update_grid(state);
 
         state->window_resized = false;
     }
 
+    // needs_redraw stays set, request_frame() tries again on the next one
     struct buffer* buffer = get_free_buff(state);
+    if (buffer == NULL) {
+        stat_add(&state->stats.frames_skipped, 1);
+        return;
+    }
 
-    paint_data(state, buffer, time);
+    // cleared before the snapshot, output parsed from now on gets a frame
+    atomic_store(&state->needs_redraw, false);
 
-    wl_surface_attach(state->surface, buffer->buffer, 0, 0);
-    wl_surface_damage(state->surface,
-                      0,
-                      0,
-                      state->width * state->output_scale_factor,
-                      state->height * state->output_scale_factor);
+    pthread_mutex_lock(&r->mutex);
+    r->width = state->width * state->output_scale_factor;
+    r->height = state->height * state->output_scale_factor;
+    r->scale = state->output_scale_factor;
+    r->time = time;
 
-    wl_surface_set_buffer_scale(state->surface, state->output_scale_factor);
+    if (state->loop.single_thread) {
+        pthread_mutex_unlock(&r->mutex);
 
-    buffer->busy = 1;
-
-    uint32_t d = time - state->last_frame_time;
-    if (d > 0)
-        state->fps = 1000 / d;
+        paint_data(state, buffer, r->width, r->height);
+        present_frame(state, buffer);
+        return;
+    }
 
-    // HOG("fps: %d", state->fps);
+    r->buffer = buffer;
+    r->done = false;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+}
 
-    state->last_frame_time = time;
-    state->frame_count++;
+// called by the loop on a wakeup, presents the buffer the render thread
+// finished if there is one
+void
+finish_render(struct state* state)
+{
+    struct render* r = &state->render;
+    struct buffer* buffer = NULL;
+
+    pthread_mutex_lock(&r->mutex);
+    if (r->buffer != NULL && r->done) {
+        buffer = r->buffer;
+        r->buffer = NULL;
+        r->done = false;
+    }
+    pthread_mutex_unlock(&r->mutex);
 
-    state->needs_redraw = false;
+    if (buffer != NULL)
+        present_frame(state, buffer);
 }
 
 void
@@ -591,40 +493,41 @@ frame_callback(void* data, struct wl_callback* callback, uint32_t time)
 {
     struct state* state = data;
 
+    TRACE_BEGIN(t);
+
     wl_callback_destroy(callback);
     state->frame_callback = NULL;
 
-    redraw(state, time);
+    if (state->commit_time != 0) {
+        histogram_record(&state->stats.frame_latency,
+                         now_ns() - state->commit_time);
+        state->commit_time = 0;
+    }
 
-    state->frame_callback = wl_surface_frame(state->surface);
-    wl_callback_add_listener(state->frame_callback, &frame_listener, state);
+    // nothing changed, stay idle until request_frame()
+    if (atomic_load(&state->needs_redraw))
+        redraw(state, time);
 
-    wl_surface_commit(state->surface);
+    TRACE_END(t, "frame callback");
 }
 
-static void
-set_font_face_size(struct font font, FT_UInt pixel_size, int32_t scale)
+// asks for a frame callback when there is something to draw and none is
+// pending, called by the loop after each round of events
+void
+request_frame(struct state* state)
 {
-    FT_Error ft_err =
-      FT_Set_Char_Size(font.ft_face, (pixel_size * scale) * 64., 0, 96, 96);
+    if (state->frame_callback || !atomic_load(&state->needs_redraw) ||
+        !state->buff1)
+        return;
 
-    if (ft_err != FT_Err_Ok)
-        HOG_ERR("Failed to char pixel size on ft_face to: %d on font %s",
-                pixel_size,
-                font.ttf);
-}
+    // present_frame() asks for the next one
+    if (state->render.buffer != NULL)
+        return;
 
-static void
-reset_ft_face_size(struct state* state)
-{
-    set_font_face_size(
-      state->font, state->ft_pixel_size, state->output_scale_factor);
+    state->frame_callback = wl_surface_frame(state->surface);
+    wl_callback_add_listener(state->frame_callback, &frame_listener, state);
 
-    dll_for_each(state->fallback_fonts, v)
-    {
-        set_font_face_size(
-          v->val, state->ft_pixel_size, state->output_scale_factor);
-    }
+    wl_surface_commit(state->surface);
 }
 
 void
@@ -632,12 +535,13 @@ handle_wl_output_scale(void* data, struct wl_output* wl_output, int32_t factor)
 {
     struct state* state = data;
     state->output_scale_factor = factor;
-    reset_ft_face_size(state);
 
     // HOG("scale factor: %d", factor);
     // TODO: handle different wl_outputs
 
+    // the fonts are resized by redraw() while the renderer is idle
     state->window_resized = true;
+    atomic_store(&state->needs_redraw, true);
 }
 
 void
@@ -676,6 +580,19 @@ static const struct wl_output_listener wl_output_listener = {
     .scale = handle_wl_output_scale,
 };
 
+static void
+handle_presentation_clock_id(void* data,
+                             struct wp_presentation* presentation,
+                             uint32_t clk_id)
+{
+    struct state* state = data;
+    state->presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = handle_presentation_clock_id,
+};
+
 static void
 registry_global(void* data,
                 struct wl_registry* wl_registry,
@@ -693,14 +610,20 @@ registry_global(void* data,
           wl_registry_bind(wl_registry, name, &xdg_wm_base_interface, 1);
         xdg_wm_base_add_listener(state->wm_base, &xdg_wm_base_listener, state);
     } else if (strcmp(interface, "wl_seat") == 0) {
-        state->seat =
-          wl_registry_bind(wl_registry, name, &wl_seat_interface, 1);
+        // v4 for wl_keyboard.repeat_info
+        state->seat = wl_registry_bind(
+          wl_registry, name, &wl_seat_interface, version < 4 ? version : 4);
     } else if (strcmp(interface, "wl_shm") == 0) {
         state->shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, 1);
     } else if (strcmp(interface, "wl_output") == 0) {
         state->output =
           wl_registry_bind(wl_registry, name, &wl_output_interface, 2);
         wl_output_add_listener(state->output, &wl_output_listener, state);
+    } else if (strcmp(interface, "wp_presentation") == 0) {
+        state->presentation =
+          wl_registry_bind(wl_registry, name, &wp_presentation_interface, 1);
+        wp_presentation_add_listener(
+          state->presentation, &presentation_listener, state);
     }
 }
 
@@ -709,11 +632,38 @@ registry_global_remove(void* data, struct wl_registry* registry, uint32_t name)
 {
 }
 
+static void
+handle_vt_write(void* data, const char* buf, size_t n)
+{
+    pty_write(data, buf, n);
+}
+
+static const struct vt_listener vt_listener = {
+    .write = handle_vt_write,
+};
+
 static const struct wl_registry_listener registry_listener = {
     .global = registry_global,
     .global_remove = registry_global_remove,
 };
 
+static size_t
+getenv_size(const char* name, size_t default_value)
+{
+    const char* v = getenv(name);
+    if (!v || !*v)
+        return default_value;
+
+    char* end;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (*end || n == 0) {
+        HOG_WARN("ignoring invalid %s: %s", name, v);
+        return default_value;
+    }
+
+    return n;
+}
+
 void
 set_signal_handlers()
 {
@@ -726,896 +676,568 @@ set_signal_handlers()
         sigaction(i, &dfl_action, NULL);
 }
 
-struct font
-init_font(FT_Library ft,
-          FT_UInt ft_pixel_size,
-          int32_t scale,
-          FcPattern* pattern)
+// the reader only needs the fds and where the data goes
+static struct pty_reader
+pty_reader(struct state* state)
 {
-    FcChar8* ttf = NULL;
-    FcPatternGetString(pattern, FC_FILE, 0, &ttf);
-    assert(ttf != NULL);
-
-    FT_Face ft_face;
-    FcCharSet* fc_charset;
-    if (FcPatternGetCharSet(pattern, FC_CHARSET, 0, &fc_charset) !=
-        FcResultMatch) {
-        HOG_ERR("failed to get charset");
-        abort();
-    }
-
-    FT_Error ft_err = FT_New_Face(ft, (const char*)ttf, 0, &ft_face);
-    if (ft_err != FT_Err_Ok) {
-        HOG_ERR("Failed to open font file: %s", ttf);
-        abort();
-    }
+    return (struct pty_reader){
+        .fd = state->master_fd,
+        .stop_fd = state->stop_fd,
+        .ring = state->pty_ring,
+        .capture = &state->capture,
+        .arrival = &state->output_arrival,
+        .ring_full = &state->stats.ring_full,
+    };
+}
 
-    ft_err =
-      FT_Set_Char_Size(ft_face, (ft_pixel_size * scale) * 64., 0, 96, 96);
-    if (ft_err != FT_Err_Ok)
-        HOG_ERR("Failed to char pixel size on ft_face to: %d on font %s",
-                ft_pixel_size,
-                ttf);
+void
+key_pressed(struct state* state)
+{
+    if (state->presentation == NULL || atomic_load(&state->key_time))
+        return;
 
-    return (
-      struct font){ .ttf = ttf, .fc_charset = fc_charset, .ft_face = ft_face };
+    atomic_store(&state->key_time, now_ns());
 }
 
+// parses the chunks in order under a single grid_mutex acquisition,
+// `arrival` is when the oldest of them was read from the pty
 void
-init_freetype(struct state* state)
+parse_pty_batch(struct state* state,
+                const struct iovec* iov,
+                int iovcnt,
+                uint64_t arrival)
 {
-    FT_Init_FreeType(&state->ft);
-
-    FcPattern* pattern;
-    FcPattern* matched;
-    FcResult result;
+    size_t n = 0;
 
-    {
-        pattern = FcNameParse((const FcChar8*)state->font_name);
-        assert(pattern != NULL);
-        FcConfigSubstitute(NULL, pattern, FcMatchPattern);
-        FcDefaultSubstitute(pattern);
+    uint64_t lock_start = now_ns();
+    pthread_mutex_lock(&state->grid_mutex);
+    uint64_t locked_at = now_ns();
 
-        matched = FcFontMatch(NULL, pattern, &result);
-        assert(matched != NULL);
-        assert(result == FcResultMatch);
+    for (int i = 0; i < iovcnt; i++) {
+        vt_parse(state->vt, iov[i].iov_base, iov[i].iov_len);
+        n += iov[i].iov_len;
     }
 
-    state->fallback_fonts = (typeof(state->fallback_fonts))dll_init();
-
-    FcFontSet* font_set = FcFontSort(NULL, pattern, FcTrue, NULL, &result);
+    atomic_store(&state->needs_redraw, true);
 
-    for (int i = 0; i < font_set->nfont; i++) {
-        FcPattern* pattern = font_set->fonts[i];
-        dll_push_tail(state->fallback_fonts,
-                      init_font(state->ft,
-                                state->ft_pixel_size,
-                                state->output_scale_factor,
-                                pattern));
+    // measured by the first frame that shows them, for a key press that is
+    // the first output after it, usually the echo
+    uint64_t key = atomic_exchange(&state->key_time, 0);
+    if (state->output_pending == 0)
+        state->output_pending = arrival;
+    if (state->key_pending == 0)
+        state->key_pending = key;
 
-        HOG("loaded font: %s", state->fallback_fonts.tail->val.ttf);
-    }
+    TRACE_END(locked_at, "parse");
 
-    state->font = init_font(
-      state->ft, state->ft_pixel_size, state->output_scale_factor, matched);
-    HOG_INFO("loaded font: %s", state->font.ttf);
-}
+    uint64_t hold = now_ns() - locked_at;
+    pthread_mutex_unlock(&state->grid_mutex);
 
-static inline void
-erase_cell(struct cell* c, char32_t ch, struct color bg)
-{
-    c->ch = ch;
-    c->attrs = DEFAULT_ATTRS;
-    c->attrs.bg = bg;
+    histogram_record(&state->stats.read_batch, n);
+    histogram_record(&state->stats.parse_lock_wait, locked_at - lock_start);
+    histogram_record(&state->stats.parse_lock_hold, hold);
 }
 
-static inline void
-erase_row(struct row* r, char32_t ch, struct color bg)
-{
-    for (int i = 0; i < r->len; i++)
-        erase_cell(&r->cells[i], ' ', bg);
-}
-
-static void
-pop_first_grid_row(struct state* state, struct row** grid)
+// only moves bytes from the pty to `pty_ring`, so a slow parse never keeps
+// the child blocked on a full pty
+void*
+pty_reader_thread(void* data)
 {
-    uint16_t top = state->top_margin;
-    uint16_t btm = state->btm_margin;
-
-    HOG("using in scroll: %d, %d", top, btm);
+    struct state* state = data;
 
-    struct row* top_row = grid[top];
+    TRACE_THREAD("pty reader");
 
-    for (int i = top; i < btm; ++i) {
-        grid[i] = grid[i + 1];
-    }
+    struct pty_reader r = pty_reader(state);
+    pty_reader_run(&r);
 
-    erase_row(top_row, ' ', state->parser.attrs.bg);
-    grid[btm] = top_row;
+    return NULL;
 }
 
-static void
-scroll(struct state* state, struct row** grid)
+// parses at most `read_batch_max` bytes from the ring, returns false if it
+// was empty
+static bool
+parse_pty_ring(struct state* state)
 {
-    assert(state->btm_margin < state->rows);
-    assert(state->top_margin < state->rows &&
-           state->top_margin < state->btm_margin);
+    struct byte_ring* ring = state->pty_ring;
+    struct iovec iov[2];
+
+    // taken before the spans so it is never newer than the bytes in them
+    uint64_t arrival = atomic_exchange(&state->output_arrival, 0);
+
+    int iovcnt = ring_read_spans(ring, iov, state->read_batch_max);
+    if (iovcnt == 0) {
+        // nothing committed since, the reader sets it only when it is 0
+        if (arrival != 0)
+            atomic_store(&state->output_arrival, arrival);
+        return false;
+    }
 
-    pop_first_grid_row(state, grid);
-}
+    histogram_record(&state->stats.ring_fill, ring_fill(ring));
 
-static int
-get_ansi_params_len(int* params)
-{
-    int i = 0;
-    while (params[i] != -1 && i < ANSI_MAX_NUM_PARAMS)
-        i++;
-    return i;
-}
+    parse_pty_batch(state, iov, iovcnt, arrival);
 
-static int
-get_ansi_param(int* params, int idx, int default_value)
-{
-    int params_len = get_ansi_params_len(params);
+    ring_consume(ring, iov[0].iov_len + ((iovcnt == 2) ? iov[1].iov_len : 0));
 
-    if (idx < params_len)
-        return (params[idx] != 0) ? params[idx] : default_value;
-    return default_value;
+    return true;
 }
 
-static const char*
-parse_ansi_params(const char* s, int* params)
+void*
+pty_parser_thread(void* data)
 {
-    // if (!((*s >= '0' && *s <= '9') || *s == ';' || *s == '?'))
-    //     if (*s >= '@' && *s <= '~')
-    //         HOG("no params for input sequence ?: ^[%c", *s);
-
-    int num = 0;
-    int i = 0;
-    while (!(*s >= '@' && *s <= '~')) {
-        if (!*s)
-            return NULL;
-
-        if (*s == ';') {
-            params[i++] = num;
-            num = 0;
-
-            s++;
-            continue;
-        }
+    struct state* state = data;
 
-        if (*s == '?') {
-            params[i++] = '?';
+    TRACE_THREAD("parser");
 
-            s++;
+    for (;;) {
+        if (!parse_pty_ring(state)) {
+            if (!ring_wait_data(state->pty_ring))
+                break;
             continue;
         }
 
-        num *= 10;
-        num += *s - '0';
-
-        s++;
+        // the main loop sleeps until something needs it, so it can ask for
+        // a frame
+        loop_wake(&state->loop);
     }
-    params[i++] = num;
 
-    params[i++] = -1;
+    // everything the pty had is parsed, the window goes with it. The child
+    // may still be running, it gets a hangup
+    atomic_store(&state->pty_closed, true);
+    loop_wake(&state->loop);
 
-    return s;
+    return NULL;
 }
 
-static const struct color
-parse_ansi_color(int* params, int* i)
+// single threaded mode: called by the loop when the pty is readable, returns
+// false on EOF/error
+bool
+pty_read_and_parse(struct state* state)
 {
-    switch (params[*i]) {
-        case 5:
-            (*i)++;
-
-            // 0-15
-            if (params[*i] < 16) {
-                return SYSTEM_COLORS[params[*i]];
-            }
-
-            // 16-231
-            if (params[*i] < 232) {
-                uint8_t idx = params[*i] - 16;
-
-                uint8_t red_idx = idx / 36;
-                uint8_t green_idx = (idx % 36) / 6;
-                uint8_t blue_idx = idx % 6;
-
-                uint8_t red = 0, green = 0, blue = 0;
-                if (red_idx != 0)
-                    red = red_idx * 40 + 55;
-                if (green_idx != 0)
-                    green = green_idx * 40 + 55;
-                if (blue_idx != 0)
-                    blue = blue_idx * 40 + 55;
-
-                return (struct color){ red, green, blue, 255 };
-            }
-
-            // 232-255
-            uint8_t code = params[*i];
-            uint8_t g = (code - 232) * 10 + 8;
-            return (struct color){ g, g, g, 255 };
-            break;
-        case 2: {
-            (*i)++;
+    struct pty_reader r = pty_reader(state);
+    bool ok = pty_reader_drain(&r, false);
 
-            uint8_t r = params[(*i)++];
-            uint8_t g = params[(*i)++];
-            uint8_t b = params[(*i)];
-
-            return (struct color){ r, g, b, 255 };
-            break;
-        }
+    while (parse_pty_ring(state)) {
     }
 
-    return COLOR_FOREGROUND;
+    return ok;
 }
 
-static int
-get_last_non_empty_cell_idx(struct row* r)
+// the socket is shut down for writing at the end, the reader sees EOF and
+// the window closes
+static void*
+replay_thread(void* data)
 {
-    for (int i = 0; i < r->len; i++)
-        if (r->cells[i].ch == 0)
-            return i - 1; // last non empty, 0 means empty
-    return r->len - 1;
-}
-
-static const char*
-parse_ansi_csi(struct state* state,
-               const char* s,
-               struct attributes* attrs,
-               struct cursor* cur,
-               struct row** grid)
-{
-#ifdef HOOKTTY_LOGCSI
-    const char* in = s;
-#endif
-
-    // skip [
-    s++;
-    if (!*s)
-        return NULL;
-
-    int params[ANSI_MAX_NUM_PARAMS] = { 0 };
-
-    const char* _s = parse_ansi_params(s, params);
-    if (!_s)
-        return NULL;
-
-    s = _s;
-
-    // TODO: we have edge cases here we need to catch
-    // ansi could be cut of because  of incorrectly written program
-    // or interupt for example
-    assert(*s >= '@' && *s <= '~');
-
-    size_t params_len = get_ansi_params_len(params);
-
-    // match final byte
-    switch (*s) {
-        case ANSI_FINAL_SGR:
-            for (int i = 0; i < params_len; i++) {
-                switch (params[i]) {
-                    case 0:
-                        *attrs = (struct attributes)DEFAULT_ATTRS;
-                        break;
-
-                    // BOLD
-                    case 1:
-                        attrs->bold = true;
-                        break;
-                    case 22:
-                        attrs->bold = false;
-                        break;
-
-                    // INVERSE
-                    case 7:
-                        attrs->inverse = true;
-                        break;
-                    case 27:
-                        attrs->inverse = false;
-                        break;
-
-                    // UNDERLINE
-                    case 4:
-                        attrs->underline = true;
-                        break;
-                    case 24:
-                        attrs->underline = false;
-                        break;
-
-                    // FOREGROUND COLORS
-                    case 30:
-                    case 31:
-                    case 32:
-                    case 33:
-                    case 34:
-                    case 35:
-                    case 36:
-                    case 37:
-                        attrs->fg = SYSTEM_COLORS[params[i] - 30];
-                        break;
-                    case 38:
-                        i++;
-                        attrs->fg = parse_ansi_color(params, &i);
-                        break;
-                    case 39:
-                        attrs->fg = COLOR_FOREGROUND;
-                        break;
-                    case 90:
-                    case 91:
-                    case 92:
-                    case 93:
-                    case 94:
-                    case 95:
-                    case 96:
-                    case 97:
-                        attrs->fg = SYSTEM_COLORS[(params[i] - 90) + 8];
-                        break;
-
-                    // BACKGROUND COLORS
-                    case 40:
-                    case 41:
-                    case 42:
-                    case 43:
-                    case 44:
-                    case 45:
-                    case 46:
-                    case 47:
-                        attrs->bg = SYSTEM_COLORS[params[i] - 40];
-                        break;
-                    case 48:
-                        i++;
-                        attrs->bg = parse_ansi_color(params, &i);
-                        break;
-                    case 49:
-                        attrs->bg = COLOR_BACKGROUND;
-                        break;
-                    case 100:
-                    case 101:
-                    case 102:
-                    case 103:
-                    case 104:
-                    case 105:
-                    case 106:
-                    case 107:
-                        attrs->bg = SYSTEM_COLORS[(params[i] - 100) + 8];
-                        break;
-
-                    default:
-                        HOG_ERR("No support for ANSI SGR: %d", params[i]);
-                        break;
-                }
-            }
-            break;
-
-        case ANSI_FINAL_CUU: {
-            uint16_t n = (params[0]) ? params[0] : 1;
-            if (cur->p.y >= n)
-                cur->p.y -= n;
-            else
-                cur->p.y = 0;
-
-            cur->lcf = false;
-            break;
-        }
-        case ANSI_FINAL_CUD: {
-            uint16_t n = (params[0]) ? params[0] : 1;
-            if (cur->p.y + n < state->rows)
-                cur->p.y += n;
-            else
-                cur->p.y = state->rows - 1;
-
-            cur->lcf = false;
-            break;
-        }
-        case ANSI_FINAL_CUF: {
-            uint16_t n = (params[0]) ? params[0] : 1;
-            if (cur->p.x + n < state->cols)
-                cur->p.x += n;
-            else
-                cur->p.x = state->cols - 1;
-
-            cur->lcf = false;
-            break;
-        }
-        case ANSI_FINAL_CUB: {
-            uint16_t n = (params[0]) ? params[0] : 1;
-            if (cur->p.x >= n)
-                cur->p.x -= n;
-            else
-                cur->p.x = 0;
-
-            cur->lcf = false;
-            break;
-        }
+    struct state* state = data;
+    int fd = state->replay_fd;
 
-        case ANSI_FINAL_CHA:
-            cur->p.x =
-              min(max(get_ansi_param(params, 0, 1), 1), grid[cur->p.y]->len) -
-              1;
+    TRACE_THREAD("replay");
 
-            cur->lcf = false;
-            break;
+    double secs =
+      capture_replay(state->replay_path, fd, state->replay_speed);
 
-        case ANSI_FINAL_VPA:
-            cur->p.y =
-              min(max(get_ansi_param(params, 0, 1), 1), state->rows) - 1;
-            break;
+    if (secs < 0)
+        HOG_ERR("replay of %s failed: %s", state->replay_path, strerror(errno));
+    else
+        HOG_INFO("replayed %s in %.3f s", state->replay_path, secs);
 
-        case ANSI_FINAL_EL:
-            switch (params[0]) {
-                case 0: // clear from cur to eol
-                    for (int i = cur->p.x; i < grid[cur->p.y]->len; i++)
-                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
-                    break;
-                case 1: // clear from cur to bol
-                    for (int i = cur->p.x; i >= 0; i--)
-                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
-                    break;
-                case 2: // clear line
-                    for (int i = 0; i < grid[cur->p.y]->len; i++)
-                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
-                    break;
-            }
-
-            cur->lcf = false;
-            break;
-
-        case ANSI_FINAL_DCH: {
-            int n = (params[0]) ? params[0] : 1;
+    return NULL;
+}
 
-            for (int i = cur->p.x;
-                 grid[cur->p.y]->cells[i].ch != 0 && i < state->cols;
-                 i++) {
+// stands in for the child, the capture is written to one end of a socket
+// pair and the other end is read like the pty master
+static bool
+start_replay(struct state* state)
+{
+    int sv[2];
 
-                if (i + n > grid[cur->p.y]->len) {
-                    erase_cell(&grid[cur->p.y]->cells[i], 0, attrs->bg);
-                    continue;
-                }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return false;
+    }
 
-                grid[cur->p.y]->cells[i] = grid[cur->p.y]->cells[i + n];
-            }
+    state->master_fd = sv[0];
+    state->replay_fd = sv[1];
+    state->child_pid = 0;
 
-            cur->lcf = false;
-            break;
-        }
+    pthread_create(&state->replay_tid, NULL, replay_thread, state);
+    state->replaying = true;
+    return true;
+}
 
-        case ANSI_FINAL_ICH: {
-            int n = (params[0]) ? params[0] : 1;
+// the other windows of a server may hold the malloc or stdio locks at the
+// fork(), the child only makes async-signal-safe calls before the exec
+static void
+child_error(const char* what, const char* error)
+{
+    const char* parts[] = { "hooktty: ", what, ": ", error, "\n" };
 
-            for (int i = get_last_non_empty_cell_idx(grid[cur->p.y]);
-                 i >= cur->p.x;
-                 i--) {
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        write(STDERR_FILENO, parts[i], strlen(parts[i]));
+}
 
-                if (i + n > grid[cur->p.y]->len) {
-                    erase_cell(&grid[cur->p.y]->cells[i], 0, attrs->bg);
-                } else {
-                    grid[cur->p.y]->cells[i + n] = grid[cur->p.y]->cells[i];
-                }
+static bool
+start_child(struct state* state)
+{
+    pid_t pid;
+    struct winsize ws = { .ws_row = state->vt->rows,
+                          .ws_col = state->vt->cols,
+                          .ws_xpixel = 0,
+                          .ws_ypixel = 0 };
 
-                if (cur->p.x + n >= i)
-                    erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
-            }
+    pid = forkpty(&state->master_fd, NULL, NULL, &ws);
+    if (pid == -1) {
+        perror("forkpty");
+        state->master_fd = -1;
+        return false;
+    }
 
-            cur->lcf = false;
-            break;
-        }
+    state->child_pid = pid;
 
-        case ANSI_FINAL_ECH: {
-            int n = (params[0]) ? params[0] : 1;
+    if (pid == 0) {
+        // SIGCHLD is blocked for the signalfd, don't pass that on
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
 
-            for (int i = cur->p.x; i < cur->p.x + n && i < state->cols; i++) {
-                erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
-            }
+        if (state->cwd != NULL && chdir(state->cwd) < 0)
+            child_error(state->cwd, "can't change to it");
 
-            cur->lcf = false;
-            break;
+        if (state->command != NULL) {
+            execvp(state->command[0], state->command);
+            child_error(state->command[0], "can't run it");
+        } else {
+            execl("/run/current-system/sw/bin/bash", "bash", NULL);
+            child_error("bash", "can't run it");
         }
 
-        case ANSI_FINAL_HVP:
-        case ANSI_FINAL_CUP:
-            cur->p.y =
-              min(max(get_ansi_param(params, 0, 1), 1), state->rows) - 1;
-
-            cur->p.x =
-              min(max(get_ansi_param(params, 1, 1), 1), grid[cur->p.y]->len) -
-              1;
-
-            cur->lcf = false;
-            break;
-
-        case ANSI_FINAL_ED: // TODO do better
-            switch (params[0]) {
-                case 0:
-                    for (int i = cur->p.y; i < state->rows; i++)
-                        for (int j = cur->p.x; j < grid[i]->len; j++)
-                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
-                    break;
-                case 1:
-                    for (int i = cur->p.y; i >= 0; i--)
-                        for (int j = cur->p.x; j >= 0; j--)
-                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
-                    break;
-                case 2:
-                    for (int i = 0; i < state->rows; i++)
-                        for (int j = 0; j < grid[i]->len; j++)
-                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
-                    break;
-            }
-
-            cur->lcf = false;
-            break;
-
-        case ANSI_FINAL_DECSET:
-            if (params[0] == '?')
-                switch (params[1]) {
-                    case 1049:
-                        state->alt_screen = true;
-                        for (int i = 0; i < state->rows; i++)
-                            for (int j = 0; j < state->alt_grid[i]->len; j++)
-                                erase_cell(&state->alt_grid[i]->cells[j], ' ', attrs->bg);
-                        break;
-                    default:
-                        HOG_ERR("unsupported ansi DECSET: %d", params[1]);
-                        break;
-                }
-            break;
-
-        case ANSI_FINAL_DECRST:
-            if (params[0] == '?')
-                switch (params[1]) {
-                    case 1049:
-                        state->alt_screen = false;
-                        state->alt_cursor = (cursor){ (point){ 0, 0 }, false };
-                        break;
-                    default:
-                        HOG_ERR("unsupported ansi DECRST: %d", params[1]);
-                        break;
-                }
-            break;
-
-        case ANSI_FINAL_DA:
-            write(state->master_fd, ANSI_DA_RESP, strlen(ANSI_DA_RESP));
-            break;
-
-        case ANSI_FINAL_DECSTBM:
-            state->top_margin = max(get_ansi_param(params, 0, 1), 1) - 1;
-            state->btm_margin =
-              min(get_ansi_param(params, 1, state->rows), state->rows) - 1;
-
-            HOG("margin: %d, %d", state->top_margin, state->btm_margin);
-
-            cur->p.y = 0;
-            cur->p.x = 0;
-            cur->lcf = false;
-            break;
-
-        case ANSI_FINAL_SU:
-            for (int i = 0;
-                 i < min(get_ansi_param(params, 0, 1), state->btm_margin);
-                 i++)
-                scroll(state, grid);
-            break;
-
-        default:
-            HOG_ERR("No support for ANSI final byte: %c", *s);
-            break;
+        // exit() would flush the buffers of the parent, logs and capture
+        _exit(1);
     }
 
-    if (*s)
-        s++;
-
-#ifdef HOOKTTY_LOGCSI
-    char buf[1024] = { 0 };
-    memcpy(buf, in, s - in);
-    HOG("CSI: %s", buf);
-    for (int i = 0; i < ANSI_MAX_NUM_PARAMS && params[i] != -1; i++) {
-        HOG("p: %d", params[i]);
-    }
-    HOG("");
-#endif
-
-    return s;
+    capture_resize(&state->capture, ws.ws_row, ws.ws_col);
+    loop_add_child(&state->loop, pid);
+    return true;
 }
 
-static const char*
-parse_ansi_osc(struct state* state, const char* s, struct attributes* attrs)
+// false if the pty or the threads reading it can't be set up, state_free()
+// undoes the part that was
+static bool
+start_pty(struct state* state)
 {
-    // skip ]
-    s++;
-
-    if (!*s) {
-        return NULL;
-    }
-    while (!((*s == ANSI_ESC && s[1] == '\\') || (*s == '\x07'))) {
-        if (!*s) {
-            return NULL;
+    // what can fail comes before the child, it would be left to reap
+    state->pty_ring = ring_new(state->ring_size);
+    if (state->pty_ring == NULL)
+        return false;
+
+    if (!state->loop.single_thread) {
+        state->stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (state->stop_fd < 0) {
+            perror("eventfd");
+            return false;
         }
-
-        s++;
     }
 
-    if (*s)
-        s++;
-    return s;
+    if (state->replay_path != NULL ? !start_replay(state)
+                                   : !start_child(state))
+        return false;
+
+    // the reader drains everything available before parsing and writes go
+    // through the pty_writer queue
+    fcntl(state->master_fd,
+          F_SETFL,
+          fcntl(state->master_fd, F_GETFL) | O_NONBLOCK);
+
+    if (state->loop.single_thread)
+        return loop_add_pty(&state->loop, state->master_fd);
+
+    pthread_create(&state->parser_tid, NULL, pty_parser_thread, state);
+    pthread_create(&state->reader_tid, NULL, pty_reader_thread, state);
+    return true;
 }
 
-// returning pointer to the first char after the ansi code
-static const char*
-parse_ansi(struct state* state,
-           const char* s,
-           struct attributes* attrs,
-           struct cursor* cur,
-           struct row** grid)
+static void*
+font_loader_thread(void* data)
 {
-    assert(*(s - 1) == ANSI_ESC);
-    if (!*s)
-        return NULL;
+    struct state* state = data;
 
-    switch (*s) {
-        case '[':
-            return parse_ansi_csi(state, s, attrs, cur, grid);
-            break;
-        case ']':
-            return parse_ansi_osc(state, s, attrs);
-            break;
-            // TODO: handle other multichar sequences ?
-        case ANSI_C1_RI: // TODO: implement scroll down ?
-            if (cur->p.y)
-                cur->p.y--;
+    TRACE_THREAD("fonts");
 
-            cur->lcf = false;
-            s++;
-            break;
-        case '(': // skip (B TODO
-            s += 2;
-            break;
-        default:
-            s++;
-            HOG_ERR("unsuported ansi: %c(%d)", *s, *s);
-            break;
-    }
+    // scaled once the outputs are known
+    fonts_init(&state->fonts, "Hack", 10, 1);
+    startup_mark(&state->startup.font);
 
-    // HOG("returing: %s", s);
+    pthread_mutex_lock(&state->font_loader.mutex);
+    state->font_loader.ready = true;
+    pthread_cond_signal(&state->font_loader.cond);
+    pthread_mutex_unlock(&state->font_loader.mutex);
 
-    return s;
-}
+    // missing glyphs are blank until these are loaded
+    uint64_t start = now_ns();
+    fonts_load_fallbacks(&state->fonts);
+    HOG_INFO("fallback fonts loaded in %.1f ms", (now_ns() - start) / 1e6);
 
-static void
-carriage_return(cursor* cur)
-{
-    cur->p.x = 0;
-    cur->lcf = false;
+    return NULL;
 }
 
 static void
-linefeed(struct state* state, cursor* cur, struct row** grid)
+wait_for_font(struct state* state)
 {
-    if (cur->p.y == state->btm_margin)
-        scroll(state, grid);
-    else if (cur->p.y < state->rows - 1)
-        cur->p.y++;
-
-    cur->lcf = false;
+    pthread_mutex_lock(&state->font_loader.mutex);
+    while (!state->font_loader.ready)
+        pthread_cond_wait(&state->font_loader.cond, &state->font_loader.mutex);
+    pthread_mutex_unlock(&state->font_loader.mutex);
 }
 
-// returns NULL if everything was parsed
-// or pointer to the data that wasn't
-static const char*
-parse_pty_output(struct state* state, char* buf, int n)
+struct state*
+state_new(char** command, const char* cwd, const struct fonts* fonts)
 {
+    struct state* state;
+    state = calloc(1, sizeof(*state));
+    state->startup = (struct startup){ .start = now_ns() };
+    state->width = 350;
+    state->height = 300;
+    state->commit_time = 0;
+    state->presentation = NULL;
+    state->presentation_clock = CLOCK_MONOTONIC;
+    state->output_arrival = state->key_time = 0;
+    state->output_pending = state->key_pending = 0;
+    state->keep_running = 1;
+    state->buff1 = NULL;
+    state->buff2 = NULL;
+    state->output_scale_factor = 1;
+    atomic_init(&state->needs_redraw, true);
+    atomic_init(&state->pty_closed, false);
+    state->snapshot = (struct snapshot){ 0 };
+    state->render = (struct render){
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    state->pty_writer = (struct pty_writer){
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+    state->grid_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    state->font_loader.mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    state->font_loader.cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    state->ws = 0;
+    state->master_fd = state->stop_fd = state->replay_fd = -1;
+    // resized to the window by update_grid()
+    state->vt = vt_new(24, 80, &vt_listener, state);
+
+    const char* profile = getenv("HOOKTTY_VT_PROFILE");
+    if (profile && *profile && strcmp(profile, "0") != 0)
+        vt_profile_enable(state->vt);
+    state->stats = (struct stats){ 0 };
+    hud_init(&state->hud);
+    state->read_batch_max =
+      getenv_size("HOOKTTY_READ_BATCH_MAX", PTY_READ_BATCH_MAX);
+    state->ring_size = getenv_size("HOOKTTY_RING_SIZE", PTY_RING_SIZE);
+
+    state->command = command;
+    state->cwd = cwd;
+
+    // the windows of a server would all write the same capture
+    state->capture = (struct capture){ 0 };
+    state->replay_path = NULL;
+
+    if (fonts == NULL) {
+        const char* capture_path = getenv("HOOKTTY_CAPTURE");
+        if (capture_path && *capture_path &&
+            !capture_open(&state->capture, capture_path))
+            perror(capture_path);
+
+        state->replay_path = getenv("HOOKTTY_REPLAY");
+        if (state->replay_path && !*state->replay_path)
+            state->replay_path = NULL;
+
+        const char* speed = getenv("HOOKTTY_REPLAY_SPEED");
+        state->replay_speed = speed ? strtod(speed, NULL) : 0;
+    }
 
-    assert(state->grid != NULL);
-    assert(state->alt_grid != NULL);
-    assert(state->cursor.p.x < state->cols);
-    assert(state->cursor.p.y < state->rows);
-
-    cursor* cur = get_cursor(state);
-    const char* s = buf;
-
-    const char* end = s + n + 1;
-
-    struct attributes* attrs = &state->parser.attrs;
-
-    struct row** grid = get_grid(state);
-
-    size_t bytes_red = 0;
-    while (*s && bytes_red < n) {
-        assert(cur->p.y < state->rows);
-        assert(cur->p.x < state->cols);
-
-        char32_t ch = 0;
-        {
-            mbstate_t p = { 0 };
-            int size = mbrtoc32(&ch, s, end - s, &p);
-            if (size < 0) {
-                HOG_ERR("mbrtoc size < 1: %d, char: %c(%d)", size, ch, ch);
-                s++;
-                continue;
-            }
-            s += size;
-            bytes_red += size;
-        }
-
-        // HOG("set: %c(%d) at %d,%d", ch, ch, cur.y, cur.x);
-
-        /* reusing an row after the screen has been resized */
-        if (grid[cur->p.y]->len != state->cols) {
-            if (grid[cur->p.y] != NULL)
-                free(grid[cur->p.y]);
-
-            grid[cur->p.y] = init_row(state->cols);
-        }
-
-        // ansi parser
-        if (ch == ANSI_ESC) {
-            bool old_alt_screen = state->alt_screen;
-
-            const char* _s = parse_ansi(state, s, attrs, cur, grid);
+    // a server already has the signals, the child is watched with a pidfd.
+    // Out of fds in a server is this window's failure, not every window's
+    if (!loop_init(&state->loop, fonts == NULL)) {
+        state_free(state);
+        return NULL;
+    }
 
-            if (old_alt_screen != state->alt_screen) {
-                grid = get_grid(state);
-                cur = get_cursor(state);
-            }
+    // the shell starts up while we connect and load the fonts, its output
+    // waits in the ring until there is a window to show it in
+    if (!start_pty(state)) {
+        state_free(state);
+        return NULL;
+    }
+    startup_mark(&state->startup.pty);
 
-            // ansi was not parsed fully
-            // return a pointer to the ESC
-            if (!_s) {
-                return s - 1;
-            }
+    if (!state->loop.single_thread) {
+        pthread_create(&state->render_tid, NULL, render_thread, state);
+        state->threads = true;
+    }
 
-            s = _s;
+    if (fonts != NULL) {
+        fonts_share(&state->fonts, fonts);
+    } else {
+        pthread_create(
+          &state->font_loader.tid, NULL, font_loader_thread, state);
+        state->font_loader.started = true;
+    }
 
-            continue;
-        }
+    state->display = wl_display_connect(NULL);
+    if (!state->display) {
+        HOG_ERR("Failed to connect to Wayland display.");
+        state_free(state);
+        return NULL;
+    }
+    HOG_INFO("Connection established!");
+    startup_mark(&state->startup.connect);
 
-        if (ch == U'\r') {
-            carriage_return(cur);
-            continue;
-        }
+    state->registry = wl_display_get_registry(state->display);
+    wl_registry_add_listener(state->registry, &registry_listener, state);
 
-        // skip bell
-        if (ch == U'\a')
-            continue;
+    wl_display_roundtrip(state->display);
+    if (state->shm == NULL) {
+        HOG_ERR("No wl_shm global");
+        state_free(state);
+        return NULL;
+    }
+    startup_mark(&state->startup.roundtrip);
 
-        // skip shift in
-        if (ch == U'\x0f')
-            continue;
+    state->surface = wl_compositor_create_surface(state->compositor);
 
-        if (ch == U'\b') {
-            cur->p.x = min(cur->p.x - 1, grid[cur->p.y]->len - 1);
-            cur->lcf = false;
-            continue;
-        }
+    setup_xdg_shell(state);
 
-        if (ch == U'\n') {
-            linefeed(state, cur, grid);
-            continue;
-        }
+    wl_surface_commit(state->surface);
 
-        bool is_at_rightmost_col = cur->p.x == state->cols - 1;
-        if (is_at_rightmost_col) {
-            if (cur->lcf) {
-                cur->p.x = 0;
-                linefeed(state, cur, grid);
-                cur->lcf = false;
-            } else
-                cur->lcf = true;
-        }
+    init_seat_devs(state);
 
-        {
-            grid[cur->p.y]->cells[cur->p.x].ch = ch;
-            grid[cur->p.y]->cells[cur->p.x].attrs = *attrs;
+    state->xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    startup_mark(&state->startup.surface);
 
-            if (!is_at_rightmost_col)
-                cur->p.x++;
-        }
+    // the first configure needs the cell size, nothing else does
+    if (fonts == NULL) {
+        wait_for_font(state);
+        startup_mark(&state->startup.fonts_wait);
     }
 
-    return NULL;
-}
+    if (state->fonts.scale != state->output_scale_factor)
+        fonts_set_scale(&state->fonts, state->output_scale_factor);
 
-#define PENDING_BUF_SIZE 8192
+    return state;
+}
 
-void*
-pty_reader_thread(void* data)
+// joins the threads of a window, the child may still hold the pty open so
+// the reader is told to stop
+static void
+stop_threads(struct state* state)
 {
-    struct state* state = data;
-
-#ifdef HOOKTTY_LOGFILE
-    int log_fd = open("log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-#endif
-
-    char buf[1024 * 4];
-
-    char pending_buf[PENDING_BUF_SIZE];
-    size_t pending_buf_len = 0;
+    struct render* r = &state->render;
 
-    while (state->keep_running) {
-        ssize_t n = read(state->master_fd, buf, sizeof(buf));
+    if (!state->threads)
+        return;
 
-        if (n <= 0) {
-            HOG_ERR("pty read error");
-            break;
-        }
+    state->keep_running = false;
 
-        // HOG("buf n: %d, strlen: %d", n, strlen(buf));
+    uint64_t one = 1;
+    write(state->stop_fd, &one, sizeof(one));
 
-        if (pending_buf_len + n > PENDING_BUF_SIZE) {
-            HOG_ERR("pending buffer overflowed");
-            pending_buf_len = 0;
-            continue;
-        }
+    // the parser stops once the reader closed the ring and it is empty
+    pthread_join(state->reader_tid, NULL);
+    pthread_join(state->parser_tid, NULL);
 
-        memcpy(pending_buf + pending_buf_len, buf, n);
-        pending_buf[pending_buf_len + n] = '\0';
-        pending_buf_len += n;
+    pthread_mutex_lock(&r->mutex);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
 
-        pthread_mutex_lock(&state->grid_mutex);
+    pthread_join(state->render_tid, NULL);
 
-        const char* left_over =
-          parse_pty_output(state, pending_buf, pending_buf_len);
+    state->threads = false;
+}
 
-        state->needs_redraw = true;
+void
+state_free(struct state* state)
+{
+    stop_threads(state);
 
-        pthread_mutex_unlock(&state->grid_mutex);
+    capture_close(&state->capture);
 
-        // if we have non parsed part (ex: cut offed ansi code)
-        if (left_over != NULL) {
-            // NOTE: other cases that ansi cut off ?
-            assert(*left_over == ANSI_ESC);
+    if (state->buff1) {
+        wl_buffer_destroy(state->buff1->buffer);
+        free(state->buff1);
+    }
 
-            size_t left_over_size = strlen(left_over);
+    if (state->buff2) {
+        wl_buffer_destroy(state->buff2->buffer);
+        free(state->buff2);
+    }
 
-            memmove(pending_buf,
-                    pending_buf + (pending_buf_len - left_over_size),
-                    left_over_size);
-            pending_buf[left_over_size] = '\0';
-            pending_buf_len = left_over_size;
-        } else {
-            pending_buf[0] = '\0';
-            pending_buf_len = 0;
-        }
+    if (state->shm_data != NULL) {
+        munmap(state->shm_data, state->size);
+        mem_track(MEM_SHM, -(int64_t)state->size);
+    }
 
-#ifdef HOOKTTY_LOGFILE
-        write(log_fd, buf, n);
-        char sep[40];
-        cursor* cur = get_cursor(state);
-        sprintf(sep, "\n========= cur: %d, %d\n", cur->p.y, cur->p.x);
-        write(log_fd, sep, strlen(sep));
-#endif
+    if (state->frame_callback)
+        wl_callback_destroy(state->frame_callback);
+    if (state->pointer)
+        wl_pointer_destroy(state->pointer);
+    if (state->keyboard)
+        wl_keyboard_destroy(state->keyboard);
+    if (state->xdg_toplevel)
+        xdg_toplevel_destroy(state->xdg_toplevel);
+    if (state->xdg_surface)
+        xdg_surface_destroy(state->xdg_surface);
+    if (state->surface)
+        wl_surface_destroy(state->surface);
+
+    if (state->presentation)
+        wp_presentation_destroy(state->presentation);
+    if (state->output)
+        wl_output_destroy(state->output);
+    if (state->seat)
+        wl_seat_destroy(state->seat);
+    if (state->shm)
+        wl_shm_destroy(state->shm);
+    if (state->wm_base)
+        xdg_wm_base_destroy(state->wm_base);
+    if (state->compositor)
+        wl_compositor_destroy(state->compositor);
+    if (state->registry)
+        wl_registry_destroy(state->registry);
+
+    if (state->display)
+        wl_display_disconnect(state->display);
+
+    xkb_state_unref(state->xkb_state);
+    xkb_keymap_unref(state->xkb_map);
+    xkb_context_unref(state->xkb_ctx);
+
+    // it may still be loading the fallbacks
+    if (state->font_loader.started)
+        pthread_join(state->font_loader.tid, NULL);
+    fonts_fini(&state->fonts);
+
+    // the replay stops once its peer is gone, it may be waiting or writing
+    if (state->replaying) {
+        shutdown(state->master_fd, SHUT_RDWR);
+        pthread_join(state->replay_tid, NULL);
     }
+    // the child gets a hangup if it is still running
+    if (state->master_fd >= 0)
+        close(state->master_fd);
+    if (state->replay_fd >= 0)
+        close(state->replay_fd);
+    if (state->stop_fd >= 0)
+        close(state->stop_fd);
 
-    return NULL;
-}
+    loop_fini(&state->loop);
 
-void
-start_pty(struct state* state)
-{
-    pid_t pid;
-    struct winsize ws = {
-        .ws_row = 24, .ws_col = 80, .ws_xpixel = 0, .ws_ypixel = 0
-    };
+    if (state->pty_ring)
+        ring_free(state->pty_ring);
+    mem_free(MEM_PTY, state->pty_writer.buf);
 
-    pid = forkpty(&state->master_fd, NULL, NULL, &ws);
-    if (pid == -1) {
-        perror("forkpty");
-        exit(1);
-    }
+    mem_free(MEM_SNAPSHOT, state->snapshot.cells);
+    vt_free(state->vt);
 
-    if (pid == 0) {
-        setenv("TERM", "xterm-256color", 1);
-        execl("/run/current-system/sw/bin/bash", "bash", NULL);
-        perror("execl");
-        exit(1);
-    } else {
-        pthread_t tid;
-        pthread_create(&tid, NULL, pty_reader_thread, state);
-    }
+    free(state);
 }
 
 int
@@ -1623,69 +1245,32 @@ main(int argc, char* argv[])
 {
     set_signal_handlers();
 
-    setlocale(LC_ALL, "C.UTF-8");
-
-    struct state* state;
-    state = malloc(sizeof(*state));
-    state->width = 350;
-    state->height = 300;
-    state->last_frame_time = 0;
-    state->frame_count = 0;
-    state->keep_running = 1;
-    state->buff1 = NULL;
-    state->buff2 = NULL;
-    state->ft_pixel_size = 10;
-    state->output_scale_factor = 1;
-    state->font_name = "Hack";
-    state->needs_redraw = true;
-    state->grid = NULL;
-    state->alt_grid = NULL;
-    state->alt_screen = false;
-    state->grid_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-    state->rows = 0;
-    state->cols = 0;
-    state->cursor = (cursor){ (point){ 0, 0 }, false };
-    state->alt_cursor = (cursor){ (point){ 0, 0 }, false };
-    state->ws = 0;
-    state->top_margin = 0;
-    state->btm_margin = 0;
-    state->parser.attrs = DEFAULT_ATTRS;
+    // inherited by every child, set before any thread exists as setenv()
+    // isn't safe after fork() in a threaded server
+    setenv("TERM", "xterm-256color", 1);
 
-    state->display = wl_display_connect(NULL);
-    if (!state->display) {
-        HOG_ERR("Failed to connect to Wayland display.");
-        return 1;
-    }
-    HOG_INFO("Connection established!");
+    // hooktty --server [socket], windows are opened with hooktty-client
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+        return server_run(argc > 2 ? argv[2] : NULL);
 
-    state->registry = wl_display_get_registry(state->display);
-    wl_registry_add_listener(state->registry, &registry_listener, state);
+    TRACE_THREAD("main");
 
-    wl_display_roundtrip(state->display);
-    if (state->shm == NULL) {
-        HOG_ERR("No wl_shm global");
+    // hooktty [command [args...]], the shell without one
+    struct state* state = state_new(argc > 1 ? &argv[1] : NULL, NULL, NULL);
+    if (state == NULL)
         return 1;
-    }
-
-    state->surface = wl_compositor_create_surface(state->compositor);
-
-    setup_xdg_shell(state);
 
-    wl_surface_commit(state->surface);
-
-    init_seat_devs(state);
+    loop_run(state);
 
-    state->xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    stats_log(&state->stats);
+    mem_log();
 
-    init_freetype(state);
-
-    start_pty(state);
-
-    while (wl_display_dispatch(state->display) != -1 && state->keep_running) {
+    if (state->vt->profile) {
+        log_flush();
+        vt_profile_report(state->vt->profile, stdout, 0);
+        fflush(stdout);
     }
 
-    // TODO free all
-    wl_display_disconnect(state->display);
-    free(state);
+    state_free(state);
     return 0;
 }
@@ -9,81 +9,63 @@
 
 #include <dll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <uchar.h>
 
-#define HOOKTTY_LOGFILE
-// #define HOOKTTY_LOGCSI
-
-struct font
-{
-    FT_Face ft_face;
-    FcCharSet* fc_charset;
-    FcChar8* ttf;
-};
-
-struct color
-{
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
-    unsigned char a;
-};
-
-struct attributes
-{
-    struct color fg;
-    struct color bg;
-    bool underline;
-    bool inverse;
-    bool bold;
-};
-
-struct cell
+#include "capture.h"
+#include "hud.h"
+#include "loop.h"
+#include "pty-write.h"
+#include "render.h"
+#include "ring.h"
+#include "stats.h"
+#include "vt.h"
+
+// bytes between the pty reader and the parser (HOOKTTY_RING_SIZE)
+#define PTY_RING_SIZE (1024 * 1024)
+// most bytes parsed per grid_mutex acquisition (HOOKTTY_READ_BATCH_MAX)
+#define PTY_READ_BATCH_MAX (256 * 1024)
+
+// frame handed to the render thread, guarded by `mutex`
+struct render
 {
-    char32_t ch;
-    struct attributes attrs;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct buffer* buffer; // being painted, NULL while idle
+    int width;             // pixels
+    int height;
+    int32_t scale;
+    uint32_t time;
+    bool done; // painted, waiting for finish_render()
+    bool stop; // the window is closing, see state_free()
+
+    // arrival of the oldest output and key press in the painted snapshot,
+    // 0 if none, set by paint_data()
+    uint64_t output_time;
+    uint64_t key_time;
 };
 
-struct row
+// one per commit with a buffer, freed when the compositor says whether it
+// was presented
+struct present_feedback
 {
-    struct cell* cells;
-    // we are not resizing the grid
-    // so not all rows will be of `cols` len
-    size_t len;
+    struct state* state;
+    uint64_t commit_time;
+    uint64_t output_time;
+    uint64_t key_time;
 };
 
-typedef struct point
-{
-    uint16_t x;
-    uint16_t y;
-} point;
-
-typedef struct cursor
-{
-    point p;
-    bool lcf; // https://github.com/mattiase/wraptest
-} cursor;
-
 struct state
 {
-    struct row** grid; // size == rows
-    struct row** alt_grid;
+    struct vt* vt;
+    // guards `vt`, the parser thread writes it, the renderer copies it
     pthread_mutex_t grid_mutex;
 
-    struct winsize* ws;
-
-    bool alt_screen;
-
-    uint16_t top_margin;
-    uint16_t btm_margin;
-
-    uint16_t rows;
-    uint16_t cols;
-    int cell_width;
-    int cell_height;
+    struct snapshot snapshot;
+    struct render render;
 
-    struct cursor cursor;
-    struct cursor alt_cursor;
+    struct winsize* ws;
 
     struct wl_display* display;
     struct wl_registry* registry;
@@ -94,6 +76,9 @@ struct state
     struct xdg_wm_base* wm_base;
     struct wl_shm* shm;
     struct wl_seat* seat;
+    // wp_presentation, NULL if the compositor doesn't have it
+    struct wp_presentation* presentation;
+    clockid_t presentation_clock;
 
     struct wl_pointer* pointer;
     struct wl_keyboard* keyboard;
@@ -112,11 +97,22 @@ struct state
     size_t size;
     uint32_t* shm_data;
 
-    uint32_t last_frame_time;
-    uint32_t frame_count;
-    uint32_t fps;
+    // time of the last commit with a buffer, 0 once its frame is done
+    uint64_t commit_time;
+
+    // the oldest pty output not parsed yet, set by the reader when it is 0
+    // and taken by the parser
+    atomic_uint_fast64_t output_arrival;
+    // the oldest key press with no output parsed after it, set on the main
+    // thread and taken by the parser
+    atomic_uint_fast64_t key_time;
+    // parsed into the grid but not in a snapshot yet, under grid_mutex
+    uint64_t output_pending;
+    uint64_t key_pending;
 
     bool keep_running;
+    // set by the parser once the pty is closed and parsed, the window closes
+    atomic_bool pty_closed;
 
     bool window_resized;
 
@@ -135,6 +131,11 @@ struct state
         int alt;
         int ctrl;
         int super;
+
+        // key held down, repeated by the loop timer
+        uint32_t repeat_key;
+        int32_t repeat_rate; // keys per second, 0 disables repeat
+        int32_t repeat_delay; // ms
     } kbd;
 
     struct
@@ -143,22 +144,71 @@ struct state
         wl_fixed_t y;
     } ptr;
 
-    const char* font_name;
-    FT_Library ft;
-    FT_UInt ft_pixel_size;
-
-    struct font font;
-    dll(struct font) fallback_fonts;
-
-    int master_fd;
-    bool needs_redraw;
+    struct fonts fonts;
 
+    // a standalone window loads its fonts on this thread while it connects,
+    // `ready` once the primary font is, the fallbacks come after that
     struct
     {
-        struct attributes attrs;
-    } parser;
+        pthread_t tid;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool ready;
+        bool started;
+    } font_loader;
+
+    int master_fd;
+    pid_t child_pid;
+    char** command; // argv of the child, NULL for the default shell
+    const char* cwd; // of the child, NULL for ours
+    // set by the parser and the wayland events, cleared by redraw()
+    atomic_bool needs_redraw;
+
+    // the pty reader, parser and render threads, unless single threaded,
+    // `stop_fd` tells the reader to stop
+    pthread_t reader_tid;
+    pthread_t parser_tid;
+    pthread_t render_tid;
+    bool threads;
+    int stop_fd;
+
+    struct loop loop;
+
+    size_t read_batch_max;
+    size_t ring_size;
+    struct byte_ring* pty_ring;
+
+    struct pty_writer pty_writer;
+
+    // HOOKTTY_CAPTURE, disabled unless set
+    struct capture capture;
+    // HOOKTTY_REPLAY plays a capture instead of starting the shell, with the
+    // original timing divided by HOOKTTY_REPLAY_SPEED (0, as fast as possible)
+    const char* replay_path;
+    double replay_speed;
+    int replay_fd;
+    pthread_t replay_tid;
+    bool replaying;
+
+    struct stats stats;
+    struct startup startup;
+    struct hud hud;
 };
 
+/*
+ * A window with its pty, `command` and `cwd` as in struct state. `fonts`
+ * are the ones of a server, shared with its other windows, NULL loads them
+ * for this window alone and makes it a standalone one, which owns the
+ * signals and honors HOOKTTY_CAPTURE and HOOKTTY_REPLAY. Returns NULL if the
+ * display can't be used, loop_run() runs it.
+ */
+struct state*
+state_new(char** command, const char* cwd, const struct fonts* fonts);
+
+// stops the threads, closes the pty and the connection and frees it all
+void
+state_free(struct state* state);
+
 struct buffer
 {
     struct wl_buffer* buffer;
@@ -166,13 +216,34 @@ struct buffer
     int offset;
 };
 
-void
+bool
 new_buffers(struct state* state);
 
 void
 update_grid(struct state* state);
 
+struct iovec;
+
+void
+parse_pty_batch(struct state* state,
+                const struct iovec* iov,
+                int iovcnt,
+                uint64_t arrival);
+
+// called for each key sent to the pty
+void
+key_pressed(struct state* state);
+
+bool
+pty_read_and_parse(struct state* state);
+
 void
 frame_callback(void* data, struct wl_callback* callback, uint32_t time);
 
+void
+request_frame(struct state* state);
+
+void
+finish_render(struct state* state);
+
 static const struct wl_callback_listener frame_listener = { frame_callback };
@@ -0,0 +1,136 @@
+#include <malloc.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "mem.h"
+
+struct mem_usage mem_usage[MEM_TAG_COUNT];
+
+static const char* const tag_names[MEM_TAG_COUNT] = {
+    [MEM_GRID] = "grid", [MEM_SNAPSHOT] = "snapshot", [MEM_FONTS] = "fonts",
+    [MEM_SHM] = "shm",   [MEM_PTY] = "pty",           [MEM_DIAG] = "diag",
+};
+
+void
+mem_track(enum mem_tag tag, int64_t bytes)
+{
+    struct mem_usage* u = &mem_usage[tag];
+
+    int64_t live =
+      atomic_fetch_add_explicit(&u->live, bytes, memory_order_relaxed) + bytes;
+
+    int64_t peak = atomic_load_explicit(&u->peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak(&u->peak, &peak, live)) {
+    }
+}
+
+void*
+mem_malloc(enum mem_tag tag, size_t size)
+{
+    void* p = malloc(size);
+    if (p != NULL)
+        mem_track(tag, malloc_usable_size(p));
+    return p;
+}
+
+void*
+mem_calloc(enum mem_tag tag, size_t n, size_t size)
+{
+    void* p = calloc(n, size);
+    if (p != NULL)
+        mem_track(tag, malloc_usable_size(p));
+    return p;
+}
+
+void*
+mem_realloc(enum mem_tag tag, void* p, size_t size)
+{
+    size_t old = p ? malloc_usable_size(p) : 0;
+
+    void* n = realloc(p, size);
+    if (n == NULL)
+        return NULL;
+
+    mem_track(tag, (int64_t)malloc_usable_size(n) - (int64_t)old);
+    return n;
+}
+
+void
+mem_free(enum mem_tag tag, void* p)
+{
+    if (p == NULL)
+        return;
+
+    mem_track(tag, -(int64_t)malloc_usable_size(p));
+    free(p);
+}
+
+// bytes the allocator handed out and resident bytes, 0 if unknown
+static void
+process_usage(size_t* heap, size_t* rss)
+{
+    *heap = mallinfo2().uordblks;
+    *rss = 0;
+
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return;
+
+    unsigned long pages;
+    if (fscanf(f, "%*u %lu", &pages) == 1)
+        *rss = pages * sysconf(_SC_PAGESIZE);
+
+    fclose(f);
+}
+
+void
+mem_dump(FILE* f)
+{
+    int64_t total = 0;
+
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        int64_t live = atomic_load(&mem_usage[i].live);
+        total += live;
+
+        fprintf(f,
+                "mem %s: live=%ldB peak=%ldB\n",
+                tag_names[i],
+                live,
+                atomic_load(&mem_usage[i].peak));
+    }
+
+    size_t heap, rss;
+    process_usage(&heap, &rss);
+
+    fprintf(f, "mem tracked: %ldB heap: %zuB rss: %zuB\n", total, heap, rss);
+}
+
+void
+mem_log(void)
+{
+    char line[256];
+    int n = 0;
+    int64_t total = 0;
+
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        int64_t live = atomic_load(&mem_usage[i].live);
+        total += live;
+
+        n += snprintf(line + n,
+                      sizeof(line) - n,
+                      "%s %.1fK, ",
+                      tag_names[i],
+                      live / 1024.0);
+    }
+
+    size_t heap, rss;
+    process_usage(&heap, &rss);
+
+    HOG_INFO("mem: %stracked %.1fK, heap %.1fK, rss %.1fK",
+             line,
+             total / 1024.0,
+             heap / 1024.0,
+             rss / 1024.0);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Live bytes per subsystem, for the SIGUSR1 stats dump and HOOKTTY_MEM_LOG.
+ *
+ * Heap blocks are counted at their malloc_usable_size() and have to be
+ * released through mem_free()/mem_realloc() with the tag they were
+ * allocated with, mappings are counted with mem_track(). Whatever isn't
+ * tagged (fontconfig, wayland, libc) only shows in the heap and RSS totals.
+ */
+
+enum mem_tag
+{
+    MEM_GRID,     // rows of the grid and the alternate grid
+    MEM_SNAPSHOT, // the copy of the grid the renderer paints from
+    MEM_FONTS,    // FreeType, faces and glyph slots
+    MEM_SHM,      // wl_shm buffer pool
+    MEM_PTY,      // pty ring and write queue
+    MEM_DIAG,     // log and trace buffers, the sequence profile
+
+    MEM_TAG_COUNT,
+};
+
+struct mem_usage
+{
+    atomic_int_fast64_t live;
+    atomic_int_fast64_t peak;
+};
+
+extern struct mem_usage mem_usage[MEM_TAG_COUNT];
+
+// adds `bytes` to `tag`, negative to release
+void
+mem_track(enum mem_tag tag, int64_t bytes);
+
+void*
+mem_malloc(enum mem_tag tag, size_t size);
+
+void*
+mem_calloc(enum mem_tag tag, size_t n, size_t size);
+
+void*
+mem_realloc(enum mem_tag tag, void* p, size_t size);
+
+void
+mem_free(enum mem_tag tag, void* p);
+
+// a line per tag, then the totals, the heap and RSS
+void
+mem_dump(FILE* f);
+
+// all of it on one line
+void
+mem_log(void);
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "macros.h"
+#include "pty-read.h"
+#include "pty-uring.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
+
+void
+pty_reader_commit(struct pty_reader* r, char* p, size_t n)
+{
+    capture_write(r->capture, CAPTURE_OUTPUT, p, n);
+
+    // it starts before wp_presentation is bound, the stamps are taken
+    // either way
+    if (!atomic_load_explicit(r->arrival, memory_order_relaxed))
+        atomic_store_explicit(r->arrival, now_ns(), memory_order_relaxed);
+
+    ring_commit(r->ring, n);
+}
+
+bool
+pty_reader_drain(struct pty_reader* r, bool wait)
+{
+    for (;;) {
+        char* p;
+        size_t span = ring_write_span(r->ring, &p);
+
+        // the parser is behind, stop draining the kernel buffer until it
+        // catches up
+        if (span == 0) {
+            stat_add(r->ring_full, 1);
+            if (!wait)
+                return true;
+
+            ring_wait_space(r->ring);
+            continue;
+        }
+
+        TRACE_BEGIN(t);
+        ssize_t n = read(r->fd, p, span);
+
+        if (n > 0) {
+            TRACE_END(t, "pty read");
+            pty_reader_commit(r, p, n);
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+
+        return false;
+    }
+}
+
+void
+pty_reader_poll(struct pty_reader* r)
+{
+    struct pollfd pfd[2] = {
+        { .fd = r->fd, .events = POLLIN },
+        { .fd = r->stop_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            HOG_ERR("pty poll error");
+            return;
+        }
+
+        // the window is closing, the child may still have the pty open
+        if (pfd[1].revents)
+            return;
+
+        // EOF or EIO once the child and whatever it started closed it
+        if (!pty_reader_drain(r, true)) {
+            HOG_INFO("pty closed");
+            return;
+        }
+    }
+}
+
+void
+pty_reader_run(struct pty_reader* r)
+{
+#ifdef HOOKTTY_IO_URING
+    // returns false only if io_uring can't be used, before reading anything
+    if (!pty_uring_reader(r))
+        pty_reader_poll(r);
+#else
+    pty_reader_poll(r);
+#endif
+
+    ring_close(r->ring);
+}
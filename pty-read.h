@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct byte_ring;
+struct capture;
+
+/*
+ * Moves the pty output into the byte ring for the parser. Only needs the fds
+ * and where to account the data, so hooktty-bench -r runs it on a pty of its
+ * own.
+ */
+struct pty_reader
+{
+    int fd;      // pty master, non-blocking
+    int stop_fd; // readable once the reader should stop
+    struct byte_ring* ring;
+    struct capture* capture;
+
+    // when the oldest unparsed byte was read, only set if it is 0, the
+    // parser clears it
+    atomic_uint_fast64_t* arrival;
+    atomic_uint_fast64_t* ring_full;
+};
+
+// `n` bytes were read to `p`, the write span of the ring
+void
+pty_reader_commit(struct pty_reader* r, char* p, size_t n);
+
+// reads everything the pty has right now straight into the ring, returns
+// false on EOF/error. When the ring fills up it waits for the parser if
+// `wait` is set and returns otherwise
+bool
+pty_reader_drain(struct pty_reader* r, bool wait);
+
+// poll() + read() until EOF or `stop_fd`
+void
+pty_reader_poll(struct pty_reader* r);
+
+// with io_uring if it can be used, else pty_reader_poll(). The ring is
+// closed at the end
+void
+pty_reader_run(struct pty_reader* r);
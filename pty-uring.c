@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <liburing.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+#include "pty-read.h"
+#include "pty-uring.h"
+#include "ring.h"
+#include "stats.h"
+
+#define URING_ENTRIES 4
+
+// user_data of the sqes, the cancel has none
+enum
+{
+    URING_CANCEL,
+    URING_READ,
+    URING_STOP, // the poll on `stop_fd`
+};
+
+static bool
+uring_enabled(void)
+{
+    const char* v = getenv("HOOKTTY_IO_URING");
+    return !(v && strcmp(v, "0") == 0);
+}
+
+// can't run out, there are never more than 3 in flight
+static struct io_uring_sqe*
+get_sqe(struct io_uring* uring, uint64_t data)
+{
+    struct io_uring_sqe* sqe = io_uring_get_sqe(uring);
+    io_uring_sqe_set_data64(sqe, data);
+    return sqe;
+}
+
+bool
+pty_uring_reader(struct pty_reader* r)
+{
+    if (!uring_enabled())
+        return false;
+
+    struct io_uring uring;
+    int ret = io_uring_queue_init(URING_ENTRIES, &uring, 0);
+    if (ret < 0) {
+        HOG_WARN("io_uring_queue_init: %s", strerror(-ret));
+        return false;
+    }
+
+    io_uring_prep_poll_add(get_sqe(&uring, URING_STOP), r->stop_fd, POLLIN);
+
+    // where the read in flight goes, NULL if there is none
+    char* p = NULL;
+    bool running = true;
+
+    while (running) {
+        // straight into the ring, the kernel arms a poll on the non-blocking
+        // fd by itself when nothing is ready
+        if (p == NULL) {
+            size_t span = ring_write_span(r->ring, &p);
+
+            // the parser is behind, stop draining the kernel buffer until
+            // it catches up
+            if (span == 0) {
+                stat_add(r->ring_full, 1);
+                ring_wait_space(r->ring);
+                p = NULL;
+                continue;
+            }
+
+            io_uring_prep_read(get_sqe(&uring, URING_READ), r->fd, p, span, 0);
+        }
+
+        ret = io_uring_submit_and_wait(&uring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            HOG_ERR("io_uring_submit_and_wait: %s", strerror(-ret));
+            break;
+        }
+
+        struct io_uring_cqe* cqe;
+        unsigned head;
+        unsigned seen = 0;
+
+        io_uring_for_each_cqe(&uring, head, cqe)
+        {
+            seen++;
+
+            // the window is closing, the child may still have the pty open
+            if (cqe->user_data == URING_STOP) {
+                running = false;
+                continue;
+            }
+
+            if (cqe->user_data != URING_READ)
+                continue;
+
+            char* dst = p;
+            p = NULL;
+
+            if (cqe->res > 0) {
+                pty_reader_commit(r, dst, cqe->res);
+                continue;
+            }
+
+            if (cqe->res == -EAGAIN || cqe->res == -EINTR)
+                continue;
+
+            // EOF or EIO once the child and whatever it started closed it
+            if (cqe->res == 0 || cqe->res == -EIO)
+                HOG_INFO("pty closed");
+            else
+                HOG_ERR("pty read error: %s", strerror(-cqe->res));
+
+            running = false;
+        }
+
+        io_uring_cq_advance(&uring, seen);
+    }
+
+    // the read targets the ring, it has to be done before the ring can go
+    if (p != NULL) {
+        io_uring_prep_cancel64(get_sqe(&uring, URING_CANCEL), URING_READ, 0);
+        io_uring_submit(&uring);
+
+        while (p != NULL) {
+            struct io_uring_cqe* cqe;
+
+            ret = io_uring_wait_cqe(&uring, &cqe);
+            if (ret == -EINTR)
+                continue;
+            // it could still write to the ring once it is freed
+            if (ret < 0) {
+                HOG_ERR("io_uring_wait_cqe: %s", strerror(-ret));
+                abort();
+            }
+
+            if (cqe->user_data == URING_READ)
+                p = NULL;
+            io_uring_cqe_seen(&uring, cqe);
+        }
+    }
+
+    io_uring_queue_exit(&uring);
+
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "pty-read.h"
+
+#ifdef HOOKTTY_IO_URING
+// reads the pty with io_uring straight into `r->ring` until the pty closes or
+// `r->stop_fd` is readable, returns false without reading anything if
+// io_uring can't be used (disabled with HOOKTTY_IO_URING=0, old kernel, ...)
+bool
+pty_uring_reader(struct pty_reader* r);
+#endif
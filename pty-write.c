@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "macros.h"
+#include "main.h"
+#include "mem.h"
+#include "pty-write.h"
+
+// writes as much of the queue as the pty takes, called with the mutex held
+static void
+write_queued(struct state* state)
+{
+    struct pty_writer* w = &state->pty_writer;
+
+    while (w->start < w->len) {
+        ssize_t n =
+          write(state->master_fd, w->buf + w->start, w->len - w->start);
+
+        if (n > 0) {
+            w->start += n;
+            if (w->start < w->len)
+                stat_add(&state->stats.pty_write_partial, 1);
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            stat_add(&state->stats.pty_write_blocked, 1);
+            break;
+        }
+
+        // the child is gone, nobody will read the rest
+        HOG_WARN("pty write failed, dropping %zu B", w->len - w->start);
+        w->start = w->len;
+        break;
+    }
+
+    if (w->start == w->len)
+        w->start = w->len = 0;
+
+    bool pending = w->len > 0;
+    if (pending != w->want_out) {
+        w->want_out = pending;
+        loop_watch_pty_out(&state->loop, state->master_fd, pending);
+    }
+}
+
+static void
+append(struct pty_writer* w, const char* data, size_t n)
+{
+    // reuse the space already written before growing
+    if (w->start > 0 && w->len + n > w->cap) {
+        memmove(w->buf, w->buf + w->start, w->len - w->start);
+        w->len -= w->start;
+        w->start = 0;
+    }
+
+    if (w->len + n > w->cap) {
+        size_t cap = w->cap ? w->cap : 4096;
+        while (cap < w->len + n)
+            cap *= 2;
+
+        w->buf = mem_realloc(MEM_PTY, w->buf, cap);
+        assert(w->buf != NULL);
+        w->cap = cap;
+    }
+
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+}
+
+void
+pty_write(struct state* state, const char* data, size_t n)
+{
+    struct pty_writer* w = &state->pty_writer;
+
+    // a replay has no child to read it
+    if (n == 0 || state->replay_path != NULL)
+        return;
+
+    pthread_mutex_lock(&w->mutex);
+
+    // in the order it is queued in
+    capture_write(&state->capture, CAPTURE_INPUT, data, n);
+
+    // nothing is dropped and the caller can't block, the parser may be the
+    // one the child waits on
+    size_t queued = w->len - w->start + n;
+    if (queued > PTY_WRITE_QUEUE_WARN)
+        HOG_WARN_RATELIMITED(
+          "the child isn't reading its input, %zu B queued", queued);
+
+    // keep the order, only try a direct write if nothing is waiting
+    append(w, data, n);
+    if (!w->want_out)
+        write_queued(state);
+
+    if (w->len > 0)
+        histogram_record(&state->stats.pty_write_queue, w->len - w->start);
+
+    pthread_mutex_unlock(&w->mutex);
+}
+
+void
+pty_flush(struct state* state)
+{
+    struct pty_writer* w = &state->pty_writer;
+
+    pthread_mutex_lock(&w->mutex);
+    write_queued(state);
+    pthread_mutex_unlock(&w->mutex);
+}
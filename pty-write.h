@@ -0,0 +1,36 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct state;
+
+// a child that doesn't read its input makes the queue grow, past this it is
+// logged
+#define PTY_WRITE_QUEUE_WARN (4 * 1024 * 1024)
+
+/*
+ * Outgoing bytes for the pty (keys, replies to queries, pastes). The master
+ * fd is non-blocking, whatever the child isn't reading yet waits here and the
+ * loop writes it once the fd is writable again.
+ */
+struct pty_writer
+{
+    pthread_mutex_t mutex;
+
+    char* buf;
+    size_t start; // first byte not written yet
+    size_t len;   // end of the queued bytes
+    size_t cap;
+
+    bool want_out; // the loop watches the fd for EPOLLOUT
+};
+
+// never blocks, callable from any thread
+void
+pty_write(struct state* state, const char* data, size_t n);
+
+// called by the loop when the master fd is writable
+void
+pty_flush(struct state* state);
@@ -0,0 +1,561 @@
+/*
+ * Headless render benchmark, paints vt snapshots with render_snapshot() into
+ * a malloc'd ARGB8888 image, no compositor needed.
+ *
+ *   hooktty-render-bench [-s WxH] [-S scale] [-f font] [-p pixel size]
+ *                        [-n frames] [-t secs] [-c chunk] [-o dir] [input...]
+ *
+ * An input is a file, a raw pty stream or a HOOKTTY_CAPTURE recording, or one
+ * of the canned screens: ascii, tui, emoji, cjk. A file is replayed `chunk`
+ * bytes per frame, a canned screen is parsed once and painted over and over.
+ * Without inputs every canned screen runs.
+ *
+ * `-s` is the window size in surface coordinates, the image is that times
+ * the scale, like the shm buffers of the window. With `-o` the last frame of
+ * every input is written to `dir/<input>.ppm`.
+ */
+
+#include <assert.h>
+#include <libgen.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "macros.h"
+#include "mem.h"
+#include "render.h"
+#include "stats.h"
+#include "vt.h"
+
+#define RENDER_BENCH_DEFAULT_FRAMES 200
+#define RENDER_BENCH_DEFAULT_CHUNK 16384
+
+struct buf
+{
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+static void
+buf_put(struct buf* b, const char* s, size_t n)
+{
+    if (b->len + n > b->cap) {
+        b->cap = (b->cap + n) * 2;
+        b->data = realloc(b->data, b->cap);
+        assert(b->data != NULL);
+    }
+
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void
+buf_printf(struct buf* b, const char* fmt, ...)
+{
+    char tmp[256];
+    va_list args;
+
+    va_start(args, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+
+    buf_put(b, tmp, min(n, (int)sizeof(tmp) - 1));
+}
+
+static void
+buf_put_utf8(struct buf* b, uint32_t cp)
+{
+    char u[4];
+
+    if (cp < 0x80) {
+        u[0] = cp;
+        buf_put(b, u, 1);
+    } else if (cp < 0x800) {
+        u[0] = 0xc0 | (cp >> 6);
+        u[1] = 0x80 | (cp & 0x3f);
+        buf_put(b, u, 2);
+    } else if (cp < 0x10000) {
+        u[0] = 0xe0 | (cp >> 12);
+        u[1] = 0x80 | ((cp >> 6) & 0x3f);
+        u[2] = 0x80 | (cp & 0x3f);
+        buf_put(b, u, 3);
+    } else {
+        u[0] = 0xf0 | (cp >> 18);
+        u[1] = 0x80 | ((cp >> 12) & 0x3f);
+        u[2] = 0x80 | ((cp >> 6) & 0x3f);
+        u[3] = 0x80 | (cp & 0x3f);
+        buf_put(b, u, 4);
+    }
+}
+
+// the same screens on every run
+static uint32_t rng_state;
+
+static uint32_t
+rng(void)
+{
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+// fills `len` columns with words and spaces
+static void
+put_words(struct buf* b, int len)
+{
+    while (len > 0) {
+        int w = min(len, 1 + (int)(rng() % 10));
+
+        for (int i = 0; i < w; i++)
+            buf_put_utf8(b, 'a' + rng() % 26);
+
+        len -= w;
+        if (len-- > 0)
+            buf_put(b, " ", 1);
+    }
+}
+
+// a full screen of plain text, like a shell after `cat`
+static void
+screen_ascii(struct buf* b, int rows, int cols)
+{
+    for (int r = 0; r < rows; r++) {
+        buf_printf(b, "\x1b[%d;1H", r + 1);
+        put_words(b, cols - 1);
+    }
+}
+
+// a file manager/monitor like TUI, boxes, 256 and true colors, a highlighted
+// selection, underlined header and an inverse status line
+static void
+screen_tui(struct buf* b, int rows, int cols)
+{
+    int split = cols / 3;
+
+    buf_printf(b, "\x1b[?1049h\x1b[H");
+
+    for (int r = 1; r <= rows - 1; r++) {
+        bool edge = r == 1 || r == rows - 1;
+
+        buf_printf(b, "\x1b[%d;1H\x1b[38;5;%dm", r, 60 + r % 6);
+        buf_put_utf8(b, edge ? (r == 1 ? 0x250c : 0x2514) : 0x2502);
+
+        if (edge) {
+            for (int c = 2; c < cols - 1; c++)
+                buf_put_utf8(b, c == split ? (r == 1 ? 0x252c : 0x2534)
+                                           : 0x2500);
+        } else {
+            // the list on the left, one row selected
+            buf_printf(b,
+                       r == rows / 2 ? "\x1b[0;30;48;2;%d;%d;%dm"
+                                     : "\x1b[0;38;2;%d;%d;%dm",
+                       100 + rng() % 156,
+                       100 + rng() % 156,
+                       100 + rng() % 156);
+            put_words(b, split - 2);
+
+            buf_printf(b, "\x1b[0;38;5;%dm", 60 + r % 6);
+            buf_put_utf8(b, 0x2502);
+
+            // colored columns on the right
+            if (r == 2)
+                buf_printf(b, "\x1b[1;4m");
+            for (int c = split + 1; c < cols - 1;) {
+                int w = min(cols - 1 - c, 4 + (int)(rng() % 8));
+
+                buf_printf(b, "\x1b[%dm", 31 + rng() % 7);
+                put_words(b, w);
+                c += w;
+            }
+        }
+
+        buf_printf(b, "\x1b[0;38;5;%dm", 60 + r % 6);
+        buf_put_utf8(b, edge ? (r == 1 ? 0x2510 : 0x2518) : 0x2502);
+    }
+
+    buf_printf(b, "\x1b[%d;1H\x1b[0;7m", rows);
+    put_words(b, cols - 1);
+    buf_printf(b, "\x1b[0m\x1b[2;3H");
+}
+
+// emoji and nerd font icons between words, most of them come from a
+// fallback font
+static void
+screen_emoji(struct buf* b, int rows, int cols)
+{
+    static const uint32_t icons[] = {
+        0xe0a0, 0xe0b0, 0xe0b2, 0xe5ff, 0xe615, 0xe702, 0xe7a8,
+        0xf015, 0xf07b, 0xf113, 0xf1d3, 0xf31b, 0xf489, 0xf7c9,
+    };
+
+    for (int r = 0; r < rows; r++) {
+        buf_printf(b, "\x1b[%d;1H", r + 1);
+
+        for (int c = 0; c < cols - 3;) {
+            if (rng() % 3 == 0) {
+                buf_put_utf8(b,
+                             rng() % 2 ? 0x1f300 + rng() % 0x300
+                                       : icons[rng() % (sizeof(icons) /
+                                                        sizeof(icons[0]))]);
+                buf_put(b, " ", 1);
+                c += 3;
+            } else {
+                int w = min(cols - 3 - c, 1 + (int)(rng() % 8));
+                put_words(b, w);
+                buf_put(b, " ", 1);
+                c += w + 1;
+            }
+        }
+    }
+}
+
+// wide CJK text with some ascii punctuation
+static void
+screen_cjk(struct buf* b, int rows, int cols)
+{
+    for (int r = 0; r < rows; r++) {
+        buf_printf(b, "\x1b[%d;1H", r + 1);
+
+        for (int c = 0; c < cols - 2; c += 2) {
+            if (rng() % 8 == 0)
+                buf_put(b, ", ", 2);
+            else
+                buf_put_utf8(b, 0x4e00 + rng() % 0x5000);
+        }
+    }
+}
+
+static const struct screen
+{
+    const char* name;
+    void (*gen)(struct buf* b, int rows, int cols);
+} screens[] = {
+    { "ascii", screen_ascii },
+    { "tui", screen_tui },
+    { "emoji", screen_emoji },
+    { "cjk", screen_cjk },
+};
+
+#define SCREEN_COUNT (sizeof(screens) / sizeof(screens[0]))
+
+// only the output of a capture, `rows` and `cols` are set to its first size
+static bool
+load_capture(struct buf* b, const char* path, int* rows, int* cols)
+{
+    struct capture_reader r;
+    struct capture_record rec;
+    bool sized = false;
+
+    if (!capture_reader_open(&r, path))
+        return false;
+
+    while (capture_read(&r, &rec)) {
+        if (rec.type == CAPTURE_OUTPUT)
+            buf_put(b, rec.data, rec.len);
+
+        if (rec.type == CAPTURE_RESIZE && !sized) {
+            uint16_t r16, c16;
+            capture_record_size(&rec, &r16, &c16);
+            *rows = r16;
+            *cols = c16;
+            sized = true;
+        }
+    }
+
+    capture_reader_close(&r);
+    return true;
+}
+
+static bool
+load_file(struct buf* b, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    char tmp[65536];
+    size_t n;
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+        buf_put(b, tmp, n);
+
+    fclose(f);
+    return true;
+}
+
+static void
+ignore_write(void* data, const char* buf, size_t n)
+{
+}
+
+static const struct vt_listener bench_listener = {
+    .write = ignore_write,
+};
+
+// binary PPM, the alpha is dropped
+static void
+write_ppm(const char* path, const uint32_t* pixels, int width, int height)
+{
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        uint8_t rgb[3] = {
+            pixels[i] >> 16,
+            pixels[i] >> 8,
+            pixels[i],
+        };
+        fwrite(rgb, 1, sizeof(rgb), f);
+    }
+
+    fclose(f);
+}
+
+struct options
+{
+    int width; // surface coordinates
+    int height;
+    int32_t scale;
+    int frames;
+    double secs; // overrides `frames` when set
+    size_t chunk;
+    const char* out_dir;
+};
+
+static void
+run(const char* name,
+    const struct buf* in,
+    bool replay,
+    struct fonts* fonts,
+    const struct options* opts)
+{
+    int width = opts->width * opts->scale;
+    int height = opts->height * opts->scale;
+
+    // the same grid size update_grid() would pick for the window
+    int cols = width / fonts->cell_width - 1;
+    int rows = height / fonts->cell_height;
+    if (rows < 1 || cols < 1) {
+        fprintf(stderr, "%s: window too small for the font\n", name);
+        return;
+    }
+
+    uint32_t* pixels = malloc((size_t)width * height * 4);
+    assert(pixels != NULL);
+
+    struct vt* vt = vt_new(rows, cols, &bench_listener, NULL);
+    struct snapshot snap = { 0 };
+    size_t off = 0;
+
+    if (!replay)
+        vt_parse(vt, in->data, in->len);
+
+    // warm up, the first frame pages in the font files
+    vt_snapshot(vt, &snap);
+    render_snapshot(fonts, &snap, pixels, width, height, NULL);
+
+    struct render_timing timing = { 0 };
+    uint64_t busy = 0;
+    int frames = 0;
+    uint64_t start = now_ns();
+
+    for (;;) {
+        if (replay) {
+            size_t n = min(opts->chunk, in->len - off);
+
+            vt_parse(vt, in->data + off, n);
+            vt_snapshot(vt, &snap);
+            off = (off + n) % in->len;
+        }
+
+        uint64_t frame_start = now_ns();
+        render_snapshot(fonts, &snap, pixels, width, height, &timing);
+        busy += now_ns() - frame_start;
+        frames++;
+
+        if (opts->secs > 0 ? now_ns() - start >= opts->secs * 1e9
+                           : frames >= opts->frames)
+            break;
+    }
+
+    uint64_t steps =
+      timing.fill + timing.font_lookup + timing.rasterize + timing.composite;
+    double per_frame = 1e6 * frames;
+
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d@%d", width, height, opts->scale);
+
+    char grid[16];
+    snprintf(grid, sizeof(grid), "%dx%d", rows, cols);
+
+    printf("%-12s %-14s %-8s %8.1f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+           name,
+           size,
+           grid,
+           frames / (busy / 1e9),
+           busy / per_frame,
+           timing.fill / per_frame,
+           timing.font_lookup / per_frame,
+           timing.rasterize / per_frame,
+           timing.composite / per_frame,
+           (busy - min(busy, steps)) / per_frame);
+
+    if (opts->out_dir != NULL) {
+        char* copy = strdup(name);
+        char path[4096];
+
+        snprintf(
+          path, sizeof(path), "%s/%s.ppm", opts->out_dir, basename(copy));
+        write_ppm(path, pixels, width, height);
+        free(copy);
+    }
+
+    mem_free(MEM_SNAPSHOT, snap.cells);
+    vt_free(vt);
+    free(pixels);
+}
+
+static void
+usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-s WxH] [-S scale] [-f font] [-p pixel size] "
+            "[-n frames] [-t secs] [-c chunk] [-o dir] [file|screen...]\n"
+            "screens:",
+            argv0);
+
+    for (size_t i = 0; i < SCREEN_COUNT; i++)
+        fprintf(stderr, " %s", screens[i].name);
+
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int
+main(int argc, char* argv[])
+{
+    struct options opts = {
+        .width = 1280,
+        .height = 720,
+        .scale = 1,
+        .frames = RENDER_BENCH_DEFAULT_FRAMES,
+        .chunk = RENDER_BENCH_DEFAULT_CHUNK,
+    };
+    const char* font_name = "Hack";
+    FT_UInt pixel_size = 10;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (i + 1 >= argc)
+            usage(argv[0]);
+
+        const char* v = argv[++i];
+
+        switch (argv[i - 1][1]) {
+            case 's':
+                if (sscanf(v, "%dx%d", &opts.width, &opts.height) != 2)
+                    usage(argv[0]);
+                break;
+            case 'S':
+                opts.scale = atoi(v);
+                break;
+            case 'f':
+                font_name = v;
+                break;
+            case 'p':
+                pixel_size = strtoul(v, NULL, 10);
+                break;
+            case 'n':
+                opts.frames = atoi(v);
+                break;
+            case 't':
+                opts.secs = strtod(v, NULL);
+                break;
+            case 'c':
+                opts.chunk = strtoul(v, NULL, 10);
+                break;
+            case 'o':
+                opts.out_dir = v;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (opts.width < 1 || opts.height < 1 || opts.scale < 1 ||
+        opts.frames < 1 || opts.chunk == 0 || pixel_size == 0)
+        usage(argv[0]);
+
+    struct fonts fonts;
+    fonts_init(&fonts, font_name, pixel_size, opts.scale);
+    fonts_load_fallbacks(&fonts);
+
+    printf("%-12s %-14s %-8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "input",
+           "pixels",
+           "grid",
+           "frames/s",
+           "ms/frame",
+           "fill",
+           "lookup",
+           "raster",
+           "compose",
+           "other");
+
+    const char* const* inputs = (const char* const*)&argv[i];
+    int n_inputs = argc - i;
+
+    const char* all[SCREEN_COUNT];
+    if (n_inputs == 0) {
+        for (size_t s = 0; s < SCREEN_COUNT; s++)
+            all[s] = screens[s].name;
+
+        inputs = all;
+        n_inputs = SCREEN_COUNT;
+    }
+
+    for (int n = 0; n < n_inputs; n++) {
+        struct buf in = { 0 };
+        const struct screen* screen = NULL;
+
+        for (size_t s = 0; s < SCREEN_COUNT; s++)
+            if (strcmp(inputs[n], screens[s].name) == 0)
+                screen = &screens[s];
+
+        if (screen != NULL) {
+            int width = opts.width * opts.scale;
+            int height = opts.height * opts.scale;
+
+            rng_state = 1;
+            screen->gen(&in,
+                        height / fonts.cell_height,
+                        width / fonts.cell_width - 1);
+        } else if (capture_is_capture(inputs[n])) {
+            // the grid follows the window size, not the recorded one
+            int rows, cols;
+
+            if (!load_capture(&in, inputs[n], &rows, &cols)) {
+                perror(inputs[n]);
+                return 1;
+            }
+        } else if (!load_file(&in, inputs[n])) {
+            perror(inputs[n]);
+            return 1;
+        }
+
+        if (in.len == 0)
+            continue;
+
+        run(inputs[n], &in, screen == NULL, &fonts, &opts);
+        free(in.data);
+    }
+
+    return 0;
+}
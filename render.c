@@ -0,0 +1,986 @@
+#include <assert.h>
+#include <ft2build.h>
+#include FT_MODULE_H
+#include <pixman.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "font-cache.h"
+#include "macros.h"
+#include "mem.h"
+#include "render.h"
+#include "stats.h"
+#include "trace.h"
+
+static const struct color COLOR_CURSOR_FOREGROUND = { 255, 120, 180, 255 };
+static const struct color COLOR_CURSOR_BACKGROUND = COLOR_BACKGROUND;
+static const struct color COLOR_OVERLAY_FOREGROUND = { 120, 255, 120, 255 };
+static const struct color COLOR_OVERLAY_BACKGROUND = { 0, 0, 0, 255 };
+
+#define GLYPH_CACHE_MIN_CAP 1024
+
+// adds the time since `mark` to `step` and moves `mark`, only when timing
+#define RENDER_LAP(timing, step, mark)                                         \
+    do {                                                                       \
+        if (timing) {                                                          \
+            uint64_t now_ = now_ns();                                          \
+            (timing)->step += now_ - (mark);                                   \
+            (mark) = now_;                                                     \
+        }                                                                      \
+    } while (0)
+
+static void*
+ft_alloc(FT_Memory memory, long size)
+{
+    return mem_malloc(MEM_FONTS, size);
+}
+
+static void
+ft_free(FT_Memory memory, void* block)
+{
+    mem_free(MEM_FONTS, block);
+}
+
+static void*
+ft_realloc(FT_Memory memory, long cur_size, long new_size, void* block)
+{
+    return mem_realloc(MEM_FONTS, block, new_size);
+}
+
+// FreeType allocates through these, its faces and glyph slots are MEM_FONTS
+static struct FT_MemoryRec_ ft_memory = {
+    .alloc = ft_alloc,
+    .free = ft_free,
+    .realloc = ft_realloc,
+};
+
+// a binary search over the pages like FcCharSetHasChar()
+static bool
+font_has_char(const struct font* font, uint32_t ch)
+{
+    uint32_t page = ch >> 8;
+    int lo = 0;
+    int hi = font->coverage_pages;
+
+    if (font->broken)
+        return false;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (font->coverage[mid].page < page)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == font->coverage_pages || font->coverage[lo].page != page)
+        return false;
+
+    return font->coverage[lo].bits[(ch >> 5) & 7] >> (ch & 31) & 1;
+}
+
+static struct font*
+find_fallback_font(struct font_set* set, uint32_t ch)
+{
+    for (int i = 0; i < set->fallback_count; i++) {
+        if (font_has_char(&set->fallback_fonts[i], ch))
+            return &set->fallback_fonts[i];
+    }
+    return NULL;
+}
+
+static struct pixman_color
+color_to_pixman_color(struct color color)
+{
+    return (struct pixman_color){
+        (uint16_t)(color.r * 257),
+        (uint16_t)(color.g * 257),
+        (uint16_t)(color.b * 257),
+        (uint16_t)(color.a * 257),
+    };
+}
+
+// under the write lock once the set is shared, FT_New_Face() can't run
+// with other calls on the library. A font that can't be opened is marked
+// broken and treated as lacking every character, the font cache that may
+// have named it is dropped
+static bool
+open_font(struct font_set* set, struct font* font)
+{
+    if (font->ft_face != NULL)
+        return true;
+    if (font->broken)
+        return false;
+
+    FT_Error ft_err =
+      FT_New_Face(set->ft, font->ttf, font->index, &font->ft_face);
+    if (ft_err != FT_Err_Ok) {
+        HOG_ERR("Failed to open font file: %s", font->ttf);
+        font->ft_face = NULL;
+        font->broken = true;
+
+        // NULL until fonts_init() is done, the fonts aren't from the cache
+        if (set->initial.name != NULL)
+            font_cache_remove(&(struct font_cache){
+              .name = set->initial.name,
+              .pixel_size = set->initial.pixel_size,
+              .scale = set->initial.scale,
+            });
+        return false;
+    }
+
+    font->size = 0;
+    HOG("opened font: %s", font->ttf);
+    return true;
+}
+
+static void
+set_font_face_size(struct font* font, FT_UInt size)
+{
+    FT_Error ft_err = FT_Set_Char_Size(font->ft_face, size * 64., 0, 96, 96);
+
+    if (ft_err != FT_Err_Ok)
+        HOG_ERR("Failed to char pixel size on ft_face to: %d on font %s",
+                size,
+                font->ttf);
+
+    font->size = size;
+}
+
+static size_t
+glyph_hash(const struct font* font, uint32_t ch, FT_UInt size)
+{
+    uint64_t h = (uintptr_t)font ^ ((uint64_t)size << 32) ^ ch;
+
+    h ^= h >> 29;
+    h *= 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
+}
+
+// under either lock
+static struct glyph*
+glyph_find(const struct font_set* set,
+           const struct font* font,
+           uint32_t ch,
+           FT_UInt size)
+{
+    if (set->glyph_cap == 0)
+        return NULL;
+
+    size_t mask = set->glyph_cap - 1;
+
+    for (size_t i = glyph_hash(font, ch, size) & mask;; i = (i + 1) & mask) {
+        struct glyph* g = set->glyphs[i];
+
+        if (g == NULL)
+            return NULL;
+        if (g->font == font && g->ch == ch && g->size == size)
+            return g;
+    }
+}
+
+// under the write lock, keeps the table at most half full
+static void
+glyph_insert(struct font_set* set, struct glyph* g)
+{
+    if ((set->glyph_count + 1) * 2 > set->glyph_cap) {
+        size_t cap = set->glyph_cap ? set->glyph_cap * 2 : GLYPH_CACHE_MIN_CAP;
+        struct glyph** old = set->glyphs;
+        size_t old_cap = set->glyph_cap;
+
+        set->glyphs = mem_calloc(MEM_FONTS, cap, sizeof(*set->glyphs));
+        assert(set->glyphs != NULL);
+        set->glyph_cap = cap;
+        set->glyph_count = 0;
+
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i] != NULL)
+                glyph_insert(set, old[i]);
+
+        mem_free(MEM_FONTS, old);
+    }
+
+    size_t mask = set->glyph_cap - 1;
+    size_t i = glyph_hash(g->font, g->ch, g->size) & mask;
+
+    while (set->glyphs[i] != NULL)
+        i = (i + 1) & mask;
+
+    set->glyphs[i] = g;
+    set->glyph_count++;
+}
+
+// under the write lock
+static struct glyph*
+rasterize_glyph(struct font_set* set,
+                struct font* font,
+                uint32_t ch,
+                FT_UInt size)
+{
+    FT_Error ft_err;
+
+    // blank, only a primary font without a fallback for `ch` gets here
+    if (!open_font(set, font)) {
+        struct glyph* g = mem_malloc(MEM_FONTS, sizeof(*g));
+        assert(g != NULL);
+
+        *g = (struct glyph){
+            .font = font,
+            .ch = ch,
+            .size = size,
+            .pixels = (const uint32_t*)(g + 1),
+        };
+        return g;
+    }
+
+    if (font->size != size)
+        set_font_face_size(font, size);
+
+    int glyph_index = FT_Get_Char_Index(font->ft_face, ch);
+
+    ft_err = FT_Load_Glyph(font->ft_face, glyph_index, FT_LOAD_DEFAULT);
+    if (ft_err != FT_Err_Ok) {
+        HOG_ERR("Failed to load glyph");
+        abort();
+    }
+
+    ft_err = FT_Render_Glyph(font->ft_face->glyph, FT_RENDER_MODE_NORMAL);
+    if (ft_err != FT_Err_Ok) {
+        HOG_ERR("Failed to load glyph");
+        abort();
+    }
+
+    FT_Bitmap bitmap = font->ft_face->glyph->bitmap;
+
+    int stride =
+      (((PIXMAN_FORMAT_BPP(PIXMAN_a8) * bitmap.width + 7) / 8 + 4 - 1) & -4);
+
+    struct glyph* g =
+      mem_malloc(MEM_FONTS, sizeof(*g) + (size_t)bitmap.rows * stride);
+    assert(g != NULL);
+
+    *g = (struct glyph){
+        .font = font,
+        .ch = ch,
+        .size = size,
+        .width = bitmap.width,
+        .rows = bitmap.rows,
+        .stride = stride,
+        .top = font->ft_face->glyph->bitmap_top,
+        .ascent = font->ft_face->size->metrics.ascender / 63.,
+        .underline_position = font->ft_face->underline_position / 64.,
+        .underline_thickness = font->ft_face->underline_thickness / 64.,
+        .pixels = (const uint32_t*)(g + 1),
+    };
+
+    uint8_t* glyph_pix = (uint8_t*)(g + 1);
+    if (stride == bitmap.pitch) {
+        memcpy(glyph_pix, bitmap.buffer, bitmap.rows * stride);
+    } else {
+        for (size_t r = 0; r < bitmap.rows; r++) {
+            for (size_t c = 0; c < bitmap.width; c++)
+                glyph_pix[r * stride + c] = bitmap.buffer[r * bitmap.pitch + c];
+        }
+    }
+
+    return g;
+}
+
+// under the write lock, the mask comes from the shared segment. A glyph no
+// process has yet is rasterized here and moved there
+static struct glyph*
+shared_glyph(struct font_set* set,
+             struct font* font,
+             uint32_t ch,
+             FT_UInt size)
+{
+    if (font->shared_id == 0)
+        font->shared_id = shared_glyphs_font_id(font->ttf, font->index);
+    if (font->shared_id == 0)
+        return rasterize_glyph(set, font, ch, size);
+
+    const struct shared_glyph* s =
+      shared_glyphs_find(set->shared, font->shared_id, ch, size);
+
+    if (s == NULL) {
+        struct glyph* g = rasterize_glyph(set, font, ch, size);
+
+        // the other processes may be able to open it
+        if (font->broken)
+            return g;
+
+        s = shared_glyphs_add(set->shared,
+                              &(struct shared_glyph){
+                                .font_id = font->shared_id,
+                                .ch = ch,
+                                .size = size,
+                                .width = g->width,
+                                .rows = g->rows,
+                                .stride = g->stride,
+                                .top = g->top,
+                                .ascent = g->ascent,
+                                .underline_position = g->underline_position,
+                                .underline_thickness = g->underline_thickness,
+                              },
+                              (const uint8_t*)g->pixels);
+
+        // full, it stays in this process
+        if (s == NULL)
+            return g;
+
+        mem_free(MEM_FONTS, g);
+    }
+
+    struct glyph* g = mem_malloc(MEM_FONTS, sizeof(*g));
+    assert(g != NULL);
+
+    *g = (struct glyph){
+        .font = font,
+        .ch = ch,
+        .size = size,
+        .width = s->width,
+        .rows = s->rows,
+        .stride = s->stride,
+        .top = s->top,
+        .ascent = s->ascent,
+        .underline_position = s->underline_position,
+        .underline_thickness = s->underline_thickness,
+        .pixels = (const uint32_t*)s->mask,
+    };
+
+    return g;
+}
+
+/*
+ * The glyph for `ch` in `font` at the size of `fonts`, rasterized on the
+ * first use. Called with the read lock held, which is dropped for the write
+ * lock on a miss, glyphs stay valid until the set is freed.
+ */
+static const struct glyph*
+get_glyph(struct fonts* fonts, struct font* font, uint32_t ch)
+{
+    struct font_set* set = fonts->set;
+    FT_UInt size = fonts->pixel_size * fonts->scale;
+
+    struct glyph* g = glyph_find(set, font, ch, size);
+    if (g != NULL)
+        return g;
+
+    pthread_rwlock_unlock(&set->lock);
+    pthread_rwlock_wrlock(&set->lock);
+
+    // another window may have rasterized it meanwhile
+    g = glyph_find(set, font, ch, size);
+    if (g == NULL) {
+        g = set->shared ? shared_glyph(set, font, ch, size)
+                        : rasterize_glyph(set, font, ch, size);
+        glyph_insert(set, g);
+    }
+
+    pthread_rwlock_unlock(&set->lock);
+    pthread_rwlock_rdlock(&set->lock);
+
+    return g;
+}
+
+static void
+render_char_at(struct fonts* fonts,
+               struct font* font,
+               pixman_image_t* buf_img,
+               const struct cell* cell,
+               int x,
+               int y,
+               int cell_height,
+               int cell_width,
+               struct render_timing* timing)
+{
+    uint64_t mark = timing ? now_ns() : 0;
+
+    const struct glyph* glyph = get_glyph(fonts, font, cell->ch);
+
+    // only read as the mask
+    pixman_image_t* glyph_img =
+      pixman_image_create_bits_no_clear(PIXMAN_a8,
+                                        glyph->width,
+                                        glyph->rows,
+                                        (uint32_t*)glyph->pixels,
+                                        glyph->stride);
+
+    RENDER_LAP(timing, rasterize, mark);
+
+    int dst_x = x + (cell_width - glyph->width) / 2;
+
+    int baseline = y - cell_height + glyph->ascent;
+    int dst_y = baseline - glyph->top;
+
+    struct pixman_color fg = color_to_pixman_color(
+      (cell->attrs.inverse) ? cell->attrs.bg : cell->attrs.fg);
+
+    struct pixman_color bg = color_to_pixman_color(
+      (cell->attrs.inverse) ? cell->attrs.fg : cell->attrs.bg);
+
+    pixman_image_fill_rectangles(
+      PIXMAN_OP_SRC,
+      buf_img,
+      &bg,
+      1,
+      (pixman_rectangle16_t[]){
+        { x, y - cell_height, cell_width, cell_height } });
+
+    RENDER_LAP(timing, fill, mark);
+
+    pixman_image_t* color_img = pixman_image_create_solid_fill(&fg);
+
+    pixman_image_composite(PIXMAN_OP_OVER,
+                           color_img,
+                           glyph_img,
+                           buf_img,
+                           0,
+                           0,
+                           0,
+                           0,
+                           dst_x,
+                           dst_y,
+                           glyph->width,
+                           glyph->rows);
+
+    if (cell->attrs.underline) {
+        int upos = glyph->underline_position;
+        int uthick = glyph->underline_thickness;
+
+        pixman_color_t ucolor = color_to_pixman_color(COLOR_FOREGROUND);
+
+        pixman_image_fill_rectangles(PIXMAN_OP_SRC,
+                                     buf_img,
+                                     &ucolor,
+                                     1,
+                                     &(pixman_rectangle16_t){
+                                       .x = x,
+                                       .y = baseline - upos,
+                                       .width = cell_width,
+                                       .height = uthick,
+                                     });
+    }
+
+    pixman_image_unref(glyph_img);
+    pixman_image_unref(color_img);
+
+    RENDER_LAP(timing, composite, mark);
+}
+
+void
+render_snapshot(struct fonts* fonts,
+                const struct snapshot* snap,
+                uint32_t* pixels,
+                int width,
+                int height,
+                struct render_timing* timing)
+{
+    uint64_t mark = timing ? now_ns() : 0;
+
+    pixman_image_t* buf_img = pixman_image_create_bits_no_clear(
+      PIXMAN_a8r8g8b8, width, height, pixels, width * 4);
+
+    pixman_region32_t clip;
+    pixman_region32_init_rect(&clip, 0, 0, width, height);
+    pixman_image_set_clip_region32(buf_img, &clip);
+    pixman_region32_fini(&clip);
+
+    struct pixman_color bg = color_to_pixman_color(COLOR_BACKGROUND);
+    pixman_image_fill_rectangles(
+      PIXMAN_OP_SRC,
+      buf_img,
+      &bg,
+      1,
+      (pixman_rectangle16_t[]){ { 0, 0, width, height } });
+
+    RENDER_LAP(timing, fill, mark);
+
+    struct font_set* set = fonts->set;
+    struct font* font = &set->font;
+
+    int x_adv = fonts->advance_x;
+    int y_adv = fonts->advance_y;
+
+    pthread_rwlock_rdlock(&set->lock);
+
+    for (int row_idx = 0; row_idx < snap->rows; row_idx++) {
+        const struct cell* cells = &snap->cells[(size_t)row_idx * snap->cols];
+
+        // skip unused rows
+        if (cells[0].ch == 0) {
+            continue;
+        }
+
+        TRACE_BEGIN(row);
+
+        for (int col_idx = 0; col_idx < snap->cols; col_idx++) {
+            const struct cell* cell = &cells[col_idx];
+
+            uint32_t ch = cell->ch;
+
+            // Don't render null chars
+            if (ch == 0)
+                break;
+
+            if (timing)
+                mark = now_ns();
+
+            if (!font_has_char(font, ch)) {
+                struct font* fallback_font = find_fallback_font(set, ch);
+
+                // until the fallbacks are loaded it is drawn from `font`
+                if (fallback_font != NULL)
+                    font = fallback_font;
+                else if (set->fallbacks_loaded)
+                    HOG_ERR_RATELIMITED("U+%04X not found in the font nor in "
+                                        "the fallbacks",
+                                        (unsigned)ch);
+            }
+
+            RENDER_LAP(timing, font_lookup, mark);
+
+            render_char_at(fonts,
+                           font,
+                           buf_img,
+                           cell,
+                           (col_idx + 1) * x_adv,
+                           (row_idx + 1) * y_adv,
+                           fonts->cell_height,
+                           fonts->cell_width,
+                           timing);
+
+            // set back to default font if using fallback
+            if (font != &set->font)
+                font = &set->font;
+        }
+
+        TRACE_END(row, "render row");
+    }
+
+    const cursor* cur = &snap->cursor;
+    struct cell cursor_cell =
+      snap->cells[(size_t)cur->p.y * snap->cols + cur->p.x];
+
+    if (cursor_cell.ch != 0) {
+        cursor_cell.attrs.fg = COLOR_CURSOR_BACKGROUND;
+        cursor_cell.attrs.bg = COLOR_CURSOR_FOREGROUND;
+
+        render_char_at(fonts,
+                       &set->font,
+                       buf_img,
+                       &cursor_cell,
+                       (cur->p.x + 1) * x_adv,
+                       (cur->p.y + 1) * y_adv,
+                       fonts->cell_height,
+                       fonts->cell_width,
+                       timing);
+    } else {
+        struct attributes a = DEFAULT_ATTRS;
+        a.fg = COLOR_CURSOR_FOREGROUND;
+        a.bg = COLOR_CURSOR_BACKGROUND;
+        struct cell cursor = { U'\u2588', a };
+
+        render_char_at(fonts,
+                       &set->font,
+                       buf_img,
+                       &cursor,
+                       (cur->p.x + 1) * x_adv,
+                       (cur->p.y + 1) * y_adv,
+                       fonts->cell_height,
+                       fonts->cell_width,
+                       timing);
+    }
+
+    pthread_rwlock_unlock(&set->lock);
+
+    pixman_image_unref(buf_img);
+}
+
+void
+render_overlay(struct fonts* fonts,
+               uint32_t* pixels,
+               int width,
+               int height,
+               const char* const* lines,
+               int n_lines)
+{
+    int cols = 0;
+    for (int i = 0; i < n_lines; i++)
+        cols = max(cols, (int)strlen(lines[i]));
+
+    if (cols == 0)
+        return;
+
+    // a cell of padding around the text, anchored to the top right corner
+    int box_width = (cols + 2) * fonts->cell_width;
+    int box_height = (n_lines + 1) * fonts->cell_height;
+    int x0 = max(width - box_width, 0);
+
+    pixman_image_t* buf_img = pixman_image_create_bits_no_clear(
+      PIXMAN_a8r8g8b8, width, height, pixels, width * 4);
+
+    pixman_region32_t clip;
+    pixman_region32_init_rect(&clip, 0, 0, width, height);
+    pixman_image_set_clip_region32(buf_img, &clip);
+    pixman_region32_fini(&clip);
+
+    struct pixman_color bg = color_to_pixman_color(COLOR_OVERLAY_BACKGROUND);
+    pixman_image_fill_rectangles(
+      PIXMAN_OP_SRC,
+      buf_img,
+      &bg,
+      1,
+      (pixman_rectangle16_t[]){ { x0, 0, box_width, box_height } });
+
+    struct cell cell = { 0, DEFAULT_ATTRS };
+    cell.attrs.fg = COLOR_OVERLAY_FOREGROUND;
+    cell.attrs.bg = COLOR_OVERLAY_BACKGROUND;
+
+    pthread_rwlock_rdlock(&fonts->set->lock);
+
+    for (int i = 0; i < n_lines; i++) {
+        for (int col = 0; lines[i][col]; col++) {
+            if (lines[i][col] == ' ')
+                continue;
+
+            cell.ch = (unsigned char)lines[i][col];
+
+            render_char_at(fonts,
+                           &fonts->set->font,
+                           buf_img,
+                           &cell,
+                           x0 + (col + 1) * fonts->cell_width,
+                           (i + 1) * fonts->cell_height,
+                           fonts->cell_height,
+                           fonts->cell_width,
+                           NULL);
+        }
+    }
+
+    pthread_rwlock_unlock(&fonts->set->lock);
+
+    pixman_image_unref(buf_img);
+}
+
+// under the write lock
+static void
+update_cell_size(struct fonts* fonts)
+{
+    struct font* font = &fonts->set->font;
+    FT_UInt size = fonts->pixel_size * fonts->scale;
+
+    // a monospace em at 96 dpi, the glyphs come from the fallbacks
+    if (!open_font(fonts->set, font)) {
+        fonts->cell_width = size * 96 / 72 * 3 / 5;
+        fonts->cell_height = size * 96 / 72 * 6 / 5;
+        fonts->advance_x = fonts->cell_width;
+        fonts->advance_y = fonts->cell_height;
+        return;
+    }
+
+    set_font_face_size(font, size);
+    FT_Load_Char(font->ft_face, 'M', FT_LOAD_DEFAULT);
+
+    fonts->cell_width = font->ft_face->glyph->advance.x >> 6;
+    fonts->cell_height = font->ft_face->size->metrics.height >> 6;
+    fonts->advance_x = font->ft_face->glyph->advance.x / 63.;
+    fonts->advance_y = font->ft_face->size->metrics.height / 63.;
+}
+
+void
+fonts_set_scale(struct fonts* fonts, int32_t scale)
+{
+    fonts->scale = scale;
+
+    pthread_rwlock_wrlock(&fonts->set->lock);
+    update_cell_size(fonts);
+    pthread_rwlock_unlock(&fonts->set->lock);
+}
+
+// the path, face index and coverage of a font fontconfig matched, the face
+// is opened when it is needed
+static struct font
+resolve_font(FcPattern* pattern)
+{
+    FcChar8* ttf = NULL;
+    FcPatternGetString(pattern, FC_FILE, 0, &ttf);
+    assert(ttf != NULL);
+
+    int index = 0;
+    FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
+
+    FcCharSet* fc_charset;
+    if (FcPatternGetCharSet(pattern, FC_CHARSET, 0, &fc_charset) !=
+        FcResultMatch) {
+        HOG_ERR("failed to get charset");
+        abort();
+    }
+
+    struct font font = { .index = index };
+
+    font.ttf = mem_malloc(MEM_FONTS, strlen((const char*)ttf) + 1);
+    assert(font.ttf != NULL);
+    strcpy(font.ttf, (const char*)ttf);
+
+    FcChar32 map[FC_CHARSET_MAP_SIZE];
+    FcChar32 next;
+    FcChar32 base;
+
+    for (base = FcCharSetFirstPage(fc_charset, map, &next);
+         base != FC_CHARSET_DONE;
+         base = FcCharSetNextPage(fc_charset, map, &next))
+        font.coverage_pages++;
+
+    font.coverage =
+      mem_calloc(MEM_FONTS, font.coverage_pages, sizeof(*font.coverage));
+    assert(font.coverage_pages == 0 || font.coverage != NULL);
+
+    int i = 0;
+    for (base = FcCharSetFirstPage(fc_charset, map, &next);
+         base != FC_CHARSET_DONE;
+         base = FcCharSetNextPage(fc_charset, map, &next), i++) {
+        font.coverage[i].page = base >> 8;
+        memcpy(font.coverage[i].bits, map, sizeof(font.coverage[i].bits));
+    }
+
+    return font;
+}
+
+static void
+free_font(struct font* font)
+{
+    if (font->ft_face != NULL)
+        FT_Done_Face(font->ft_face);
+
+    mem_free(MEM_FONTS, font->ttf);
+    mem_free(MEM_FONTS, font->coverage);
+}
+
+// a warm start, the fonts, the metrics and the ASCII glyphs fonts_init()
+// and fonts_load_fallbacks() would come to
+static bool
+load_font_cache(struct fonts* fonts)
+{
+    struct font_set* set = fonts->set;
+    struct font_cache cache = {
+        .name = fonts->name,
+        .pixel_size = fonts->pixel_size,
+        .scale = fonts->scale,
+    };
+
+    if (!font_cache_read(&cache))
+        return false;
+
+    set->font = cache.fonts[0];
+    set->fallback_count = cache.font_count - 1;
+    set->fallback_fonts =
+      mem_calloc(MEM_FONTS, set->fallback_count, sizeof(*set->fallback_fonts));
+    assert(set->fallback_count == 0 || set->fallback_fonts != NULL);
+    memcpy(set->fallback_fonts,
+           cache.fonts + 1,
+           set->fallback_count * sizeof(*set->fallback_fonts));
+    set->fallbacks_loaded = true;
+    mem_free(MEM_FONTS, cache.fonts);
+
+    fonts->cell_width = cache.cell_width;
+    fonts->cell_height = cache.cell_height;
+    fonts->advance_x = cache.advance_x;
+    fonts->advance_y = cache.advance_y;
+
+    for (int i = 0; i < cache.glyph_count; i++) {
+        cache.glyphs[i]->font = &set->font;
+        glyph_insert(set, cache.glyphs[i]);
+    }
+    mem_free(MEM_FONTS, cache.glyphs);
+
+    return true;
+}
+
+// rasterizes printable ASCII at the size fonts_init() had for the next
+// start, the set is in use meanwhile
+static void
+save_font_cache(struct font_set* set)
+{
+    struct fonts initial = set->initial;
+    struct glyph* glyphs['~' - ' ' + 1];
+    int n_glyphs = 0;
+
+    pthread_rwlock_rdlock(&set->lock);
+
+    for (uint32_t ch = ' '; ch <= '~'; ch++)
+        glyphs[n_glyphs++] =
+          (struct glyph*)get_glyph(&initial, &set->font, ch);
+
+    // the glyphs are blank, the next start resolves the fonts again
+    if (set->font.broken) {
+        pthread_rwlock_unlock(&set->lock);
+        return;
+    }
+
+    // copies of the structs, the paths and coverage stay valid. The ones
+    // that can't be opened are left out
+    struct font* fonts = malloc((set->fallback_count + 1) * sizeof(*fonts));
+    assert(fonts != NULL);
+
+    int n_fonts = 0;
+    fonts[n_fonts++] = set->font;
+    for (int i = 0; i < set->fallback_count; i++)
+        if (!set->fallback_fonts[i].broken)
+            fonts[n_fonts++] = set->fallback_fonts[i];
+
+    pthread_rwlock_unlock(&set->lock);
+
+    font_cache_write(&(struct font_cache){
+      .name = initial.name,
+      .pixel_size = initial.pixel_size,
+      .scale = initial.scale,
+      .cell_width = initial.cell_width,
+      .cell_height = initial.cell_height,
+      .advance_x = initial.advance_x,
+      .advance_y = initial.advance_y,
+      .fonts = fonts,
+      .font_count = n_fonts,
+      .glyphs = glyphs,
+      .glyph_count = n_glyphs,
+    });
+
+    free(fonts);
+}
+
+void
+fonts_init(struct fonts* fonts,
+           const char* name,
+           FT_UInt pixel_size,
+           int32_t scale)
+{
+    fonts->name = name;
+    fonts->pixel_size = pixel_size;
+    fonts->scale = scale;
+
+    struct font_set* set = mem_calloc(MEM_FONTS, 1, sizeof(*set));
+    assert(set != NULL);
+
+    fonts->set = set;
+    set->refs = 1;
+    pthread_rwlock_init(&set->lock, NULL);
+
+    // FT_Init_FreeType() with our allocator
+    if (FT_New_Library(&ft_memory, &set->ft) != FT_Err_Ok) {
+        HOG_ERR("Failed to initialize FreeType");
+        abort();
+    }
+    FT_Add_Default_Modules(set->ft);
+    FT_Set_Default_Properties(set->ft);
+
+    set->shared = shared_glyphs_open();
+
+    if (load_font_cache(fonts)) {
+        set->initial = *fonts;
+        return;
+    }
+
+    FcPattern* pattern;
+    FcPattern* matched;
+    FcResult result;
+
+    {
+        pattern = FcNameParse((const FcChar8*)name);
+        assert(pattern != NULL);
+        FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+        FcDefaultSubstitute(pattern);
+
+        matched = FcFontMatch(NULL, pattern, &result);
+        assert(matched != NULL);
+        assert(result == FcResultMatch);
+    }
+
+    set->pattern = pattern;
+    set->font = resolve_font(matched);
+    FcPatternDestroy(matched);
+    HOG_INFO("loaded font: %s", set->font.ttf);
+
+    update_cell_size(fonts);
+    set->initial = *fonts;
+}
+
+void
+fonts_load_fallbacks(const struct fonts* fonts)
+{
+    struct font_set* set = fonts->set;
+    FcResult result;
+
+    // from the font cache
+    if (set->fallbacks_loaded)
+        return;
+
+    // fontconfig is thread safe, FcFontSort() is what takes long
+    FcFontSet* font_set =
+      FcFontSort(NULL, set->pattern, FcTrue, NULL, &result);
+
+    struct font* fallback_fonts =
+      mem_calloc(MEM_FONTS, font_set->nfont, sizeof(*fallback_fonts));
+    assert(font_set->nfont == 0 || fallback_fonts != NULL);
+
+    for (int i = 0; i < font_set->nfont; i++)
+        fallback_fonts[i] = resolve_font(font_set->fonts[i]);
+
+    pthread_rwlock_wrlock(&set->lock);
+    set->fallback_fonts = fallback_fonts;
+    set->fallback_count = font_set->nfont;
+    set->fallbacks_loaded = true;
+    pthread_rwlock_unlock(&set->lock);
+
+    HOG("%d fallback fonts", font_set->nfont);
+    FcFontSetDestroy(font_set);
+
+    save_font_cache(set);
+}
+
+void
+fonts_share(struct fonts* fonts, const struct fonts* from)
+{
+    *fonts = *from;
+
+    pthread_rwlock_wrlock(&fonts->set->lock);
+    fonts->set->refs++;
+    pthread_rwlock_unlock(&fonts->set->lock);
+}
+
+void
+fonts_fini(struct fonts* fonts)
+{
+    struct font_set* set = fonts->set;
+
+    fonts->set = NULL;
+    if (set == NULL)
+        return;
+
+    pthread_rwlock_wrlock(&set->lock);
+    int refs = --set->refs;
+    pthread_rwlock_unlock(&set->lock);
+
+    if (refs > 0)
+        return;
+
+    for (size_t i = 0; i < set->glyph_cap; i++)
+        mem_free(MEM_FONTS, set->glyphs[i]);
+    mem_free(MEM_FONTS, set->glyphs);
+
+    for (int i = 0; i < set->fallback_count; i++)
+        free_font(&set->fallback_fonts[i]);
+    mem_free(MEM_FONTS, set->fallback_fonts);
+
+    free_font(&set->font);
+    FT_Done_Library(set->ft);
+
+    // after the glyphs pointing into it
+    shared_glyphs_close(set->shared);
+
+    if (set->pattern != NULL)
+        FcPatternDestroy(set->pattern);
+
+    pthread_rwlock_destroy(&set->lock);
+    mem_free(MEM_FONTS, set);
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <fontconfig/fontconfig.h>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "shared-glyphs.h"
+#include "vt.h"
+
+/*
+ * Paints a vt snapshot into an ARGB8888 image with FreeType and pixman, no
+ * wayland involved. The window paints into its shm buffers,
+ * hooktty-render-bench into plain memory.
+ */
+
+// 256 code points of a font's charset, as fontconfig keeps them
+struct coverage_page
+{
+    uint32_t page; // ch >> 8
+    uint32_t bits[8];
+};
+
+struct font
+{
+    // opened by the first glyph or metric that needs it, fallbacks only
+    // matter for the characters the primary font lacks
+    FT_Face ft_face;
+    char* ttf;
+    int index; // of the face in `ttf`
+    bool broken; // `ttf` can't be opened, the font has no characters
+
+    // sorted by page, from fontconfig or the font cache
+    struct coverage_page* coverage;
+    int coverage_pages;
+
+    // the face has one size at a time, the one it was last rasterized at
+    FT_UInt size;
+
+    uint64_t shared_id; // shared_glyphs_font_id(), 0 until the first glyph
+};
+
+// an a8 mask rasterized at `size` pixels, `stride` bytes a row. The mask
+// follows the struct, or is in the shared glyph segment
+struct glyph
+{
+    const struct font* font;
+    uint32_t ch;
+    FT_UInt size;
+
+    int width;
+    int rows;
+    int stride;
+    int top; // rows from the top of the mask down to the baseline
+
+    // of the face at `size`, in pixels
+    int ascent;
+    int underline_position;
+    int underline_thickness;
+
+    const uint32_t* pixels;
+};
+
+// the fonts of one window
+struct fonts
+{
+    const char* name;
+    struct font_set* set;
+    FT_UInt pixel_size;
+    int32_t scale;
+
+    // pixels at `scale`, from the advance and line height of 'M'
+    int cell_width;
+    int cell_height;
+    // the same, rounded the way render_snapshot() lays out the grid
+    int advance_x;
+    int advance_y;
+};
+
+/*
+ * FreeType, the faces fontconfig matched and every glyph rasterized from
+ * them. A server shares one between its windows, each rasterizes at its own
+ * scale.
+ */
+struct font_set
+{
+    FT_Library ft;
+
+    // FreeType isn't thread safe, it and the cache are written under the
+    // write lock, lookups only need the read lock
+    pthread_rwlock_t lock;
+
+    struct font font;
+    // in fontconfig's order, empty until fonts_load_fallbacks()
+    struct font* fallback_fonts;
+    int fallback_count;
+    bool fallbacks_loaded;
+    FcPattern* pattern; // what fonts_init() matched, sorted for the fallbacks
+
+    // as fonts_init() left them, the key and the metrics of the font cache
+    struct fonts initial;
+
+    // NULL unless HOOKTTY_SHARED_GLYPHS, see shared-glyphs.h
+    struct shared_glyphs* shared;
+
+    // open addressing, NULL slots are free, glyphs are never evicted
+    struct glyph** glyphs;
+    size_t glyph_cap; // power of 2
+    size_t glyph_count;
+
+    int refs; // fonts_init() and fonts_share(), under `lock`
+};
+
+// ns spent in each step of render_snapshot(), added to on every call
+struct render_timing
+{
+    uint64_t fill;        // clearing the image and cell backgrounds
+    uint64_t font_lookup; // charset checks, fallback search, glyph index
+    uint64_t rasterize;   // glyph cache lookups, FreeType on a miss
+    uint64_t composite;   // glyph and underline compositing
+};
+
+// matches `name` with fontconfig and loads it, enough for the cell size,
+// characters it doesn't have need fonts_load_fallbacks(). From the font
+// cache if it has them, the fallbacks included
+void
+fonts_init(struct fonts* fonts,
+           const char* name,
+           FT_UInt pixel_size,
+           int32_t scale);
+
+// sorts the fonts fontconfig has for the name and keeps each as a fallback,
+// the slow part of the startup, then writes the font cache. Can run on
+// another thread while `fonts` and the fonts sharing its set are used
+void
+fonts_load_fallbacks(const struct fonts* fonts);
+
+// `fonts` uses the font set of `from`, at the same size and scale
+void
+fonts_share(struct fonts* fonts, const struct fonts* from);
+
+// drops the font set when no other fonts share it
+void
+fonts_fini(struct fonts* fonts);
+
+// glyphs are rasterized at `pixel_size * scale` from now on, updates the
+// cell size
+void
+fonts_set_scale(struct fonts* fonts, int32_t scale);
+
+// `width` and `height` are in pixels, `pixels` is `width * 4` bytes a row,
+// `timing` can be NULL
+void
+render_snapshot(struct fonts* fonts,
+                const struct snapshot* snap,
+                uint32_t* pixels,
+                int width,
+                int height,
+                struct render_timing* timing);
+
+// paints `lines` of ASCII text over the top right corner of an image painted
+// by render_snapshot(), for the HOOKTTY_HUD overlay
+void
+render_overlay(struct fonts* fonts,
+               uint32_t* pixels,
+               int width,
+               int height,
+               const char* const* lines,
+               int n_lines);
@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "mem.h"
+#include "ring.h"
+
+struct byte_ring*
+ring_new(size_t size)
+{
+    size_t pow2 = 4096;
+    while (pow2 < size)
+        pow2 <<= 1;
+
+    struct byte_ring* r = aligned_alloc(CACHE_LINE_SIZE, sizeof(*r));
+    assert(r != NULL);
+    memset(r, 0, sizeof(*r));
+
+    r->size = pow2;
+    r->mask = pow2 - 1;
+    r->buf = mem_malloc(MEM_PTY, pow2);
+    assert(r->buf != NULL);
+
+    r->data_fd = eventfd(0, EFD_CLOEXEC);
+    r->space_fd = eventfd(0, EFD_CLOEXEC);
+    if (r->data_fd < 0 || r->space_fd < 0) {
+        HOG_ERR("eventfd failed: %s", strerror(errno));
+        if (r->data_fd >= 0)
+            close(r->data_fd);
+        if (r->space_fd >= 0)
+            close(r->space_fd);
+        mem_free(MEM_PTY, r->buf);
+        free(r);
+        return NULL;
+    }
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->producer_waiting, false);
+    atomic_init(&r->consumer_waiting, false);
+    atomic_init(&r->closed, false);
+
+    return r;
+}
+
+void
+ring_free(struct byte_ring* r)
+{
+    close(r->data_fd);
+    close(r->space_fd);
+    mem_free(MEM_PTY, r->buf);
+    free(r);
+}
+
+static void
+wake(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+sleep_on(int fd)
+{
+    uint64_t v;
+    while (read(fd, &v, sizeof(v)) < 0 && errno == EINTR)
+        ;
+}
+
+size_t
+ring_write_span(struct byte_ring* r, char** p)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - r->tail_cache == r->size)
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    size_t space = r->size - (head - r->tail_cache);
+    size_t off = head & r->mask;
+
+    *p = r->buf + off;
+    return min(space, r->size - off);
+}
+
+void
+ring_commit(struct byte_ring* r, size_t n)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    // seq_cst pairs with the consumer setting its waiting flag
+    atomic_store(&r->head, head + n);
+
+    if (atomic_load(&r->consumer_waiting))
+        wake(r->data_fd);
+}
+
+void
+ring_wait_space(struct byte_ring* r)
+{
+    atomic_store(&r->producer_waiting, true);
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load(&r->tail) == r->size)
+        sleep_on(r->space_fd);
+
+    atomic_store(&r->producer_waiting, false);
+}
+
+void
+ring_write(struct byte_ring* r, const char* data, size_t n)
+{
+    while (n) {
+        char* p;
+        size_t span = ring_write_span(r, &p);
+
+        if (span == 0) {
+            ring_wait_space(r);
+            continue;
+        }
+
+        span = min(span, n);
+        memcpy(p, data, span);
+        ring_commit(r, span);
+
+        data += span;
+        n -= span;
+    }
+}
+
+void
+ring_close(struct byte_ring* r)
+{
+    atomic_store(&r->closed, true);
+    wake(r->data_fd);
+}
+
+int
+ring_read_spans(struct byte_ring* r, struct iovec iov[2], size_t max)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (tail == r->head_cache)
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    size_t used = min(r->head_cache - tail, max);
+    if (used == 0)
+        return 0;
+
+    size_t off = tail & r->mask;
+    size_t first = min(used, r->size - off);
+
+    iov[0] = (struct iovec){ r->buf + off, first };
+    if (first == used)
+        return 1;
+
+    iov[1] = (struct iovec){ r->buf, used - first };
+    return 2;
+}
+
+void
+ring_consume(struct byte_ring* r, size_t n)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    // seq_cst pairs with the producer setting its waiting flag
+    atomic_store(&r->tail, tail + n);
+
+    if (atomic_load(&r->producer_waiting))
+        wake(r->space_fd);
+}
+
+bool
+ring_wait_data(struct byte_ring* r)
+{
+    atomic_store(&r->consumer_waiting, true);
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    bool empty = atomic_load(&r->head) == tail;
+
+    if (empty && atomic_load(&r->closed)) {
+        atomic_store(&r->consumer_waiting, false);
+        return false;
+    }
+
+    if (empty)
+        sleep_on(r->data_fd);
+
+    atomic_store(&r->consumer_waiting, false);
+    return true;
+}
+
+size_t
+ring_fill(struct byte_ring* r)
+{
+    return atomic_load(&r->head) - atomic_load(&r->tail);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Lock-free single producer / single consumer byte ring.
+ *
+ * `head` and `tail` only grow, the producer owns `head` and the consumer
+ * `tail`, each on its own cache line next to the copy of the other index it
+ * last saw. The blocking side sleeps on an eventfd, the other side only pays
+ * for the write() when a waiter flag is set.
+ */
+struct byte_ring
+{
+    char* buf;
+    size_t size; // power of 2
+    size_t mask;
+
+    int data_fd;  // producer -> consumer wakeups
+    int space_fd; // consumer -> producer wakeups
+
+    alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    size_t tail_cache;
+    atomic_bool producer_waiting;
+
+    alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    size_t head_cache;
+    atomic_bool consumer_waiting;
+
+    alignas(CACHE_LINE_SIZE) atomic_bool closed;
+};
+
+// `size` is rounded up to a power of 2, NULL if the eventfds can't be
+// created
+struct byte_ring*
+ring_new(size_t size);
+
+void
+ring_free(struct byte_ring* r);
+
+/* producer */
+
+// contiguous free space at the head, 0 if the ring is full
+size_t
+ring_write_span(struct byte_ring* r, char** p);
+
+void
+ring_commit(struct byte_ring* r, size_t n);
+
+void
+ring_wait_space(struct byte_ring* r);
+
+// copies `n` bytes in, waiting for space when needed
+void
+ring_write(struct byte_ring* r, const char* data, size_t n);
+
+// no more data will be written, wakes the consumer
+void
+ring_close(struct byte_ring* r);
+
+/* consumer */
+
+// up to `max` readable bytes as 1 or 2 spans (wrap around), returns the
+// number of spans, 0 if the ring is empty
+int
+ring_read_spans(struct byte_ring* r, struct iovec iov[2], size_t max);
+
+void
+ring_consume(struct byte_ring* r, size_t n);
+
+// returns false once the ring is closed and empty
+bool
+ring_wait_data(struct byte_ring* r);
+
+// bytes waiting to be consumed
+size_t
+ring_fill(struct byte_ring* r);
@@ -2,6 +2,7 @@
 
 #include "macros.h"
 #include "main.h"
+#include "pty-write.h"
 #include "seat.h"
 #include "sys/mman.h"
 #include "unistd.h"
@@ -61,12 +62,35 @@ handle_wl_keyboard_enter(void* data,
 {
 }
 
+static void
+stop_repeat(struct state* state)
+{
+    state->kbd.repeat_key = 0;
+    loop_arm_timer(&state->loop, 0, 0);
+}
+
 void
 handle_wl_keyboard_leave(void* data,
                          struct wl_keyboard* wl_keyboard,
                          uint32_t serial,
                          struct wl_surface* surface)
 {
+    stop_repeat(data);
+}
+
+void
+handle_wl_keyboard_repeat_info(void* data,
+                               struct wl_keyboard* wl_keyboard,
+                               int32_t rate,
+                               int32_t delay)
+{
+    struct state* state = data;
+
+    state->kbd.repeat_rate = rate;
+    state->kbd.repeat_delay = delay;
+
+    if (rate == 0)
+        stop_repeat(state);
 }
 
 void
@@ -126,22 +150,9 @@ handle_wl_keyboard_keymap(void* data,
     close(fd);
 }
 
-void
-handle_wl_keyboard_key(void* data,
-                       struct wl_keyboard* wl_keyboard,
-                       uint32_t serial,
-                       uint32_t time,
-                       uint32_t key,
-                       uint32_t state)
+static void
+send_key(struct state* s, uint32_t key)
 {
-    if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
-        return;
-
-    struct state* s = data;
-
-    // if (key == KEY_ESC)
-    //     s->keep_running = 0;
-
     key += 8;
 
     xkb_keysym_t sym = xkb_state_key_get_one_sym(s->xkb_state, key);
@@ -167,35 +178,86 @@ handle_wl_keyboard_key(void* data,
     HOG("sym: 0x%x, l: %d: %s", sym, layout_idx, name);
 
     if (key - 8 == KEY_LEFT && s->kbd.ctrl) {
-        write(s->master_fd, "\x1B[1;5D", 6);
+        pty_write(s, "\x1B[1;5D", 6);
         return;
     }
     if (key - 8 == KEY_LEFT) {
-        write(s->master_fd, "\x1B[D", 3);
+        pty_write(s, "\x1B[D", 3);
         return;
     }
 
     if (key - 8 == KEY_UP) {
-        write(s->master_fd, "\x1B[A", 3);
+        pty_write(s, "\x1B[A", 3);
         return;
     }
 
     if (key - 8 == KEY_RIGHT && s->kbd.ctrl) {
-        write(s->master_fd, "\x1B[1;5C", 6);
+        pty_write(s, "\x1B[1;5C", 6);
         return;
     }
 
     if (key - 8 == KEY_RIGHT) {
-        write(s->master_fd, "\x1B[C", 3);
+        pty_write(s, "\x1B[C", 3);
         return;
     }
 
     if (key - 8 == KEY_DOWN) {
-        write(s->master_fd, "\x1B[B", 3);
+        pty_write(s, "\x1B[B", 3);
         return;
     }
 
-    write(s->master_fd, &(name[0]), 1);
+    pty_write(s, &(name[0]), 1);
+}
+
+void
+handle_wl_keyboard_key(void* data,
+                       struct wl_keyboard* wl_keyboard,
+                       uint32_t serial,
+                       uint32_t time,
+                       uint32_t key,
+                       uint32_t state)
+{
+    struct state* s = data;
+
+    if (state == WL_KEYBOARD_KEY_STATE_RELEASED) {
+        if (key == s->kbd.repeat_key)
+            stop_repeat(s);
+        return;
+    }
+
+    // if (key == KEY_ESC)
+    //     s->keep_running = 0;
+
+    key_pressed(s);
+    send_key(s, key);
+
+    if (s->kbd.repeat_rate <= 0 ||
+        !xkb_keymap_key_repeats(s->xkb_map, key + 8)) {
+        stop_repeat(s);
+        return;
+    }
+
+    // a 0 delay or interval would disarm the timer
+    int32_t interval = 1000 / s->kbd.repeat_rate;
+
+    s->kbd.repeat_key = key;
+    loop_arm_timer(&s->loop,
+                   s->kbd.repeat_delay > 0 ? s->kbd.repeat_delay : 1,
+                   interval > 0 ? interval : 1);
+}
+
+void
+keyboard_repeat(struct state* state, uint64_t count)
+{
+    if (state->kbd.repeat_key == 0)
+        return;
+
+    // the loop was late, don't flood the pty with everything it missed
+    if (count > 5)
+        count = 5;
+
+    while (count--)
+        send_key(state, state->kbd.repeat_key);
 }
 
 void
@@ -235,6 +297,11 @@ handle_wl_keyboard_modifiers(void* data,
 void
 init_seat_devs(struct state* state)
 {
+    // used until the compositor sends repeat_info
+    state->kbd.repeat_rate = 25;
+    state->kbd.repeat_delay = 600;
+    state->kbd.repeat_key = 0;
+
     state->pointer = wl_seat_get_pointer(state->seat);
 
     state->keyboard = wl_seat_get_keyboard(state->seat);
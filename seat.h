@@ -92,10 +92,21 @@ handle_wl_keyboard_modifiers(void* data,
                              uint32_t mods_locked,
                              uint32_t group);
 
+void
+handle_wl_keyboard_repeat_info(void* data,
+                               struct wl_keyboard* wl_keyboard,
+                               int32_t rate,
+                               int32_t delay);
+
 static const struct wl_keyboard_listener wl_keyboard_listener = {
     .keymap = handle_wl_keyboard_keymap,
     .enter = handle_wl_keyboard_enter,
     .leave = handle_wl_keyboard_leave,
     .key = handle_wl_keyboard_key,
     .modifiers = handle_wl_keyboard_modifiers,
+    .repeat_info = handle_wl_keyboard_repeat_info,
 };
+
+// the loop timer fired `count` times since the last call
+void
+keyboard_repeat(struct state* state, uint64_t count);
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "macros.h"
+#include "main.h"
+#include "render.h"
+#include "server.h"
+#include "trace.h"
+
+// a client that doesn't send its request in time gets no window
+#define SERVER_REQUEST_TIMEOUT_S 2
+
+struct window
+{
+    struct server* server;
+    int fd; // the client, until the window is up
+
+    // what `state` points into
+    char** argv;
+    char* cwd;
+
+    struct state* state; // NULL until the window is up
+    struct window* next;
+};
+
+struct server
+{
+    struct fonts fonts;
+
+    // guards `windows`, the windows add and remove themselves
+    pthread_mutex_t mutex;
+    struct window* windows;
+};
+
+static bool
+read_full(int fd, void* buf, size_t n)
+{
+    char* p = buf;
+
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+
+        p += r;
+        n -= r;
+    }
+
+    return true;
+}
+
+// fills `w->argv` and `w->cwd`, one allocation each
+static bool
+read_request(struct window* w)
+{
+    uint32_t head[2];
+
+    if (!read_full(w->fd, head, sizeof(head)))
+        return false;
+
+    uint32_t argc = head[0];
+    uint32_t cwd_len = head[1];
+
+    if (argc > SERVER_REQUEST_MAX / sizeof(uint32_t) ||
+        cwd_len > SERVER_REQUEST_MAX)
+        return false;
+
+    uint32_t* lens = calloc(argc + 1, sizeof(*lens));
+    if (!read_full(w->fd, lens, argc * sizeof(*lens))) {
+        free(lens);
+        return false;
+    }
+
+    size_t args = 0;
+    for (uint32_t i = 0; i < argc; i++)
+        args += lens[i];
+
+    if (sizeof(head) + argc * sizeof(*lens) + cwd_len + args >
+        SERVER_REQUEST_MAX) {
+        free(lens);
+        return false;
+    }
+
+    // the arguments follow the pointers, every one terminated
+    w->argv = calloc(1, (argc + 1) * sizeof(char*) + args + argc);
+    w->cwd = calloc(1, cwd_len + 1);
+
+    char* p = (char*)(w->argv + argc + 1);
+    bool ok = read_full(w->fd, w->cwd, cwd_len);
+
+    for (uint32_t i = 0; ok && i < argc; i++) {
+        w->argv[i] = p;
+        ok = read_full(w->fd, p, lens[i]);
+        p += lens[i] + 1;
+    }
+
+    free(lens);
+    return ok;
+}
+
+static void
+free_window(struct window* w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+
+    free(w->argv);
+    free(w->cwd);
+    free(w);
+}
+
+static void*
+window_thread(void* data)
+{
+    struct window* w = data;
+    struct server* server = w->server;
+
+    TRACE_THREAD("window");
+
+    struct timeval timeout = { SERVER_REQUEST_TIMEOUT_S, 0 };
+    setsockopt(w->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (read_request(w)) {
+        w->state = state_new(w->argv[0] ? w->argv : NULL,
+                             *w->cwd ? w->cwd : NULL,
+                             &server->fonts);
+    } else {
+        // a second server checking if this one is alive ends up here too
+        HOG("invalid window request");
+    }
+
+    uint8_t status = w->state == NULL;
+    send(w->fd, &status, sizeof(status), MSG_NOSIGNAL);
+    close(w->fd);
+    w->fd = -1;
+
+    if (w->state == NULL) {
+        free_window(w);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    w->next = server->windows;
+    server->windows = w;
+    pthread_mutex_unlock(&server->mutex);
+
+    loop_run(w->state);
+
+    pthread_mutex_lock(&server->mutex);
+    for (struct window** p = &server->windows; *p; p = &(*p)->next) {
+        if (*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    state_free(w->state);
+    free_window(w);
+
+    return NULL;
+}
+
+static void
+open_window(struct server* server, int fd)
+{
+    struct window* w = calloc(1, sizeof(*w));
+    *w = (struct window){ .server = server, .fd = fd };
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t tid;
+    if (pthread_create(&tid, &attr, window_thread, w) != 0) {
+        HOG_ERR("can't start a window thread");
+        free_window(w);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+// the listening socket, -1 if another server is listening on `path` or it
+// can't be bound
+static int
+listen_on(const char* path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        HOG_ERR("socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // a socket nobody listens on is left over from a server that died
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        HOG_ERR("a server is already listening on %s", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// false once the server should exit
+static bool
+handle_signals(struct server* server, int signal_fd)
+{
+    struct signalfd_siginfo si;
+    bool running = true;
+
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGUSR1:
+                pthread_mutex_lock(&server->mutex);
+                for (struct window* w = server->windows; w; w = w->next)
+                    dump_stats(w->state);
+                pthread_mutex_unlock(&server->mutex);
+                break;
+            case SIGCHLD:
+                loop_reap_orphans();
+                break;
+#ifdef HOOKTTY_TRACE
+            case SIGUSR2:
+                dump_trace();
+                break;
+#endif
+            case SIGINT:
+            case SIGTERM:
+                running = false;
+                break;
+        }
+    }
+
+    return running;
+}
+
+int
+server_run(const char* path)
+{
+    char buf[108];
+
+    if (path == NULL) {
+        if (!server_socket_path(buf, sizeof(buf))) {
+            HOG_ERR("XDG_RUNTIME_DIR isn't set, give a socket path");
+            return 1;
+        }
+        path = buf;
+    }
+
+    TRACE_THREAD("server");
+
+    // blocked before any window thread exists, they inherit the mask. A
+    // window reaps its own child from a pidfd, nothing reaps it before so
+    // its pid stays valid
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+#ifdef HOOKTTY_TRACE
+    sigaddset(&mask, SIGUSR2);
+#endif
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        return 1;
+    }
+
+    int listen_fd = listen_on(path);
+    if (listen_fd < 0)
+        return 1;
+
+    // static, the detached window threads use it until the process is gone
+    static struct server server = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+
+    fonts_init(&server.fonts, "Hack", 10, 1);
+    fonts_load_fallbacks(&server.fonts);
+
+    HOG_INFO("listening on %s", path);
+
+    struct pollfd pfd[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("poll");
+            break;
+        }
+
+        if (pfd[1].revents && !handle_signals(&server, signal_fd))
+            break;
+
+        if (!pfd[0].revents)
+            continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0)
+            open_window(&server, fd);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            perror("accept");
+    }
+
+    // the windows go with the process, their shells get a hangup. Nothing
+    // is freed and no exit handler runs while they may still draw
+    unlink(path);
+    close(listen_fd);
+
+    log_flush();
+    _exit(0);
+}
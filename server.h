@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * `hooktty --server [socket]` loads the fonts once and opens a window for
+ * every request on its socket, `hooktty-client [-s socket] [command...]`
+ * sends one. The windows share the FreeType library, the faces and the
+ * glyph cache (struct font_set), everything else is their own: a thread
+ * running the loop, a wayland connection, the pty and its threads.
+ *
+ * A request is, in host byte order
+ *
+ *   u32  argc, 0 for the shell
+ *   u32  length of the working directory
+ *   u32  length of each argument, argc of them
+ *   the working directory and the arguments, without terminators
+ *
+ * and the server answers with one byte, 0 once the window is up.
+ */
+
+// the whole request, lengths included
+#define SERVER_REQUEST_MAX (64 * 1024)
+
+// $XDG_RUNTIME_DIR/hooktty-$WAYLAND_DISPLAY.sock, false if XDG_RUNTIME_DIR
+// isn't set or it doesn't fit
+static inline bool
+server_socket_path(char* buf, size_t size)
+{
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    const char* display = getenv("WAYLAND_DISPLAY");
+
+    if (!dir || !*dir)
+        return false;
+
+    if (!display || !*display)
+        display = "wayland-0";
+
+    // WAYLAND_DISPLAY can be a path too
+    const char* slash = strrchr(display, '/');
+    if (slash != NULL)
+        display = slash + 1;
+
+    int n = snprintf(buf, size, "%s/hooktty-%s.sock", dir, display);
+    return n > 0 && (size_t)n < size;
+}
+
+// `path` NULL for server_socket_path(), returns the exit status if the
+// server can't start and _exit()s once it is stopped
+int
+server_run(const char* path);
@@ -0,0 +1,247 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "shared-glyphs.h"
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the slots are shared");
+
+static uint64_t
+slot_hash(uint64_t font_id, uint32_t ch, uint32_t size)
+{
+    uint64_t h = font_id ^ ((uint64_t)size << 32) ^ ch;
+
+    h ^= h >> 29;
+    h *= 0x9e3779b97f4a7c15ull;
+    return h ^ (h >> 32);
+}
+
+// under the flock(), nobody maps a segment before it has its magic
+static void
+init_header(struct shared_glyphs_header* header, size_t size)
+{
+    size_t slots = SHARED_GLYPHS_SLOTS * sizeof(header->slots[0]);
+
+    header->size = size;
+    header->slot_count = SHARED_GLYPHS_SLOTS;
+    header->data_start = (sizeof(*header) + slots + 63) & ~(size_t)63;
+    atomic_store(&header->used, 0);
+
+    memcpy(header->magic, SHARED_GLYPHS_MAGIC, SHARED_GLYPHS_MAGIC_LEN);
+}
+
+static bool
+valid_header(const struct shared_glyphs_header* header, size_t size)
+{
+    uint32_t slots = header->slot_count;
+
+    return memcmp(header->magic,
+                  SHARED_GLYPHS_MAGIC,
+                  SHARED_GLYPHS_MAGIC_LEN) == 0 &&
+           header->size == size && slots != 0 && (slots & (slots - 1)) == 0 &&
+           header->data_start >=
+             sizeof(*header) + slots * sizeof(header->slots[0]) &&
+           header->data_start < size;
+}
+
+struct shared_glyphs*
+shared_glyphs_open(void)
+{
+    const char* enabled = getenv("HOOKTTY_SHARED_GLYPHS");
+    if (!enabled || !*enabled || strcmp(enabled, "0") == 0)
+        return NULL;
+
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) {
+        HOG_ERR("HOOKTTY_SHARED_GLYPHS needs XDG_RUNTIME_DIR");
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/hooktty-glyphs", dir);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    // the first process sizes and initializes it, the others wait here
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    void* p = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 &&
+        (st.st_size != 0 || ftruncate(fd, SHARED_GLYPHS_SIZE) == 0)) {
+        if (st.st_size == 0)
+            st.st_size = SHARED_GLYPHS_SIZE;
+
+        p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    struct shared_glyphs_header* header = p;
+    bool ok = p != MAP_FAILED && (size_t)st.st_size > sizeof(*header);
+
+    // a magic of zeros was never initialized, its creator died before that
+    if (ok && header->magic[0] == '\0')
+        init_header(header, st.st_size);
+
+    ok = ok && valid_header(header, st.st_size);
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (!ok) {
+        HOG_ERR("%s is from another version or broken, remove it", path);
+        if (p != MAP_FAILED)
+            munmap(p, st.st_size);
+        return NULL;
+    }
+
+    struct shared_glyphs* shared = calloc(1, sizeof(*shared));
+    *shared = (struct shared_glyphs){ .header = header, .size = st.st_size };
+
+    HOG_INFO("shared glyphs: %s, %lu KB used",
+             path,
+             (unsigned long)(atomic_load(&header->used) / 1024));
+
+    return shared;
+}
+
+void
+shared_glyphs_close(struct shared_glyphs* shared)
+{
+    if (shared == NULL)
+        return;
+
+    munmap(shared->header, shared->size);
+    free(shared);
+}
+
+uint64_t
+shared_glyphs_font_id(const char* path, int index)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0)
+        return 0;
+
+    // FNV-1a of the path, then what changes when the file is replaced
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const char* p = path; *p; p++)
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+
+    uint64_t fields[] = {
+        index, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        h = (h ^ fields[i]) * 0x100000001b3ull;
+
+    return h ? h : 1;
+}
+
+// NULL for an entry outside the segment, another process could have
+// written anything
+static const struct shared_glyph*
+entry_at(const struct shared_glyphs* shared, uint64_t offset)
+{
+    const struct shared_glyphs_header* header = shared->header;
+
+    if (offset < header->data_start ||
+        offset > shared->size - sizeof(struct shared_glyph))
+        return NULL;
+
+    const struct shared_glyph* g =
+      (const struct shared_glyph*)((const char*)header + offset);
+
+    if (g->rows < 0 || g->stride < 0 ||
+        (uint64_t)g->rows * g->stride >
+          shared->size - offset - sizeof(*g))
+        return NULL;
+
+    return g;
+}
+
+const struct shared_glyph*
+shared_glyphs_find(const struct shared_glyphs* shared,
+                   uint64_t font_id,
+                   uint32_t ch,
+                   uint32_t size)
+{
+    struct shared_glyphs_header* header = shared->header;
+    uint64_t mask = header->slot_count - 1;
+    uint64_t i = slot_hash(font_id, ch, size) & mask;
+
+    for (uint32_t n = 0; n < header->slot_count; n++, i = (i + 1) & mask) {
+        uint64_t offset =
+          atomic_load_explicit(&header->slots[i], memory_order_acquire);
+        if (offset == 0)
+            return NULL;
+
+        const struct shared_glyph* g = entry_at(shared, offset);
+        if (g != NULL && g->font_id == font_id && g->ch == ch &&
+            g->size == size)
+            return g;
+    }
+
+    return NULL;
+}
+
+const struct shared_glyph*
+shared_glyphs_add(struct shared_glyphs* shared,
+                  const struct shared_glyph* glyph,
+                  const uint8_t* mask)
+{
+    struct shared_glyphs_header* header = shared->header;
+    size_t mask_size = (size_t)glyph->rows * glyph->stride;
+    uint64_t n = (sizeof(*glyph) + mask_size + 7) & ~7ull;
+
+    if (shared->full)
+        return NULL;
+
+    uint64_t used =
+      atomic_fetch_add_explicit(&header->used, n, memory_order_relaxed);
+    uint64_t offset = header->data_start + used;
+
+    if (offset + n > shared->size) {
+        HOG_INFO("shared glyphs: full, new glyphs stay in this process");
+        shared->full = true;
+        return NULL;
+    }
+
+    struct shared_glyph* g = (struct shared_glyph*)((char*)header + offset);
+    *g = *glyph;
+    memcpy(g->mask, mask, mask_size);
+
+    // the release makes the entry visible before its offset
+    uint64_t slot_mask = header->slot_count - 1;
+    uint64_t i = slot_hash(glyph->font_id, glyph->ch, glyph->size) & slot_mask;
+
+    for (uint32_t k = 0; k < header->slot_count; k++, i = (i + 1) & slot_mask) {
+        uint64_t expected = 0;
+
+        if (atomic_compare_exchange_strong_explicit(&header->slots[i],
+                                                    &expected,
+                                                    offset,
+                                                    memory_order_release,
+                                                    memory_order_acquire))
+            return g;
+
+        // another process added it meanwhile, its copy is the one found
+        const struct shared_glyph* other = entry_at(shared, expected);
+        if (other != NULL && other->font_id == glyph->font_id &&
+            other->ch == glyph->ch && other->size == glyph->size)
+            return other;
+    }
+
+    HOG_INFO("shared glyphs: no free slot, new glyphs stay in this process");
+    shared->full = true;
+    return NULL;
+}
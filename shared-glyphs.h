@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Glyph masks shared between hooktty processes, enabled with
+ * HOOKTTY_SHARED_GLYPHS=1. The segment is $XDG_RUNTIME_DIR/hooktty-glyphs,
+ * on the runtime dir's tmpfs, mapped by every process that uses it. The
+ * first process to open it sizes and initializes it under flock(). Nothing
+ * else takes a lock.
+ *
+ * Entries are appended after the slot table and never move or change. A
+ * writer reserves space by bumping `used`, fills the entry, then publishes
+ * its offset into a free slot with a CAS. Readers probe the slots without
+ * locking. Two processes adding the same glyph both publish it, and the
+ * second copy is never found. Once the segment is full, glyphs stay in the
+ * process that rasterized them.
+ */
+
+#define SHARED_GLYPHS_MAGIC "hookgly\x01"
+#define SHARED_GLYPHS_MAGIC_LEN 8
+
+// sparse on tmpfs, only what is appended uses memory
+#define SHARED_GLYPHS_SIZE (64u << 20)
+#define SHARED_GLYPHS_SLOTS (1u << 17)
+
+struct shared_glyphs_header
+{
+    char magic[SHARED_GLYPHS_MAGIC_LEN]; // written last by the initializer
+    uint64_t size;
+    uint32_t slot_count; // power of 2
+    uint32_t data_start; // the first entry, after the slots
+    _Atomic uint64_t used; // bytes from `data_start` handed out
+    _Atomic uint64_t slots[]; // entry offsets in the segment, 0 for free
+};
+
+// an a8 mask as in struct glyph, `size` is pixel size * scale
+struct shared_glyph
+{
+    uint64_t font_id;
+    uint32_t ch;
+    uint32_t size;
+
+    int32_t width;
+    int32_t rows;
+    int32_t stride;
+    int32_t top;
+    int32_t ascent;
+    int32_t underline_position;
+    int32_t underline_thickness;
+    int32_t pad;
+
+    uint8_t mask[];
+};
+
+struct shared_glyphs
+{
+    struct shared_glyphs_header* header;
+    size_t size;
+    bool full; // logged once
+};
+
+// maps the segment, NULL when disabled or it can't be used
+struct shared_glyphs*
+shared_glyphs_open(void);
+
+void
+shared_glyphs_close(struct shared_glyphs* shared);
+
+// identifies the face `index` of the font file at `path` across processes,
+// a replaced file gets a new id. 0 if it can't be stat()ed
+uint64_t
+shared_glyphs_font_id(const char* path, int index);
+
+// NULL if no process added it yet, without locking
+const struct shared_glyph*
+shared_glyphs_find(const struct shared_glyphs* shared,
+                   uint64_t font_id,
+                   uint32_t ch,
+                   uint32_t size);
+
+// copies `glyph` and `mask` in, the mask is `rows * stride` bytes. Returns
+// the entry, NULL once the segment is full
+const struct shared_glyph*
+shared_glyphs_add(struct shared_glyphs* shared,
+                  const struct shared_glyph* glyph,
+                  const uint8_t* mask);
@@ -0,0 +1,279 @@
+#include <stddef.h>
+
+#include "macros.h"
+#include "stats.h"
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+// the only writer of `h` at the time
+void
+histogram_record(struct histogram* h, uint64_t v)
+{
+    int bucket = v ? 63 - __builtin_clzll(v) : 0;
+    uint64_t count = LOAD(h->count);
+
+    STORE(h->buckets[bucket], LOAD(h->buckets[bucket]) + 1);
+    STORE(h->sum, LOAD(h->sum) + v);
+
+    if (count == 0 || v < LOAD(h->min))
+        STORE(h->min, v);
+    if (v > LOAD(h->max))
+        STORE(h->max, v);
+
+    STORE(h->count, count + 1);
+}
+
+// upper bound of the bucket holding the p-th percentile (0 < p <= 1)
+uint64_t
+histogram_percentile(const struct histogram* h, double p)
+{
+    uint64_t count = LOAD(h->count);
+    uint64_t max = LOAD(h->max);
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(p * count + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += LOAD(h->buckets[i]);
+        if (seen < rank)
+            continue;
+
+        uint64_t upper = (i == 63) ? UINT64_MAX : (2ull << i) - 1;
+        return min(upper, max);
+    }
+
+    return max;
+}
+
+void
+histogram_sub(struct histogram* out,
+              const struct histogram* a,
+              const struct histogram* b)
+{
+    *out = (struct histogram){ 0 };
+
+    int lo = -1, hi = -1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        out->buckets[i] = a->buckets[i] - b->buckets[i];
+        out->count += out->buckets[i];
+
+        if (out->buckets[i] == 0)
+            continue;
+        if (lo < 0)
+            lo = i;
+        hi = i;
+    }
+
+    if (out->count == 0)
+        return;
+
+    out->sum = a->sum - b->sum;
+
+    // only the buckets are known, unless the extremes are in the window
+    out->min = max(a->min, lo ? 1ull << lo : 0);
+    out->max = min(a->max, (hi == 63) ? UINT64_MAX : (2ull << hi) - 1);
+}
+
+static const struct
+{
+    const char* name;
+    const char* unit;
+    size_t offset;
+} histograms[] = {
+    { "parse batch", "B", offsetof(struct stats, read_batch) },
+    { "pty ring fill", "B", offsetof(struct stats, ring_fill) },
+    { "parse grid_mutex wait", "ns", offsetof(struct stats, parse_lock_wait) },
+    { "parse grid_mutex hold", "ns", offsetof(struct stats, parse_lock_hold) },
+    { "render grid_mutex wait", "ns", offsetof(struct stats, render_lock_wait) },
+    { "render grid_mutex hold", "ns", offsetof(struct stats, render_lock_hold) },
+    { "paint", "ns", offsetof(struct stats, paint_time) },
+    { "commit to frame done", "ns", offsetof(struct stats, frame_latency) },
+    { "commit to present", "ns", offsetof(struct stats, commit_to_present) },
+    { "pty output to present", "ns", offsetof(struct stats, output_to_present) },
+    { "key to present", "ns", offsetof(struct stats, key_to_present) },
+    { "pty write queue", "B", offsetof(struct stats, pty_write_queue) },
+};
+
+#define HISTOGRAM_COUNT (sizeof(histograms) / sizeof(histograms[0]))
+
+static const struct
+{
+    const char* name;
+    size_t offset;
+} counters[] = {
+    { "pty ring full", offsetof(struct stats, ring_full) },
+    { "pty write blocked", offsetof(struct stats, pty_write_blocked) },
+    { "pty write partial", offsetof(struct stats, pty_write_partial) },
+    { "frames", offsetof(struct stats, frames) },
+    { "frames skipped", offsetof(struct stats, frames_skipped) },
+    { "frames presented", offsetof(struct stats, frames_presented) },
+    { "frames discarded", offsetof(struct stats, frames_discarded) },
+    { "buffer busy", offsetof(struct stats, buffer_busy) },
+};
+
+#define COUNTER_COUNT (sizeof(counters) / sizeof(counters[0]))
+
+#define STATS_FIELD(stats, type, offset)                                       \
+    ((const type*)((const char*)(stats) + (offset)))
+#define STATS_FIELD_OUT(stats, type, offset)                                   \
+    ((type*)((char*)(stats) + (offset)))
+
+static void
+histogram_copy(struct histogram* out, const struct histogram* h)
+{
+    STORE(out->count, LOAD(h->count));
+    STORE(out->sum, LOAD(h->sum));
+    STORE(out->min, LOAD(h->min));
+    STORE(out->max, LOAD(h->max));
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        STORE(out->buckets[i], LOAD(h->buckets[i]));
+}
+
+void
+stats_copy(struct stats* out, const struct stats* stats)
+{
+    for (size_t i = 0; i < HISTOGRAM_COUNT; i++)
+        histogram_copy(
+          STATS_FIELD_OUT(out, struct histogram, histograms[i].offset),
+          STATS_FIELD(stats, struct histogram, histograms[i].offset));
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++) {
+        size_t offset = counters[i].offset;
+
+        STORE(*STATS_FIELD_OUT(out, atomic_uint_fast64_t, offset),
+              LOAD(*STATS_FIELD(stats, atomic_uint_fast64_t, offset)));
+    }
+}
+
+static int
+histogram_format(char* buf,
+                 size_t size,
+                 const char* name,
+                 const char* unit,
+                 const struct histogram* h)
+{
+    uint64_t count = LOAD(h->count);
+    if (count == 0)
+        return snprintf(buf, size, "%s: no samples", name);
+
+    return snprintf(buf,
+                    size,
+                    "%s: n=%lu avg=%lu%s min=%lu p50=%lu p99=%lu max=%lu",
+                    name,
+                    count,
+                    LOAD(h->sum) / count,
+                    unit,
+                    LOAD(h->min),
+                    histogram_percentile(h, 0.5),
+                    histogram_percentile(h, 0.99),
+                    LOAD(h->max));
+}
+
+void
+histogram_log(const char* name, const char* unit, const struct histogram* h)
+{
+    char line[256];
+
+    histogram_format(line, sizeof(line), name, unit, h);
+    HOG_INFO("%s", line);
+}
+
+void
+stats_log(const struct stats* stats)
+{
+    for (size_t i = 0; i < HISTOGRAM_COUNT; i++)
+        histogram_log(
+          histograms[i].name,
+          histograms[i].unit,
+          STATS_FIELD(stats, struct histogram, histograms[i].offset));
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+        HOG_INFO("%s: %lu",
+                 counters[i].name,
+                 LOAD(*STATS_FIELD(
+                   stats, atomic_uint_fast64_t, counters[i].offset)));
+}
+
+void
+stats_dump(const struct stats* stats, FILE* f)
+{
+    char line[256];
+
+    for (size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+        histogram_format(
+          line,
+          sizeof(line),
+          histograms[i].name,
+          histograms[i].unit,
+          STATS_FIELD(stats, struct histogram, histograms[i].offset));
+        fprintf(f, "%s\n", line);
+    }
+
+    for (size_t i = 0; i < COUNTER_COUNT; i++)
+        fprintf(f,
+                "%s: %lu\n",
+                counters[i].name,
+                LOAD(*STATS_FIELD(
+                  stats, atomic_uint_fast64_t, counters[i].offset)));
+}
+
+static const struct
+{
+    const char* name;
+    size_t offset;
+} startup_steps[] = {
+    { "pty", offsetof(struct startup, pty) },
+    { "connect", offsetof(struct startup, connect) },
+    { "roundtrip", offsetof(struct startup, roundtrip) },
+    { "surface", offsetof(struct startup, surface) },
+    { "font", offsetof(struct startup, font) },
+    { "fonts wait", offsetof(struct startup, fonts_wait) },
+    { "configure", offsetof(struct startup, configure) },
+    { "first frame", offsetof(struct startup, first_frame) },
+    { "first output", offsetof(struct startup, first_output) },
+    { "first prompt", offsetof(struct startup, first_prompt) },
+};
+
+#define STARTUP_STEP_COUNT (sizeof(startup_steps) / sizeof(startup_steps[0]))
+
+static void
+startup_format(char* buf, size_t size, const struct startup* startup)
+{
+    int n = snprintf(buf, size, "startup:");
+
+    for (size_t i = 0; i < STARTUP_STEP_COUNT && n < (int)size; i++) {
+        uint64_t t = *STATS_FIELD(startup, uint64_t, startup_steps[i].offset);
+        if (t == 0)
+            continue;
+
+        n += snprintf(buf + n,
+                      size - n,
+                      " %s %.1f ms",
+                      startup_steps[i].name,
+                      (t - startup->start) / 1e6);
+    }
+}
+
+void
+startup_log(const struct startup* startup)
+{
+    char line[256];
+
+    startup_format(line, sizeof(line), startup);
+    HOG_INFO("%s", line);
+}
+
+void
+startup_dump(const struct startup* startup, FILE* f)
+{
+    char line[256];
+
+    startup_format(line, sizeof(line), startup);
+    fprintf(f, "%s\n", line);
+}
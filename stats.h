@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// log2 buckets, bucket i counts values in [2^i, 2^(i+1)), 0 goes to bucket 0
+#define HISTOGRAM_BUCKETS 64
+
+/*
+ * The stats are written by the reader, parser, render and main threads and
+ * read by the HUD and the SIGUSR1 dump from others. Every field is a relaxed
+ * atomic, a reader never sees a torn value and a field never goes back. The
+ * writes to one histogram are serialized, each is recorded by one thread or
+ * under a mutex, so they are plain loads and stores.
+ */
+struct histogram
+{
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t min;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct stats
+{
+    // bytes parsed per grid_mutex acquisition, `sum` is all bytes parsed
+    struct histogram read_batch;
+    // bytes in the pty ring when the parser picks up a batch
+    struct histogram ring_fill;
+    // times the reader found the pty ring full
+    atomic_uint_fast64_t ring_full;
+    // ns waiting for / holding grid_mutex, per parsed batch and per frame,
+    // the parser holds it for the whole parse
+    struct histogram parse_lock_wait;
+    struct histogram parse_lock_hold;
+    struct histogram render_lock_wait;
+    struct histogram render_lock_hold;
+    // bytes waiting for the child to read its input, sampled on each write
+    // that couldn't go out right away
+    struct histogram pty_write_queue;
+    // writes to the pty that hit EAGAIN / wrote only part of the queue
+    atomic_uint_fast64_t pty_write_blocked;
+    atomic_uint_fast64_t pty_write_partial;
+    // ns painting a frame, without the snapshot
+    struct histogram paint_time;
+    // ns from a commit to the frame callback that came with it
+    struct histogram frame_latency;
+    // ns until wp_presentation says the frame reached the screen, from its
+    // commit, from the oldest pty output in it and from the key press its
+    // output followed
+    struct histogram commit_to_present;
+    struct histogram output_to_present;
+    struct histogram key_to_present;
+    atomic_uint_fast64_t frames;
+    // wp_presentation feedback, frames shown and frames never shown
+    atomic_uint_fast64_t frames_presented;
+    atomic_uint_fast64_t frames_discarded;
+    // frame callbacks that couldn't start a frame, the last one was still
+    // being painted or no buffer was free
+    atomic_uint_fast64_t frames_skipped;
+    // frames that found both buffers held by the compositor
+    atomic_uint_fast64_t buffer_busy;
+};
+
+// when each step of opening a window was done, now_ns() or 0 until it is.
+// The steps overlap, the pty and the fonts start before the connection
+struct startup
+{
+    uint64_t start;        // state_new()
+    uint64_t pty;          // the child was spawned
+    uint64_t connect;      // wl_display_connect()
+    uint64_t roundtrip;    // the globals are bound
+    uint64_t surface;      // the toplevel and the seat are set up
+    uint64_t font;         // the primary font is loaded, on the font thread
+    uint64_t fonts_wait;   // the window had to wait for it until then
+    uint64_t configure;    // the first xdg_surface.configure
+    uint64_t first_frame;  // the first painted buffer was committed
+    uint64_t first_output; // the output the first prompt shows arrived
+    uint64_t first_prompt; // a frame with pty output reached the screen
+};
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// counters can have more than one writer
+static inline void
+stat_add(atomic_uint_fast64_t* counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// the first time only
+static inline void
+startup_mark(uint64_t* step)
+{
+    if (*step == 0)
+        *step = now_ns();
+}
+
+void
+histogram_record(struct histogram* h, uint64_t v);
+
+uint64_t
+histogram_percentile(const struct histogram* h, double p);
+
+// `out` = `a` - `b`, the samples recorded since `b` was copied from `a`
+void
+histogram_sub(struct histogram* out,
+              const struct histogram* a,
+              const struct histogram* b);
+
+// a consistent enough copy for rates, every field is read once
+void
+stats_copy(struct stats* out, const struct stats* stats);
+
+void
+histogram_log(const char* name, const char* unit, const struct histogram* h);
+
+void
+stats_log(const struct stats* stats);
+
+// the same as stats_log() without colors, for the SIGUSR1 dump
+void
+stats_dump(const struct stats* stats, FILE* f);
+
+// one line with the ms since `start` of every step done so far
+void
+startup_log(const struct startup* startup);
+
+void
+startup_dump(const struct startup* startup, FILE* f);
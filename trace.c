@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "macros.h"
+#include "mem.h"
+#include "trace.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+struct trace_event
+{
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+/*
+ * Single producer ring, the owning thread writes the event at `head` and
+ * then publishes it by bumping `head`. The dump copies the newest events and
+ * drops the ones the producer may have been overwriting meanwhile, the ones
+ * `head` moved past by more than TRACE_RING_SIZE after the copy.
+ */
+struct trace_ring
+{
+    struct trace_ring* next;
+    const char* thread_name;
+    pid_t tid;
+
+    atomic_uint_fast64_t head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+// every ring ever created, threads are few and rings are never freed so
+// the dump can walk it while threads come and go
+static _Atomic(struct trace_ring*) rings;
+
+static __thread struct trace_ring* thread_ring;
+
+static struct trace_ring*
+trace_ring_get(void)
+{
+    if (thread_ring != NULL)
+        return thread_ring;
+
+    struct trace_ring* r = mem_calloc(MEM_DIAG, 1, sizeof(*r));
+    assert(r != NULL);
+
+    r->tid = gettid();
+    atomic_init(&r->head, 0);
+
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+    }
+
+    thread_ring = r;
+    return r;
+}
+
+void
+trace_thread(const char* name)
+{
+    trace_ring_get()->thread_name = name;
+}
+
+void
+trace_span(const char* name, uint64_t start, uint64_t end)
+{
+    struct trace_ring* r = trace_ring_get();
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    r->events[head & TRACE_RING_MASK] =
+      (struct trace_event){ name, start, end };
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static void
+dump_ring(FILE* f, struct trace_ring* r, pid_t pid, bool* first)
+{
+    static struct trace_event copy[TRACE_RING_SIZE];
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    for (uint64_t i = from; i < head; i++)
+        copy[i & TRACE_RING_MASK] = r->events[i & TRACE_RING_MASK];
+
+    // the slots of events older than `after - TRACE_RING_SIZE` may have been
+    // reused while copying
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (after > TRACE_RING_SIZE && after - TRACE_RING_SIZE > from)
+        from = min(after - TRACE_RING_SIZE, head);
+
+    if (r->thread_name != NULL) {
+        fprintf(f,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                *first ? "" : ",",
+                pid,
+                r->tid,
+                r->thread_name);
+        *first = false;
+    }
+
+    for (uint64_t i = from; i < head; i++) {
+        const struct trace_event* e = &copy[i & TRACE_RING_MASK];
+
+        fprintf(f,
+                "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f}",
+                *first ? "" : ",",
+                e->name,
+                pid,
+                r->tid,
+                e->start / 1e3,
+                (e->end - e->start) / 1e3);
+        *first = false;
+    }
+}
+
+bool
+trace_dump(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+
+    pid_t pid = getpid();
+    bool first = true;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (struct trace_ring* r = atomic_load(&rings); r != NULL; r = r->next)
+        dump_ring(f, r, pid, &first);
+
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
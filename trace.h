@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/*
+ * Trace spans, built in with `make TRACE=1` (-DHOOKTTY_TRACE) and compiled
+ * out otherwise.
+ *
+ * Every thread records into its own ring of the last TRACE_RING_SIZE spans,
+ * so recording takes no locks and a busy thread can't push out the spans of
+ * the others. SIGUSR2 writes them all to HOOKTTY_TRACE_FILE, by default
+ * /tmp/hooktty-trace-<pid>.json, in the Chrome trace event format that
+ * chrome://tracing and ui.perfetto.dev open.
+ *
+ *   TRACE_BEGIN(t);
+ *   ...
+ *   TRACE_END(t, "parse");
+ *
+ * `name` has to be a string literal, only the pointer is kept.
+ */
+
+#define TRACE_RING_SIZE 16384 // power of 2
+
+#ifdef HOOKTTY_TRACE
+
+#define TRACE_BEGIN(var) uint64_t var = now_ns()
+#define TRACE_END(var, name) trace_span(name, var, now_ns())
+#define TRACE_THREAD(name) trace_thread(name)
+
+// records a span of the calling thread
+void
+trace_span(const char* name, uint64_t start, uint64_t end);
+
+// names the calling thread in the dump, `name` has to be a string literal
+void
+trace_thread(const char* name);
+
+// writes the spans of every thread to `path`, false on error
+bool
+trace_dump(const char* path);
+
+#else
+
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name)
+#define TRACE_THREAD(name)
+
+#endif
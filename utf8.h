@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <uchar.h>
+
+/*
+ * Incremental utf-8 decoder driven by a small DFA, the idea is from
+ * https://bjoern.hoehrmann.de/utf-8/decoder/dfa/
+ *
+ * Every byte is mapped to a class and the class moves the decoder to the next
+ * state. Overlong forms, surrogates and values above U+10FFFF are rejected at
+ * the first byte that can't continue a valid sequence, which is what the
+ * "maximal subpart" rule for emitting U+FFFD needs.
+ */
+
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 1
+
+#define UTF8_REPLACEMENT_CHAR U'\uFFFD'
+
+enum utf8_class
+{
+    UTF8_C_ASCII,   // 00-7f
+    UTF8_C_CONT_LO, // 80-8f
+    UTF8_C_CONT_MI, // 90-9f
+    UTF8_C_CONT_HI, // a0-bf
+    UTF8_C_INVALID, // c0-c1, f5-ff
+    UTF8_C_LEAD2,   // c2-df
+    UTF8_C_E0,
+    UTF8_C_LEAD3, // e1-ec, ee-ef
+    UTF8_C_ED,
+    UTF8_C_F0,
+    UTF8_C_LEAD4, // f1-f3
+    UTF8_C_F4,
+
+    UTF8_CLASS_COUNT,
+};
+
+enum utf8_dfa_state
+{
+    UTF8_S_ACCEPT = UTF8_ACCEPT,
+    UTF8_S_REJECT = UTF8_REJECT,
+    UTF8_S_CONT1, // 1 continuation byte left
+    UTF8_S_CONT2,
+    UTF8_S_CONT3,
+    UTF8_S_E0, // a0-bf, then 1 more
+    UTF8_S_ED, // 80-9f, then 1 more
+    UTF8_S_F0, // 90-bf, then 2 more
+    UTF8_S_F4, // 80-8f, then 2 more
+
+    UTF8_STATE_COUNT,
+};
+
+static const uint8_t utf8_class[256] = {
+    [0x00 ... 0x7f] = UTF8_C_ASCII,   [0x80 ... 0x8f] = UTF8_C_CONT_LO,
+    [0x90 ... 0x9f] = UTF8_C_CONT_MI, [0xa0 ... 0xbf] = UTF8_C_CONT_HI,
+    [0xc0 ... 0xc1] = UTF8_C_INVALID, [0xc2 ... 0xdf] = UTF8_C_LEAD2,
+    [0xe0] = UTF8_C_E0,               [0xe1 ... 0xec] = UTF8_C_LEAD3,
+    [0xed] = UTF8_C_ED,               [0xee ... 0xef] = UTF8_C_LEAD3,
+    [0xf0] = UTF8_C_F0,               [0xf1 ... 0xf3] = UTF8_C_LEAD4,
+    [0xf4] = UTF8_C_F4,               [0xf5 ... 0xff] = UTF8_C_INVALID,
+};
+
+// payload bits of the first byte of a sequence
+static const uint8_t utf8_lead_mask[UTF8_CLASS_COUNT] = {
+    [UTF8_C_ASCII] = 0x7f, [UTF8_C_LEAD2] = 0x1f, [UTF8_C_E0] = 0x0f,
+    [UTF8_C_LEAD3] = 0x0f, [UTF8_C_ED] = 0x0f,    [UTF8_C_F0] = 0x07,
+    [UTF8_C_LEAD4] = 0x07, [UTF8_C_F4] = 0x07,
+};
+
+#define A UTF8_S_ACCEPT
+#define R UTF8_S_REJECT
+#define C1 UTF8_S_CONT1
+#define C2 UTF8_S_CONT2
+#define C3 UTF8_S_CONT3
+#define E0 UTF8_S_E0
+#define ED UTF8_S_ED
+#define F0 UTF8_S_F0
+#define F4 UTF8_S_F4
+
+// clang-format off
+static const uint8_t utf8_transitions[UTF8_STATE_COUNT][UTF8_CLASS_COUNT] = {
+    /*               00  80  90  a0  c0  c2  e0  e1  ed  f0  f1  f4 */
+    [UTF8_S_ACCEPT] = { A,  R,  R,  R,  R, C1, E0, C2, ED, F0, C3, F4 },
+    [UTF8_S_REJECT] = { R,  R,  R,  R,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_CONT1]  = { R,  A,  A,  A,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_CONT2]  = { R, C1, C1, C1,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_CONT3]  = { R, C2, C2, C2,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_E0]     = { R,  R,  R, C1,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_ED]     = { R, C1, C1,  R,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_F0]     = { R,  R, C2, C2,  R,  R,  R,  R,  R,  R,  R,  R },
+    [UTF8_S_F4]     = { R, C2,  R,  R,  R,  R,  R,  R,  R,  R,  R,  R },
+};
+// clang-format on
+
+#undef A
+#undef R
+#undef C1
+#undef C2
+#undef C3
+#undef E0
+#undef ED
+#undef F0
+#undef F4
+
+/*
+ * Feeds one byte, returns the new state:
+ *   UTF8_ACCEPT  `*cp` holds a complete codepoint
+ *   UTF8_REJECT  the sequence is invalid, if the previous state wasn't
+ *                UTF8_ACCEPT the byte has to be fed again after a reset
+ *   otherwise    more bytes are needed
+ */
+static inline uint32_t
+utf8_decode(uint32_t* state, char32_t* cp, uint8_t b)
+{
+    uint8_t class = utf8_class[b];
+
+    *cp = (*state != UTF8_ACCEPT) ? (*cp << 6) | (b & 0x3f)
+                                  : (char32_t)(b & utf8_lead_mask[class]);
+
+    *state = utf8_transitions[*state][class];
+
+    return *state;
+}
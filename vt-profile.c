@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+#include "vt-profile.h"
+#include "vt.h"
+
+#define VT_PROFILE_MASK (VT_PROFILE_SLOTS - 1)
+
+// kind:8 marker:8 intermediate:8 final:8 param:32
+static uint64_t
+make_key(enum vt_profile_kind kind,
+         uint8_t marker,
+         uint8_t intermediate,
+         uint8_t final,
+         uint32_t param)
+{
+    return (uint64_t)kind << 56 | (uint64_t)marker << 48 |
+           (uint64_t)intermediate << 40 | (uint64_t)final << 32 | param;
+}
+
+static void
+record(struct vt_profile* prof, uint64_t key, uint64_t ns, bool unsupported)
+{
+    // fibonacci hashing, the low bits of the keys are mostly the same
+    size_t i = (key * 0x9e3779b97f4a7c15ull) >> 54;
+    struct vt_profile_entry* e = &prof->other;
+
+    for (size_t probe = 0; probe < VT_PROFILE_SLOTS; probe++) {
+        struct vt_profile_entry* slot =
+          &prof->entries[(i + probe) & VT_PROFILE_MASK];
+
+        if (slot->key == key || slot->key == 0) {
+            slot->key = key;
+            e = slot;
+            break;
+        }
+    }
+
+    e->count++;
+    e->ns += ns;
+    e->unsupported += unsupported;
+}
+
+static bool
+is_subparam(const struct parser* p, int idx)
+{
+    return idx < p->params_len && (p->subparams & (1u << idx));
+}
+
+// the SGR parameters without the arguments of 38/48/58, the way
+// csi_dispatch_sgr() reads them
+static int
+sgr_params(const struct parser* p, int* out)
+{
+    int n = 0;
+
+    for (int i = 0; i < p->params_len; i++) {
+        int v = p->params[i];
+        out[n++] = v;
+
+        if ((v == 38 || v == 48 || v == 58) && i + 1 < p->params_len &&
+            !is_subparam(p, i + 1)) {
+            if (p->params[i + 1] == 5)
+                i += 2;
+            else if (p->params[i + 1] == 2)
+                i += 4;
+        }
+
+        while (is_subparam(p, i + 1))
+            i++;
+    }
+
+    return n;
+}
+
+static uint32_t
+osc_number(const struct parser* p)
+{
+    uint32_t n = 0;
+
+    for (size_t i = 0; i < p->osc_len && p->osc[i] >= '0' && p->osc[i] <= '9';
+         i++)
+        n = min(n * 10 + (p->osc[i] - '0'), UINT16_MAX);
+
+    return n;
+}
+
+void
+vt_profile_dispatch(struct vt_profile* prof,
+                    enum vt_profile_kind kind,
+                    const struct parser* p,
+                    uint8_t final,
+                    uint64_t ns)
+{
+    uint8_t marker = 0, intermediate = 0;
+    uint32_t param = 0;
+
+    if (kind != VT_PROFILE_C0) {
+        marker = p->private_marker;
+        intermediate = p->intermediates_len ? p->intermediates[0] : 0;
+    }
+
+    if (kind == VT_PROFILE_OSC) {
+        marker = intermediate = 0;
+        param = osc_number(p);
+    }
+
+    record(prof,
+           make_key(kind, marker, intermediate, final, param),
+           ns,
+           p->unsupported);
+
+    if (kind != VT_PROFILE_CSI || intermediate)
+        return;
+
+    // the time of the sequence is split between its parameters
+    if (final == 'm' && !marker) {
+        int params[ANSI_MAX_NUM_PARAMS];
+        int n = sgr_params(p, params);
+
+        for (int i = 0; i < n; i++)
+            record(prof,
+                   make_key(VT_PROFILE_SGR, 0, 0, final, params[i]),
+                   ns / n,
+                   false);
+    } else if (final == 'h' || final == 'l') {
+        for (int i = 0; i < p->params_len; i++)
+            record(prof,
+                   make_key(VT_PROFILE_MODE, marker, 0, final, p->params[i]),
+                   ns / p->params_len,
+                   false);
+    }
+}
+
+static void
+key_name(uint64_t key, char* buf, size_t size)
+{
+    enum vt_profile_kind kind = key >> 56;
+    char marker = key >> 48;
+    char intermediate = key >> 40;
+    char final = key >> 32;
+    uint32_t param = key;
+
+    // "? " / "( " / "" in front of the final byte
+    char pre[5] = { 0 };
+    int n = 0;
+    if (marker) {
+        pre[n++] = marker;
+        pre[n++] = ' ';
+    }
+    if (intermediate) {
+        pre[n++] = intermediate;
+        pre[n++] = ' ';
+    }
+
+    switch (kind) {
+        case VT_PROFILE_C0:
+            snprintf(buf, size, "C0 0x%02x", (uint8_t)final);
+            break;
+        case VT_PROFILE_ESC:
+            snprintf(buf, size, "ESC %s%c", pre, final);
+            break;
+        case VT_PROFILE_CSI:
+            snprintf(buf, size, "CSI %s%c", pre, final);
+            break;
+        case VT_PROFILE_MODE:
+            snprintf(buf, size, "CSI %s%u %c", pre, param, final);
+            break;
+        case VT_PROFILE_SGR:
+            snprintf(buf, size, "SGR %u", param);
+            break;
+        case VT_PROFILE_OSC:
+            snprintf(buf, size, "OSC %u", param);
+            break;
+        case VT_PROFILE_DCS:
+            snprintf(buf, size, "DCS %s%c", pre, final);
+            break;
+        default:
+            snprintf(buf, size, "other");
+            break;
+    }
+}
+
+static int
+compare_ns(const void* a, const void* b)
+{
+    const struct vt_profile_entry* ea = a;
+    const struct vt_profile_entry* eb = b;
+
+    if (ea->ns != eb->ns)
+        return ea->ns < eb->ns ? 1 : -1;
+
+    return (ea->count < eb->count) - (ea->count > eb->count);
+}
+
+void
+vt_profile_report(const struct vt_profile* prof, FILE* f, size_t max)
+{
+    uint64_t total = prof->text_bytes + prof->control_bytes;
+
+    fprintf(f,
+            "text %lu B (%.1f%%), control %lu B (%.1f%%)\n",
+            prof->text_bytes,
+            total ? 100.0 * prof->text_bytes / total : 0,
+            prof->control_bytes,
+            total ? 100.0 * prof->control_bytes / total : 0);
+
+    struct vt_profile_entry sorted[VT_PROFILE_SLOTS + 1];
+    size_t n = 0;
+
+    for (size_t i = 0; i < VT_PROFILE_SLOTS; i++)
+        if (prof->entries[i].key != 0)
+            sorted[n++] = prof->entries[i];
+
+    if (prof->other.count)
+        sorted[n++] = prof->other;
+
+    qsort(sorted, n, sizeof(sorted[0]), compare_ns);
+
+    if (max == 0 || max > n)
+        max = n;
+
+    fprintf(f,
+            "%-20s %12s %12s %10s %12s\n",
+            "sequence",
+            "count",
+            "total ms",
+            "ns/each",
+            "unsupported");
+
+    for (size_t i = 0; i < max; i++) {
+        const struct vt_profile_entry* e = &sorted[i];
+        char name[32];
+
+        key_name(e->key, name, sizeof(name));
+
+        fprintf(f,
+                "%-20s %12lu %12.3f %10lu %12lu\n",
+                name,
+                e->count,
+                e->ns / 1e6,
+                e->ns / e->count,
+                e->unsupported);
+    }
+}
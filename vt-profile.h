@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct parser;
+
+/*
+ * Counts of what the parser dispatched and how long it took, enabled per vt
+ * with vt_profile_enable(). Sequences are keyed by their kind, private
+ * marker, first intermediate and final byte, SGR parameters and
+ * DECSET/DECRST modes get an entry each on top of the one of the sequence
+ * with an even share of its time. Only the sequence entries count
+ * unsupported dispatches.
+ *
+ * Written by whoever calls vt_parse(), the frontend serializes the report
+ * with it like any other vt call.
+ */
+
+enum vt_profile_kind
+{
+    VT_PROFILE_C0 = 1,
+    VT_PROFILE_ESC,
+    VT_PROFILE_CSI,
+    VT_PROFILE_MODE, // DECSET/DECRST/SM/RM parameter
+    VT_PROFILE_SGR,  // SGR parameter
+    VT_PROFILE_OSC,
+    VT_PROFILE_DCS,
+};
+
+#define VT_PROFILE_SLOTS 1024 // power of 2
+
+struct vt_profile_entry
+{
+    uint64_t key; // 0 for a free slot
+    uint64_t count;
+    uint64_t ns;
+    uint64_t unsupported; // dispatches that hit an unsupported path
+};
+
+struct vt_profile
+{
+    uint64_t text_bytes;    // printed, ascii and utf-8
+    uint64_t control_bytes; // C0, sequences and strings
+
+    // the ones that didn't fit in `entries`
+    struct vt_profile_entry other;
+    struct vt_profile_entry entries[VT_PROFILE_SLOTS];
+};
+
+// accounts one dispatch, `p` is the parser state the sequence was
+// dispatched with
+void
+vt_profile_dispatch(struct vt_profile* prof,
+                    enum vt_profile_kind kind,
+                    const struct parser* p,
+                    uint8_t final,
+                    uint64_t ns);
+
+// the byte counts and the `max` entries that took the most time, all of
+// them if `max` is 0
+void
+vt_profile_report(const struct vt_profile* prof, FILE* f, size_t max);
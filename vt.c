@@ -0,0 +1,1414 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "ansi.h"
+#include "macros.h"
+#include "mem.h"
+#include "stats.h"
+#include "utf8.h"
+#include "vt.h"
+
+// for input the parser doesn't handle, counted by the profiler
+#define UNSUPPORTED(p, fmt, ...)                                               \
+    do {                                                                       \
+        (p)->unsupported = true;                                               \
+        HOG_ERR_RATELIMITED(fmt, ##__VA_ARGS__);                               \
+    } while (0)
+
+// runs `call`, which dispatches `final`, and accounts it when profiling
+#define PROFILE_DISPATCH(vt, kind, final, call)                                \
+    do {                                                                       \
+        if (!(vt)->profile) {                                                  \
+            call;                                                              \
+            break;                                                             \
+        }                                                                      \
+                                                                               \
+        (vt)->parser.unsupported = false;                                      \
+        uint64_t start_ = now_ns();                                            \
+        call;                                                                  \
+        vt_profile_dispatch(                                                   \
+          (vt)->profile, kind, &(vt)->parser, final, now_ns() - start_);       \
+    } while (0)
+
+static const struct color COLOR_BRIGHT_0 = { 57, 57, 57, 255 };
+static const struct color COLOR_BRIGHT_1 = { 238, 83, 150, 255 };
+static const struct color COLOR_BRIGHT_2 = { 66, 190, 101, 255 };
+static const struct color COLOR_BRIGHT_3 = { 255, 233, 123, 255 };
+static const struct color COLOR_BRIGHT_4 = { 51, 177, 255, 255 };
+static const struct color COLOR_BRIGHT_5 = { 255, 126, 182, 255 };
+static const struct color COLOR_BRIGHT_6 = { 61, 219, 217, 255 };
+static const struct color COLOR_BRIGHT_7 = { 255, 255, 255, 255 };
+
+static const struct color COLOR_REGULAR_0 = { 0, 0, 0, 255 };
+static const struct color COLOR_REGULAR_1 = { 255, 126, 182, 255 };
+static const struct color COLOR_REGULAR_2 = { 66, 190, 101, 255 };
+static const struct color COLOR_REGULAR_3 = { 255, 233, 123, 255 };
+static const struct color COLOR_REGULAR_4 = { 51, 177, 255, 255 };
+static const struct color COLOR_REGULAR_5 = { 255, 126, 182, 255 };
+static const struct color COLOR_REGULAR_6 = { 61, 219, 217, 255 };
+static const struct color COLOR_REGULAR_7 = { 221, 225, 230, 255 };
+
+static const struct color SYSTEM_COLORS[16] = {
+    COLOR_REGULAR_0, COLOR_REGULAR_1, COLOR_REGULAR_2, COLOR_REGULAR_3,
+    COLOR_REGULAR_4, COLOR_REGULAR_5, COLOR_REGULAR_6, COLOR_REGULAR_7,
+
+    COLOR_BRIGHT_0,  COLOR_BRIGHT_1,  COLOR_BRIGHT_2,  COLOR_BRIGHT_3,
+    COLOR_BRIGHT_4,  COLOR_BRIGHT_5,  COLOR_BRIGHT_6,  COLOR_BRIGHT_7,
+};
+
+static inline struct row**
+get_grid(struct vt* vt)
+{
+    return (vt->alt_screen) ? vt->alt_grid : vt->grid;
+}
+
+static inline struct cursor*
+get_cursor(struct vt* vt)
+{
+    return (vt->alt_screen) ? &vt->alt_cursor : &vt->cursor;
+}
+
+void
+vt_snapshot(struct vt* vt, struct snapshot* snap)
+{
+    struct row** grid = get_grid(vt);
+    size_t size = (size_t)vt->rows * vt->cols;
+
+    if (size > snap->cap) {
+        snap->cells = mem_realloc(
+          MEM_SNAPSHOT, snap->cells, size * sizeof(*snap->cells));
+        assert(snap->cells != NULL);
+        snap->cap = size;
+    }
+
+    snap->rows = vt->rows;
+    snap->cols = vt->cols;
+    snap->cursor = *get_cursor(vt);
+
+    for (int i = 0; i < vt->rows; i++) {
+        struct cell* dst = &snap->cells[(size_t)i * vt->cols];
+        size_t len = min(grid[i]->len, vt->cols);
+
+        memcpy(dst, grid[i]->cells, len * sizeof(*dst));
+        // rows not yet reused after a resize are shorter
+        memset(dst + len, 0, (vt->cols - len) * sizeof(*dst));
+    }
+}
+
+static struct row*
+init_row(uint16_t size)
+{
+    struct row* row = mem_malloc(MEM_GRID, sizeof(struct row));
+    row->cells = mem_calloc(MEM_GRID, size, sizeof(*row->cells));
+
+    struct attributes attrs = DEFAULT_ATTRS;
+
+    for (int i = 0; i < size; i++) {
+        row->cells[i].ch = 0;
+        row->cells[i].attrs = attrs;
+    }
+
+    row->len = size;
+
+    return row;
+}
+
+static struct row**
+init_grid(uint16_t rows, uint16_t cols)
+{
+    struct row** grid = mem_malloc(MEM_GRID, rows * sizeof(struct row*));
+
+    for (int i = 0; i < rows; i++) {
+        grid[i] = init_row(cols);
+    }
+
+    return grid;
+}
+
+static void
+grow_grid(struct row*** grid, uint16_t old_rows, uint16_t rows, uint16_t cols)
+{
+    struct row** new = mem_realloc(MEM_GRID, *grid, rows * sizeof(struct row*));
+
+    assert(new != NULL);
+
+    *grid = new;
+
+    for (int i = old_rows; i < rows; i++) {
+        (*grid)[i] = init_row(cols);
+    }
+}
+
+static void
+free_row(struct row* row)
+{
+    mem_free(MEM_GRID, row->cells);
+    mem_free(MEM_GRID, row);
+}
+
+// drops `top` rows from the top and whatever doesn't fit from the bottom
+static void
+shrink_grid(struct row*** grid, uint16_t old_rows, uint16_t rows, uint16_t top)
+{
+    for (int i = 0; i < top; i++)
+        free_row((*grid)[i]);
+
+    for (int i = top + rows; i < old_rows; i++)
+        free_row((*grid)[i]);
+
+    memmove(*grid, *grid + top, rows * sizeof(struct row*));
+
+    struct row** new = mem_realloc(MEM_GRID, *grid, rows * sizeof(struct row*));
+    assert(new != NULL);
+    *grid = new;
+}
+
+static void
+free_grid(struct row** grid, uint16_t rows)
+{
+    for (int i = 0; i < rows; i++)
+        free_row(grid[i]);
+
+    mem_free(MEM_GRID, grid);
+}
+
+static inline void
+erase_cell(struct cell* c, char32_t ch, struct color bg)
+{
+    c->ch = ch;
+    c->attrs = DEFAULT_ATTRS;
+    c->attrs.bg = bg;
+}
+
+static inline void
+erase_row(struct row* r, char32_t ch, struct color bg)
+{
+    for (size_t i = 0; i < r->len; i++)
+        erase_cell(&r->cells[i], ch, bg);
+}
+
+static void
+pop_first_grid_row(struct vt* vt, struct row** grid)
+{
+    uint16_t top = vt->top_margin;
+    uint16_t btm = vt->btm_margin;
+
+    struct row* top_row = grid[top];
+
+    for (int i = top; i < btm; ++i) {
+        grid[i] = grid[i + 1];
+    }
+
+    erase_row(top_row, ' ', vt->parser.attrs.bg);
+    grid[btm] = top_row;
+}
+
+static void
+scroll(struct vt* vt, struct row** grid)
+{
+    assert(vt->btm_margin < vt->rows);
+    // equal on a screen of one row
+    assert(vt->top_margin < vt->rows &&
+           vt->top_margin <= vt->btm_margin);
+
+    pop_first_grid_row(vt, grid);
+}
+
+static int
+get_ansi_param(struct parser* p, int idx, int default_value)
+{
+    if (idx < p->params_len)
+        return (p->params[idx] != 0) ? p->params[idx] : default_value;
+    return default_value;
+}
+
+static inline bool
+is_ansi_subparam(struct parser* p, int idx)
+{
+    return idx < p->params_len && (p->subparams & (1u << idx));
+}
+
+static struct color
+parse_ansi_color(struct parser* p, int* i)
+{
+    int* params = p->params;
+
+    if (*i >= p->params_len)
+        return COLOR_FOREGROUND;
+
+    switch (params[*i]) {
+        case 5:
+            (*i)++;
+            if (*i >= p->params_len)
+                break;
+
+            // 0-15
+            if (params[*i] < 16) {
+                return SYSTEM_COLORS[params[*i]];
+            }
+
+            // 16-231
+            if (params[*i] < 232) {
+                uint8_t idx = params[*i] - 16;
+
+                uint8_t red_idx = idx / 36;
+                uint8_t green_idx = (idx % 36) / 6;
+                uint8_t blue_idx = idx % 6;
+
+                uint8_t red = 0, green = 0, blue = 0;
+                if (red_idx != 0)
+                    red = red_idx * 40 + 55;
+                if (green_idx != 0)
+                    green = green_idx * 40 + 55;
+                if (blue_idx != 0)
+                    blue = blue_idx * 40 + 55;
+
+                return (struct color){ red, green, blue, 255 };
+            }
+
+            // 232-255
+            uint8_t code = params[*i];
+            uint8_t g = (code - 232) * 10 + 8;
+            return (struct color){ g, g, g, 255 };
+            break;
+        case 2: {
+            // 38:2:<colorspace>:r:g:b, the colorspace id is ignored
+            int sub = 0;
+            while (is_ansi_subparam(p, *i + 1 + sub))
+                sub++;
+            if (sub >= 4)
+                (*i)++;
+
+            if (*i + 3 >= p->params_len) {
+                *i = p->params_len - 1;
+                break;
+            }
+
+            (*i)++;
+
+            uint8_t r = params[(*i)++];
+            uint8_t g = params[(*i)++];
+            uint8_t b = params[(*i)];
+
+            return (struct color){ r, g, b, 255 };
+            break;
+        }
+    }
+
+    return COLOR_FOREGROUND;
+}
+
+static int
+get_last_non_empty_cell_idx(struct row* r)
+{
+    for (size_t i = 0; i < r->len; i++)
+        if (r->cells[i].ch == 0)
+            return (int)i - 1; // last non empty, 0 means empty
+    return (int)r->len - 1;
+}
+
+static void
+carriage_return(cursor* cur)
+{
+    cur->p.x = 0;
+    cur->lcf = false;
+}
+
+static void
+linefeed(struct vt* vt, cursor* cur, struct row** grid)
+{
+    if (cur->p.y == vt->btm_margin)
+        scroll(vt, grid);
+    else if (cur->p.y < vt->rows - 1)
+        cur->p.y++;
+
+    cur->lcf = false;
+}
+
+static void
+csi_dispatch_sgr(struct parser* p)
+{
+    struct attributes* attrs = &p->attrs;
+    int* params = p->params;
+
+    for (int i = 0; i < p->params_len; i++) {
+        switch (params[i]) {
+            case 0:
+                *attrs = (struct attributes)DEFAULT_ATTRS;
+                break;
+
+            // BOLD
+            case 1:
+                attrs->bold = true;
+                break;
+            case 22:
+                attrs->bold = false;
+                break;
+
+            // INVERSE
+            case 7:
+                attrs->inverse = true;
+                break;
+            case 27:
+                attrs->inverse = false;
+                break;
+
+            // UNDERLINE
+            case 4:
+                // 4:0 turns it off, other styles are drawn as single
+                attrs->underline =
+                  !(is_ansi_subparam(p, i + 1) && params[i + 1] == 0);
+                break;
+            case 24:
+                attrs->underline = false;
+                break;
+
+            // FOREGROUND COLORS
+            case 30:
+            case 31:
+            case 32:
+            case 33:
+            case 34:
+            case 35:
+            case 36:
+            case 37:
+                attrs->fg = SYSTEM_COLORS[params[i] - 30];
+                break;
+            case 38:
+                i++;
+                attrs->fg = parse_ansi_color(p, &i);
+                break;
+            case 39:
+                attrs->fg = COLOR_FOREGROUND;
+                break;
+            case 90:
+            case 91:
+            case 92:
+            case 93:
+            case 94:
+            case 95:
+            case 96:
+            case 97:
+                attrs->fg = SYSTEM_COLORS[(params[i] - 90) + 8];
+                break;
+
+            // BACKGROUND COLORS
+            case 40:
+            case 41:
+            case 42:
+            case 43:
+            case 44:
+            case 45:
+            case 46:
+            case 47:
+                attrs->bg = SYSTEM_COLORS[params[i] - 40];
+                break;
+            case 48:
+                i++;
+                attrs->bg = parse_ansi_color(p, &i);
+                break;
+            case 49:
+                attrs->bg = COLOR_BACKGROUND;
+                break;
+            case 100:
+            case 101:
+            case 102:
+            case 103:
+            case 104:
+            case 105:
+            case 106:
+            case 107:
+                attrs->bg = SYSTEM_COLORS[(params[i] - 100) + 8];
+                break;
+
+            default:
+                UNSUPPORTED(p, "No support for ANSI SGR: %d", params[i]);
+                break;
+        }
+
+        // skip subparameters we didn't consume
+        while (is_ansi_subparam(p, i + 1))
+            i++;
+    }
+}
+
+static void
+csi_dispatch(struct vt* vt, uint8_t final)
+{
+    struct parser* p = &vt->parser;
+    struct attributes* attrs = &p->attrs;
+    cursor* cur = get_cursor(vt);
+    struct row** grid = get_grid(vt);
+    int* params = p->params;
+
+    // no parameters is the same as a single default one
+    if (p->params_len == 0) {
+        p->params[0] = 0;
+        p->params_len = 1;
+    }
+
+#ifdef HOOKTTY_LOGCSI
+    HOG("CSI: %c%.*s%c",
+        p->private_marker ? p->private_marker : ' ',
+        p->intermediates_len,
+        p->intermediates,
+        final);
+    for (int i = 0; i < p->params_len; i++) {
+        HOG("p: %d%s", params[i], is_ansi_subparam(p, i) ? " (sub)" : "");
+    }
+    HOG("");
+#endif
+
+    if (p->intermediates_len || p->intermediates_overflow) {
+        UNSUPPORTED(p,
+                    "No support for ANSI CSI with intermediates: %.*s%c",
+                    p->intermediates_len,
+                    p->intermediates,
+                    final);
+        return;
+    }
+
+    // private parameters are only known for DECSET/DECRST
+    if (p->private_marker &&
+        !(p->private_marker == '?' &&
+          (final == ANSI_FINAL_DECSET || final == ANSI_FINAL_DECRST))) {
+        UNSUPPORTED(p,
+                    "No support for private ANSI CSI: %c%c",
+                    p->private_marker,
+                    final);
+        return;
+    }
+
+    // match final byte
+    switch (final) {
+        case ANSI_FINAL_SGR:
+            csi_dispatch_sgr(p);
+            break;
+
+        case ANSI_FINAL_CUU: {
+            uint16_t n = (params[0]) ? params[0] : 1;
+            if (cur->p.y >= n)
+                cur->p.y -= n;
+            else
+                cur->p.y = 0;
+
+            cur->lcf = false;
+            break;
+        }
+        case ANSI_FINAL_CUD: {
+            uint16_t n = (params[0]) ? params[0] : 1;
+            if (cur->p.y + n < vt->rows)
+                cur->p.y += n;
+            else
+                cur->p.y = vt->rows - 1;
+
+            cur->lcf = false;
+            break;
+        }
+        case ANSI_FINAL_CUF: {
+            uint16_t n = (params[0]) ? params[0] : 1;
+            if (cur->p.x + n < vt->cols)
+                cur->p.x += n;
+            else
+                cur->p.x = vt->cols - 1;
+
+            cur->lcf = false;
+            break;
+        }
+        case ANSI_FINAL_CUB: {
+            uint16_t n = (params[0]) ? params[0] : 1;
+            if (cur->p.x >= n)
+                cur->p.x -= n;
+            else
+                cur->p.x = 0;
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_CHA: {
+            int len = grid[cur->p.y]->len;
+
+            cur->p.x = min(max(get_ansi_param(p, 0, 1), 1), len) - 1;
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_VPA:
+            cur->p.y = min(max(get_ansi_param(p, 0, 1), 1), vt->rows) - 1;
+            break;
+
+        case ANSI_FINAL_EL:
+            switch (params[0]) {
+                case 0: // clear from cur to eol
+                    for (size_t i = cur->p.x; i < grid[cur->p.y]->len; i++)
+                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
+                    break;
+                case 1: // clear from cur to bol
+                    for (int i = cur->p.x; i >= 0; i--)
+                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
+                    break;
+                case 2: // clear line
+                    for (size_t i = 0; i < grid[cur->p.y]->len; i++)
+                        erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
+                    break;
+            }
+
+            cur->lcf = false;
+            break;
+
+        case ANSI_FINAL_DCH: {
+            int n = (params[0]) ? params[0] : 1;
+
+            for (int i = cur->p.x;
+                 grid[cur->p.y]->cells[i].ch != 0 && i < vt->cols;
+                 i++) {
+
+                if ((size_t)(i + n) > grid[cur->p.y]->len) {
+                    erase_cell(&grid[cur->p.y]->cells[i], 0, attrs->bg);
+                    continue;
+                }
+
+                grid[cur->p.y]->cells[i] = grid[cur->p.y]->cells[i + n];
+            }
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_ICH: {
+            int n = (params[0]) ? params[0] : 1;
+
+            for (int i = get_last_non_empty_cell_idx(grid[cur->p.y]);
+                 i >= cur->p.x;
+                 i--) {
+
+                if ((size_t)(i + n) > grid[cur->p.y]->len) {
+                    erase_cell(&grid[cur->p.y]->cells[i], 0, attrs->bg);
+                } else {
+                    grid[cur->p.y]->cells[i + n] = grid[cur->p.y]->cells[i];
+                }
+
+                if (cur->p.x + n >= i)
+                    erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
+            }
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_ECH: {
+            int n = (params[0]) ? params[0] : 1;
+
+            for (int i = cur->p.x; i < cur->p.x + n && i < vt->cols; i++) {
+                erase_cell(&grid[cur->p.y]->cells[i], ' ', attrs->bg);
+            }
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_HVP:
+        case ANSI_FINAL_CUP: {
+            cur->p.y = min(max(get_ansi_param(p, 0, 1), 1), vt->rows) - 1;
+
+            int len = grid[cur->p.y]->len;
+            cur->p.x = min(max(get_ansi_param(p, 1, 1), 1), len) - 1;
+
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_ED: // TODO do better
+            switch (params[0]) {
+                case 0:
+                    for (int i = cur->p.y; i < vt->rows; i++)
+                        for (size_t j = cur->p.x; j < grid[i]->len; j++)
+                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
+                    break;
+                case 1:
+                    for (int i = cur->p.y; i >= 0; i--)
+                        for (int j = cur->p.x; j >= 0; j--)
+                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
+                    break;
+                case 2:
+                    for (int i = 0; i < vt->rows; i++)
+                        for (size_t j = 0; j < grid[i]->len; j++)
+                            erase_cell(&grid[i]->cells[j], ' ', attrs->bg);
+                    break;
+            }
+
+            cur->lcf = false;
+            break;
+
+        case ANSI_FINAL_DECSET:
+            if (p->private_marker != '?') {
+                UNSUPPORTED(p, "unsupported ansi SM: %d", params[0]);
+                break;
+            }
+
+            for (int i = 0; i < p->params_len; i++)
+                switch (params[i]) {
+                    case 1049:
+                        vt->alt_screen = true;
+                        for (int i = 0; i < vt->rows; i++)
+                            for (size_t j = 0; j < vt->alt_grid[i]->len; j++)
+                                erase_cell(&vt->alt_grid[i]->cells[j],
+                                           ' ',
+                                           attrs->bg);
+                        break;
+                    default:
+                        UNSUPPORTED(
+                          p, "unsupported ansi DECSET: %d", params[i]);
+                        break;
+                }
+            break;
+
+        case ANSI_FINAL_DECRST:
+            if (p->private_marker != '?') {
+                UNSUPPORTED(p, "unsupported ansi RM: %d", params[0]);
+                break;
+            }
+
+            for (int i = 0; i < p->params_len; i++)
+                switch (params[i]) {
+                    case 1049:
+                        vt->alt_screen = false;
+                        vt->alt_cursor = (cursor){ (point){ 0, 0 }, false };
+                        break;
+                    default:
+                        UNSUPPORTED(
+                          p, "unsupported ansi DECRST: %d", params[i]);
+                        break;
+                }
+            break;
+
+        case ANSI_FINAL_DA:
+            if (vt->listener && vt->listener->write)
+                vt->listener->write(
+                  vt->data, ANSI_DA_RESP, strlen(ANSI_DA_RESP));
+            break;
+
+        case ANSI_FINAL_DECSTBM: {
+            int top = max(get_ansi_param(p, 0, 1), 1) - 1;
+            int btm = min(get_ansi_param(p, 1, vt->rows), vt->rows) - 1;
+
+            // a region of less than two rows is ignored, like xterm does
+            if (top >= btm)
+                break;
+
+            vt->top_margin = top;
+            vt->btm_margin = btm;
+
+            HOG("margin: %d, %d", vt->top_margin, vt->btm_margin);
+
+            cur->p.y = 0;
+            cur->p.x = 0;
+            cur->lcf = false;
+            break;
+        }
+
+        case ANSI_FINAL_SU:
+            for (int i = 0; i < min(get_ansi_param(p, 0, 1), vt->btm_margin);
+                 i++)
+                scroll(vt, grid);
+            break;
+
+        default:
+            UNSUPPORTED(p, "No support for ANSI final byte: %c", final);
+            break;
+    }
+}
+
+static void
+esc_dispatch(struct vt* vt, uint8_t final)
+{
+    struct parser* p = &vt->parser;
+    cursor* cur = get_cursor(vt);
+
+    if (p->intermediates_len || p->intermediates_overflow) {
+        // character set designation, only the default set is supported
+        if (p->intermediates[0] >= '(' && p->intermediates[0] <= '+')
+            return;
+
+        UNSUPPORTED(p,
+                    "unsuported ansi: %.*s%c",
+                    p->intermediates_len,
+                    p->intermediates,
+                    final);
+        return;
+    }
+
+    switch (final) {
+        case ANSI_C1_RI: // TODO: implement scroll down ?
+            if (cur->p.y)
+                cur->p.y--;
+
+            cur->lcf = false;
+            break;
+        case ANSI_ST: // the string it terminates was already dispatched
+            break;
+        default:
+            UNSUPPORTED(p, "unsuported ansi: %c(%d)", final, final);
+            break;
+    }
+}
+
+static void
+osc_dispatch(struct vt* vt)
+{
+    // TODO: window title, colors, ... for now OSC strings are dropped
+    (void)vt;
+}
+
+static void
+dcs_hook(struct vt* vt, uint8_t final)
+{
+    UNSUPPORTED(&vt->parser, "unsupported ansi DCS: %c", final);
+}
+
+/* reusing an row after the screen has been resized */
+static inline struct row*
+get_row_for_write(struct vt* vt, struct row** grid, uint16_t y)
+{
+    if (grid[y]->len != vt->cols) {
+        free_row(grid[y]);
+        grid[y] = init_row(vt->cols);
+    }
+
+    return grid[y];
+}
+
+static void
+print_char(struct vt* vt, char32_t ch)
+{
+    cursor* cur = get_cursor(vt);
+    struct row** grid = get_grid(vt);
+
+    assert(cur->p.y < vt->rows);
+    assert(cur->p.x < vt->cols);
+
+    // the previous char was written to the last column, wrap now
+    if (cur->lcf) {
+        cur->p.x = 0;
+        linefeed(vt, cur, grid);
+    }
+
+    struct row* row = get_row_for_write(vt, grid, cur->p.y);
+    struct cell* cell = &row->cells[cur->p.x];
+    cell->ch = ch;
+    cell->attrs = vt->parser.attrs;
+
+    if (cur->p.x == vt->cols - 1)
+        cur->lcf = true;
+    else
+        cur->p.x++;
+}
+
+// writes a run of printable ascii, same as calling print_char() for each
+static void
+print_ascii(struct vt* vt, const char* s, size_t n)
+{
+    cursor* cur = get_cursor(vt);
+    struct row** grid = get_grid(vt);
+    struct cell c = { 0, vt->parser.attrs };
+
+    while (n) {
+        if (cur->lcf) {
+            cur->p.x = 0;
+            linefeed(vt, cur, grid);
+        }
+
+        struct cell* cells = get_row_for_write(vt, grid, cur->p.y)->cells;
+        size_t len = min(n, (size_t)(vt->cols - cur->p.x));
+
+        for (size_t i = 0; i < len; i++) {
+            c.ch = (uint8_t)s[i];
+            cells[cur->p.x + i] = c;
+        }
+
+        cur->p.x += len;
+        if (cur->p.x == vt->cols) {
+            cur->p.x = vt->cols - 1;
+            cur->lcf = true;
+        }
+
+        s += len;
+        n -= len;
+    }
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2"))) static size_t
+printable_ascii_len_avx2(const char* s, size_t n)
+{
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+
+        // signed compare, bytes >= 0x80 are negative so < 0x20 too
+        __m256i ctl = _mm256_cmpgt_epi8(space, v);
+        __m256i bad = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, del));
+
+        uint32_t mask = _mm256_movemask_epi8(bad);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    for (; i < n; i++)
+        if ((uint8_t)s[i] < 0x20 || (uint8_t)s[i] > 0x7e)
+            break;
+    return i;
+}
+#endif
+
+static size_t
+printable_ascii_len_sse2(const char* s, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+
+        // signed compare, bytes >= 0x80 are negative so < 0x20 too
+        __m128i ctl = _mm_cmpgt_epi8(space, v);
+        __m128i bad = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, del));
+
+        uint32_t mask = _mm_movemask_epi8(bad);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < n; i++)
+        if ((uint8_t)s[i] < 0x20 || (uint8_t)s[i] > 0x7e)
+            break;
+    return i;
+}
+
+// length of the run of 0x20-0x7e bytes at the start of `s`
+static size_t
+printable_ascii_len(const char* s, size_t n)
+{
+#ifdef __x86_64__
+    static int has_avx2 = -1;
+    if (has_avx2 == -1)
+        has_avx2 = __builtin_cpu_supports("avx2");
+
+    if (has_avx2)
+        return printable_ascii_len_avx2(s, n);
+#endif
+    return printable_ascii_len_sse2(s, n);
+}
+
+// a sequence cut off by a control or ascii char is a single invalid subpart
+static void
+flush_utf8(struct vt* vt)
+{
+    if (vt->parser.utf8_state == UTF8_ACCEPT)
+        return;
+
+    vt->parser.utf8_state = UTF8_ACCEPT;
+    print_char(vt, UTF8_REPLACEMENT_CHAR);
+}
+
+static void
+print(struct vt* vt, uint8_t b)
+{
+    struct parser* p = &vt->parser;
+    uint32_t prev = p->utf8_state;
+
+    switch (utf8_decode(&p->utf8_state, &p->utf8_cp, b)) {
+        case UTF8_ACCEPT:
+            print_char(vt, p->utf8_cp);
+            break;
+        case UTF8_REJECT:
+            p->utf8_state = UTF8_ACCEPT;
+            print_char(vt, UTF8_REPLACEMENT_CHAR);
+
+            // the byte that broke the sequence can start a new one
+            if (prev != UTF8_ACCEPT)
+                print(vt, b);
+            break;
+    }
+}
+
+static void
+execute(struct vt* vt, uint8_t b)
+{
+    cursor* cur = get_cursor(vt);
+
+    flush_utf8(vt);
+
+    switch (b) {
+        case '\r':
+            carriage_return(cur);
+            break;
+        case '\n':
+        case '\v':
+        case '\f':
+            linefeed(vt, cur, get_grid(vt));
+            break;
+        case '\b':
+            if (cur->p.x)
+                cur->p.x--;
+            cur->lcf = false;
+            break;
+        case '\t':
+            cur->p.x = min((cur->p.x / 8 + 1) * 8, vt->cols - 1);
+            break;
+        default: // BEL, SO, SI, ...
+            break;
+    }
+}
+
+/*
+ * VT500 style parser state machine, based on
+ * https://vt100.net/emu/dec_ansi_parser
+ *
+ * Each entry holds the action for the byte in the high nibble and the next
+ * state in the low one (STATE_STAY if the byte doesn't change the state).
+ * Bytes >= 0x80 are utf-8, there are no 8-bit C1 controls.
+ */
+enum parser_action
+{
+    ACTION_NONE,
+    ACTION_PRINT,
+    ACTION_EXECUTE,
+    ACTION_COLLECT,
+    ACTION_PARAM,
+    ACTION_ESC_DISPATCH,
+    ACTION_CSI_DISPATCH,
+    ACTION_OSC_PUT,
+};
+
+#define T(action, vt) (uint8_t)((ACTION_##action << 4) | STATE_##vt)
+
+#define C0_EXECUTE                                                             \
+    [0x00 ... 0x17] = T(EXECUTE, STAY), [0x19] = T(EXECUTE, STAY),             \
+    [0x1c ... 0x1f] = T(EXECUTE, STAY)
+
+#define C0_IGNORE                                                              \
+    [0x00 ... 0x17] = T(NONE, STAY), [0x19] = T(NONE, STAY),                   \
+    [0x1c ... 0x1f] = T(NONE, STAY)
+
+#define ANYWHERE                                                               \
+    [0x18] = T(EXECUTE, GROUND), [0x1a] = T(EXECUTE, GROUND),                  \
+    [0x1b] = T(NONE, ESCAPE)
+
+static const uint8_t parser_table[STATE_COUNT][256] = {
+    [STATE_GROUND] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x7e] = T(PRINT, STAY),
+        [0x7f] = T(NONE, STAY),
+        [0x80 ... 0xff] = T(PRINT, STAY),
+    },
+    [STATE_ESCAPE] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, ESCAPE_INTERMEDIATE),
+        [0x30 ... 0x4f] = T(ESC_DISPATCH, GROUND),
+        [0x50] = T(NONE, DCS_ENTRY),
+        [0x51 ... 0x57] = T(ESC_DISPATCH, GROUND),
+        [0x58] = T(NONE, SOS_PM_APC_STRING),
+        [0x59 ... 0x5a] = T(ESC_DISPATCH, GROUND),
+        [0x5b] = T(NONE, CSI_ENTRY),
+        [0x5c] = T(ESC_DISPATCH, GROUND),
+        [0x5d] = T(NONE, OSC_STRING),
+        [0x5e ... 0x5f] = T(NONE, SOS_PM_APC_STRING),
+        [0x60 ... 0x7e] = T(ESC_DISPATCH, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_ESCAPE_INTERMEDIATE] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, STAY),
+        [0x30 ... 0x7e] = T(ESC_DISPATCH, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_CSI_ENTRY] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, CSI_INTERMEDIATE),
+        [0x30 ... 0x3b] = T(PARAM, CSI_PARAM),
+        [0x3c ... 0x3f] = T(COLLECT, CSI_PARAM),
+        [0x40 ... 0x7e] = T(CSI_DISPATCH, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_CSI_PARAM] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, CSI_INTERMEDIATE),
+        [0x30 ... 0x3b] = T(PARAM, STAY),
+        [0x3c ... 0x3f] = T(NONE, CSI_IGNORE),
+        [0x40 ... 0x7e] = T(CSI_DISPATCH, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_CSI_INTERMEDIATE] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, STAY),
+        [0x30 ... 0x3f] = T(NONE, CSI_IGNORE),
+        [0x40 ... 0x7e] = T(CSI_DISPATCH, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_CSI_IGNORE] = {
+        C0_EXECUTE, ANYWHERE,
+        [0x20 ... 0x3f] = T(NONE, STAY),
+        [0x40 ... 0x7e] = T(NONE, GROUND),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_DCS_ENTRY] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, DCS_INTERMEDIATE),
+        [0x30 ... 0x3b] = T(PARAM, DCS_PARAM),
+        [0x3c ... 0x3f] = T(COLLECT, DCS_PARAM),
+        [0x40 ... 0x7e] = T(NONE, DCS_PASSTHROUGH),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_DCS_PARAM] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, DCS_INTERMEDIATE),
+        [0x30 ... 0x3b] = T(PARAM, STAY),
+        [0x3c ... 0x3f] = T(NONE, DCS_IGNORE),
+        [0x40 ... 0x7e] = T(NONE, DCS_PASSTHROUGH),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_DCS_INTERMEDIATE] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0x2f] = T(COLLECT, STAY),
+        [0x30 ... 0x3f] = T(NONE, DCS_IGNORE),
+        [0x40 ... 0x7e] = T(NONE, DCS_PASSTHROUGH),
+        [0x7f ... 0xff] = T(NONE, STAY),
+    },
+    // no DCS is supported, the payload is dropped
+    [STATE_DCS_PASSTHROUGH] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_DCS_IGNORE] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0xff] = T(NONE, STAY),
+    },
+    [STATE_OSC_STRING] = {
+        ANYWHERE,
+        [0x00 ... 0x06] = T(NONE, STAY),
+        [0x07] = T(NONE, GROUND), // xterm allows BEL as the terminator
+        [0x08 ... 0x17] = T(NONE, STAY),
+        [0x19] = T(NONE, STAY),
+        [0x1c ... 0x1f] = T(NONE, STAY),
+        [0x20 ... 0xff] = T(OSC_PUT, STAY),
+    },
+    [STATE_SOS_PM_APC_STRING] = {
+        C0_IGNORE, ANYWHERE,
+        [0x20 ... 0xff] = T(NONE, STAY),
+    },
+};
+
+#undef T
+#undef C0_EXECUTE
+#undef C0_IGNORE
+#undef ANYWHERE
+
+static void
+parser_clear(struct parser* p)
+{
+    p->params[0] = 0;
+    p->params_len = 0;
+    p->params_overflow = false;
+    p->subparams = 0;
+    p->private_marker = 0;
+    p->intermediates_len = 0;
+    p->intermediates_overflow = false;
+}
+
+static void
+parser_collect(struct parser* p, uint8_t b)
+{
+    // only reachable from the entry states
+    if (b >= 0x3c && b <= 0x3f) {
+        p->private_marker = b;
+        return;
+    }
+
+    if (p->intermediates_len == PARSER_MAX_INTERMEDIATES) {
+        p->intermediates_overflow = true;
+        return;
+    }
+
+    p->intermediates[p->intermediates_len++] = b;
+}
+
+static void
+parser_param(struct parser* p, uint8_t b)
+{
+    if (p->params_len == 0)
+        p->params_len = 1;
+
+    if (b == ';' || b == ':') {
+        if (p->params_len == ANSI_MAX_NUM_PARAMS) {
+            p->params_overflow = true;
+            return;
+        }
+
+        if (b == ':')
+            p->subparams |= 1u << p->params_len;
+
+        p->params[p->params_len++] = 0;
+        return;
+    }
+
+    // extra parameters are ignored
+    if (p->params_overflow)
+        return;
+
+    int* v = &p->params[p->params_len - 1];
+    *v = min(*v * 10 + (b - '0'), UINT16_MAX);
+}
+
+static void
+parser_osc_put(struct parser* p, uint8_t b)
+{
+    if (p->osc_len < sizeof(p->osc) - 1)
+        p->osc[p->osc_len++] = b;
+}
+
+static void
+parser_enter(struct vt* vt, uint8_t s, uint8_t b)
+{
+    switch (s) {
+        case STATE_ESCAPE:
+        case STATE_CSI_ENTRY:
+        case STATE_DCS_ENTRY:
+            parser_clear(&vt->parser);
+            break;
+        case STATE_OSC_STRING:
+            vt->parser.osc_len = 0;
+            break;
+        case STATE_DCS_PASSTHROUGH:
+            PROFILE_DISPATCH(vt, VT_PROFILE_DCS, b, dcs_hook(vt, b));
+            break;
+    }
+}
+
+static void
+parser_exit(struct vt* vt, uint8_t s)
+{
+    switch (s) {
+        case STATE_GROUND:
+            flush_utf8(vt);
+            break;
+        case STATE_OSC_STRING:
+            vt->parser.osc[vt->parser.osc_len] = '\0';
+            PROFILE_DISPATCH(vt, VT_PROFILE_OSC, 0, osc_dispatch(vt));
+            break;
+    }
+}
+
+static inline void
+parser_do_action(struct vt* vt, uint8_t action, uint8_t b)
+{
+    switch (action) {
+        case ACTION_PRINT:
+            print(vt, b);
+            break;
+        case ACTION_EXECUTE:
+            PROFILE_DISPATCH(vt, VT_PROFILE_C0, b, execute(vt, b));
+            break;
+        case ACTION_COLLECT:
+            parser_collect(&vt->parser, b);
+            break;
+        case ACTION_PARAM:
+            parser_param(&vt->parser, b);
+            break;
+        case ACTION_ESC_DISPATCH:
+            PROFILE_DISPATCH(vt, VT_PROFILE_ESC, b, esc_dispatch(vt, b));
+            break;
+        case ACTION_CSI_DISPATCH:
+            PROFILE_DISPATCH(vt, VT_PROFILE_CSI, b, csi_dispatch(vt, b));
+            break;
+        case ACTION_OSC_PUT:
+            parser_osc_put(&vt->parser, b);
+            break;
+    }
+}
+
+void
+vt_parse(struct vt* vt, const char* buf, size_t n)
+{
+    assert(vt->grid != NULL);
+    assert(vt->alt_grid != NULL);
+    assert(vt->cursor.p.x < vt->cols);
+    assert(vt->cursor.p.y < vt->rows);
+
+    struct parser* p = &vt->parser;
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t b = buf[i];
+
+        // fast path for plain text
+        if (p->state == STATE_GROUND && b >= 0x20 && b < 0x7f) {
+            size_t len = printable_ascii_len(buf + i, n - i);
+
+            flush_utf8(vt);
+            print_ascii(vt, buf + i, len);
+
+            if (vt->profile)
+                vt->profile->text_bytes += len;
+
+            i += len - 1;
+            continue;
+        }
+
+        uint8_t t = parser_table[p->state][b];
+        uint8_t action = t >> 4;
+        uint8_t next = t & 0x0f;
+
+        if (vt->profile) {
+            if (action == ACTION_PRINT)
+                vt->profile->text_bytes++;
+            else
+                vt->profile->control_bytes++;
+        }
+
+        if (next == STATE_STAY) {
+            parser_do_action(vt, action, b);
+            continue;
+        }
+
+        parser_exit(vt, p->state);
+        parser_do_action(vt, action, b);
+        parser_enter(vt, next, b);
+
+        p->state = next;
+    }
+}
+
+struct vt*
+vt_new(uint16_t rows,
+       uint16_t cols,
+       const struct vt_listener* listener,
+       void* data)
+{
+    struct vt* vt = calloc(1, sizeof(*vt));
+    assert(vt != NULL);
+
+    vt->rows = rows;
+    vt->cols = cols;
+    vt->top_margin = 0;
+    vt->btm_margin = rows - 1;
+
+    vt->grid = init_grid(rows, cols);
+    vt->alt_grid = init_grid(rows, cols);
+    vt->alt_screen = false;
+
+    vt->cursor = (cursor){ (point){ 0, 0 }, false };
+    vt->alt_cursor = (cursor){ (point){ 0, 0 }, false };
+
+    vt->parser = (struct parser){ .attrs = DEFAULT_ATTRS,
+                                  .state = STATE_GROUND };
+
+    vt->listener = listener;
+    vt->data = data;
+
+    return vt;
+}
+
+void
+vt_free(struct vt* vt)
+{
+    free_grid(vt->grid, vt->rows);
+    free_grid(vt->alt_grid, vt->rows);
+    mem_free(MEM_DIAG, vt->profile);
+    free(vt);
+}
+
+void
+vt_profile_enable(struct vt* vt)
+{
+    if (vt->profile != NULL)
+        return;
+
+    vt->profile = mem_calloc(MEM_DIAG, 1, sizeof(*vt->profile));
+    assert(vt->profile != NULL);
+}
+
+// cut or padded with empty cells, every row is `cols` wide so the
+// sequences can trust `len`
+static void
+resize_row(struct row* row, uint16_t cols)
+{
+    if (row->len == cols)
+        return;
+
+    struct cell* cells =
+      mem_realloc(MEM_GRID, row->cells, cols * sizeof(*row->cells));
+    assert(cells != NULL);
+
+    struct attributes attrs = DEFAULT_ATTRS;
+    for (size_t i = row->len; i < cols; i++)
+        cells[i] = (struct cell){ .ch = 0, .attrs = attrs };
+
+    row->cells = cells;
+    row->len = cols;
+}
+
+// keeps the cursor row on screen, rows above it go first
+static void
+resize_screen(struct row*** grid,
+              cursor* cur,
+              uint16_t old_rows,
+              uint16_t rows,
+              uint16_t cols)
+{
+    if (rows > old_rows)
+        grow_grid(grid, old_rows, rows, cols);
+
+    if (rows < old_rows) {
+        uint16_t top = (cur->p.y >= rows) ? cur->p.y - rows + 1 : 0;
+
+        shrink_grid(grid, old_rows, rows, top);
+        cur->p.y -= top;
+    }
+
+    for (int i = 0; i < rows; i++)
+        resize_row((*grid)[i], cols);
+
+    if (cur->p.x >= cols) {
+        cur->p.x = cols - 1;
+        cur->lcf = false;
+    }
+}
+
+bool
+vt_resize(struct vt* vt, uint16_t rows, uint16_t cols)
+{
+    if (rows == 0 || cols == 0)
+        return false;
+    if (rows == vt->rows && cols == vt->cols)
+        return true;
+
+    resize_screen(&vt->grid, &vt->cursor, vt->rows, rows, cols);
+    resize_screen(&vt->alt_grid, &vt->alt_cursor, vt->rows, rows, cols);
+
+    vt->rows = rows;
+    vt->cols = cols;
+
+    vt->top_margin = 0;
+    vt->btm_margin = rows - 1;
+    return true;
+}
+
+struct cursor*
+vt_cursor(struct vt* vt)
+{
+    return get_cursor(vt);
+}
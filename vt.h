@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uchar.h>
+
+#include "ansi.h"
+#include "vt-profile.h"
+
+/*
+ * Terminal model: the grid, cursors and the escape sequence parser, without
+ * anything about windows, fonts or the pty. Bytes from the host go in with
+ * vt_parse(), what the terminal has to say back comes out through the
+ * `vt_listener` callbacks. Nothing here locks, the frontend serializes the
+ * calls.
+ */
+
+// #define HOOKTTY_LOGCSI
+
+#define COLOR_BACKGROUND_ALPHA 0.8
+
+struct color
+{
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+    unsigned char a;
+};
+
+struct attributes
+{
+    struct color fg;
+    struct color bg;
+    bool underline;
+    bool inverse;
+    bool bold;
+};
+
+static const struct color COLOR_BACKGROUND = {
+    25, 25, 25, (unsigned char)(255 * COLOR_BACKGROUND_ALPHA)
+};
+static const struct color COLOR_FOREGROUND = { 255, 255, 255, 255 };
+static const struct attributes DEFAULT_ATTRS = {
+    COLOR_FOREGROUND, COLOR_BACKGROUND, false, false, false,
+};
+
+struct cell
+{
+    char32_t ch;
+    struct attributes attrs;
+};
+
+struct row
+{
+    struct cell* cells;
+    // `cols` of the vt, vt_resize() resizes every row
+    size_t len;
+};
+
+typedef struct point
+{
+    uint16_t x;
+    uint16_t y;
+} point;
+
+typedef struct cursor
+{
+    point p;
+    bool lcf; // https://github.com/mattiase/wraptest
+} cursor;
+
+// copy of the visible grid the renderer paints from
+struct snapshot
+{
+    struct cell* cells; // rows * cols
+    size_t cap;
+
+    uint16_t rows;
+    uint16_t cols;
+
+    struct cursor cursor;
+};
+
+enum parser_state
+{
+    STATE_GROUND,
+    STATE_ESCAPE,
+    STATE_ESCAPE_INTERMEDIATE,
+    STATE_CSI_ENTRY,
+    STATE_CSI_PARAM,
+    STATE_CSI_INTERMEDIATE,
+    STATE_CSI_IGNORE,
+    STATE_DCS_ENTRY,
+    STATE_DCS_PARAM,
+    STATE_DCS_INTERMEDIATE,
+    STATE_DCS_PASSTHROUGH,
+    STATE_DCS_IGNORE,
+    STATE_OSC_STRING,
+    STATE_SOS_PM_APC_STRING,
+
+    STATE_COUNT,
+    STATE_STAY = 0x0f,
+};
+
+#define PARSER_MAX_INTERMEDIATES 2
+#define PARSER_MAX_OSC_LEN 512
+
+struct parser
+{
+    struct attributes attrs;
+
+    uint8_t state;
+
+    int params[ANSI_MAX_NUM_PARAMS];
+    uint8_t params_len;
+    bool params_overflow;
+    // bit i is set when params[i] was separated by `:`
+    uint32_t subparams;
+
+    char private_marker;
+    char intermediates[PARSER_MAX_INTERMEDIATES];
+    uint8_t intermediates_len;
+    bool intermediates_overflow;
+
+    char osc[PARSER_MAX_OSC_LEN];
+    size_t osc_len;
+
+    // utf-8 decoder, sequences can be cut off between reads
+    uint32_t utf8_state;
+    char32_t utf8_cp;
+
+    // set by a dispatch that hit something it doesn't support
+    bool unsupported;
+};
+
+struct vt_listener
+{
+    // bytes for the host, replies to queries like DA
+    void (*write)(void* data, const char* buf, size_t n);
+};
+
+struct vt
+{
+    struct row** grid; // size == rows
+    struct row** alt_grid;
+    bool alt_screen;
+
+    uint16_t top_margin;
+    uint16_t btm_margin;
+
+    uint16_t rows;
+    uint16_t cols;
+
+    struct cursor cursor;
+    struct cursor alt_cursor;
+
+    struct parser parser;
+
+    const struct vt_listener* listener;
+    void* data;
+
+    // NULL unless vt_profile_enable() was called
+    struct vt_profile* profile;
+};
+
+struct vt*
+vt_new(uint16_t rows,
+       uint16_t cols,
+       const struct vt_listener* listener,
+       void* data);
+
+void
+vt_free(struct vt* vt);
+
+// starts counting dispatched sequences in `vt->profile`, see vt-profile.h
+void
+vt_profile_enable(struct vt* vt);
+
+// feeds `n` bytes to the parser, sequences cut off at the end of `buf`
+// are continued on the next call
+void
+vt_parse(struct vt* vt, const char* buf, size_t n);
+
+// resets the scroll region, rows and columns that don't fit anymore are
+// dropped. False for 0 rows or columns, the vt is left as it is
+bool
+vt_resize(struct vt* vt, uint16_t rows, uint16_t cols);
+
+// the cursor of the active screen
+struct cursor*
+vt_cursor(struct vt* vt);
+
+// copies the visible grid into `snap`, growing it if needed
+void
+vt_snapshot(struct vt* vt, struct snapshot* snap);
@@ -38,7 +38,7 @@ handle_xdg_toplevel_configure(void* data,
         state->width = width;
         state->height = height;
         state->window_resized = true;
-        state->needs_redraw = true;
+        atomic_store(&state->needs_redraw, true);
     }
 }
 
@@ -57,9 +57,14 @@ handle_xdg_surface_configure(void* data,
     struct state* state = data;
 
     xdg_surface_ack_configure(surface, serial);
+    startup_mark(&state->startup.configure);
 
     if (state->buff1 == NULL || state->buff2 == NULL) {
-        new_buffers(state);
+        // only this window closes, the others of a server go on
+        if (!new_buffers(state)) {
+            state->keep_running = false;
+            return;
+        }
         update_grid(state);
 
         state->frame_callback = wl_surface_frame(state->surface);